@@ -0,0 +1,219 @@
+#include "aes.hpp"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define AES_NI_SUPPORTED
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AES_NI_TARGET
+#else
+#include <cpuid.h>
+// Allow the intrinsics without compiling the whole program for AES-NI
+#define AES_NI_TARGET __attribute__((target("aes,sse2")))
+#endif
+#endif
+
+namespace
+{
+struct AES_TABLES
+{
+    AES_TABLES() {
+        // Walk the multiplicative group by the generator 3 and its inverse
+        uint32_t p = 1;
+        uint32_t q = 1;
+        do {
+            p = (p ^ (p << 1) ^ (p & 0x80 ? 0x1b : 0)) & 0xff;
+            q ^= q << 1;
+            q ^= q << 2;
+            q ^= q << 4;
+            q &= 0xff;
+            if (q & 0x80) {
+                q ^= 0x09;
+            }
+            uint32_t x = q ^ (q << 1) ^ (q << 2) ^ (q << 3) ^ (q << 4);
+            sbox[p] = static_cast<uint8_t>((x ^ (x >> 8) ^ 0x63) & 0xff);
+        }
+        while (p != 1);
+        sbox[0] = 0x63;
+
+        for (int i = 0; i < 256; ++i) {
+            uint32_t s = sbox[i];
+            uint32_t s2 = ((s << 1) ^ (s & 0x80 ? 0x1b : 0)) & 0xff;
+            te[i] = (s2 << 24) | (s << 16) | (s << 8) | (s2 ^ s);
+        }
+    }
+    uint8_t sbox[256];
+    // Combined SubBytes and MixColumns for the first row, rotated for the others
+    uint32_t te[256];
+};
+
+const AES_TABLES &GetTables()
+{
+    static const AES_TABLES tables;
+    return tables;
+}
+
+inline uint32_t LoadWord(const uint8_t *p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+inline void StoreWord(uint8_t *p, uint32_t n)
+{
+    p[0] = static_cast<uint8_t>(n >> 24);
+    p[1] = static_cast<uint8_t>(n >> 16);
+    p[2] = static_cast<uint8_t>(n >> 8);
+    p[3] = static_cast<uint8_t>(n);
+}
+
+inline uint32_t Ror(uint32_t n, int bits)
+{
+    return (n >> bits) | (n << (32 - bits));
+}
+
+bool IsAesNiSupported()
+{
+#ifdef AES_NI_SUPPORTED
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 25)) != 0;
+#else
+    unsigned int a, b, c, d;
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & (1U << 25));
+#endif
+#else
+    return false;
+#endif
+}
+}
+
+CAes128::CAes128()
+    : m_aesNi(IsAesNiSupported())
+    , m_roundKeys()
+    , m_roundKeyWords()
+{
+}
+
+void CAes128::SetKey(const uint8_t *key)
+{
+    const AES_TABLES &t = GetTables();
+    std::copy(key, key + 16, m_roundKeys);
+    uint8_t rcon = 1;
+    for (int i = 16; i < 176; i += 4) {
+        uint8_t w[4] = {m_roundKeys[i - 4], m_roundKeys[i - 3], m_roundKeys[i - 2], m_roundKeys[i - 1]};
+        if (i % 16 == 0) {
+            // RotWord, SubWord and Rcon
+            uint8_t w0 = w[0];
+            w[0] = t.sbox[w[1]] ^ rcon;
+            w[1] = t.sbox[w[2]];
+            w[2] = t.sbox[w[3]];
+            w[3] = t.sbox[w0];
+            rcon = static_cast<uint8_t>((rcon << 1) ^ (rcon & 0x80 ? 0x1b : 0));
+        }
+        for (int j = 0; j < 4; ++j) {
+            m_roundKeys[i + j] = m_roundKeys[i + j - 16] ^ w[j];
+        }
+    }
+    for (int i = 0; i < 44; ++i) {
+        m_roundKeyWords[i] = LoadWord(&m_roundKeys[i * 4]);
+    }
+}
+
+void CAes128::EncryptCbc(uint8_t *data, size_t blockNum, uint8_t *iv) const
+{
+    if (m_aesNi) {
+        EncryptCbcAesNi(data, blockNum, iv);
+    }
+    else {
+        EncryptCbcPortable(data, blockNum, iv);
+    }
+}
+
+void CAes128::EncryptPattern(uint8_t *data, size_t size, int cryptBlocks, int skipBlocks, const uint8_t *iv) const
+{
+    uint8_t chain[16];
+    std::copy(iv, iv + 16, chain);
+    size_t blockNum = size / 16;
+    if (cryptBlocks == 0 && skipBlocks == 0) {
+        EncryptCbc(data, blockNum, chain);
+        return;
+    }
+    for (size_t i = 0; i < blockNum; i += cryptBlocks + skipBlocks) {
+        EncryptCbc(data + i * 16, std::min<size_t>(cryptBlocks, blockNum - i), chain);
+    }
+}
+
+void CAes128::SetAesNiEnabled(bool enabled)
+{
+    m_aesNi = enabled && IsAesNiSupported();
+}
+
+void CAes128::EncryptCbcPortable(uint8_t *data, size_t blockNum, uint8_t *iv) const
+{
+    const AES_TABLES &t = GetTables();
+    const uint32_t *rk = m_roundKeyWords;
+    uint32_t c0 = LoadWord(iv);
+    uint32_t c1 = LoadWord(iv + 4);
+    uint32_t c2 = LoadWord(iv + 8);
+    uint32_t c3 = LoadWord(iv + 12);
+    for (size_t i = 0; i < blockNum; ++i, data += 16) {
+        uint32_t s0 = LoadWord(data) ^ c0 ^ rk[0];
+        uint32_t s1 = LoadWord(data + 4) ^ c1 ^ rk[1];
+        uint32_t s2 = LoadWord(data + 8) ^ c2 ^ rk[2];
+        uint32_t s3 = LoadWord(data + 12) ^ c3 ^ rk[3];
+        for (int r = 1; r < 10; ++r) {
+            uint32_t t0 = t.te[s0 >> 24] ^ Ror(t.te[(s1 >> 16) & 0xff], 8) ^ Ror(t.te[(s2 >> 8) & 0xff], 16) ^ Ror(t.te[s3 & 0xff], 24) ^ rk[r * 4];
+            uint32_t t1 = t.te[s1 >> 24] ^ Ror(t.te[(s2 >> 16) & 0xff], 8) ^ Ror(t.te[(s3 >> 8) & 0xff], 16) ^ Ror(t.te[s0 & 0xff], 24) ^ rk[r * 4 + 1];
+            uint32_t t2 = t.te[s2 >> 24] ^ Ror(t.te[(s3 >> 16) & 0xff], 8) ^ Ror(t.te[(s0 >> 8) & 0xff], 16) ^ Ror(t.te[s1 & 0xff], 24) ^ rk[r * 4 + 2];
+            uint32_t t3 = t.te[s3 >> 24] ^ Ror(t.te[(s0 >> 16) & 0xff], 8) ^ Ror(t.te[(s1 >> 8) & 0xff], 16) ^ Ror(t.te[s2 & 0xff], 24) ^ rk[r * 4 + 3];
+            s0 = t0;
+            s1 = t1;
+            s2 = t2;
+            s3 = t3;
+        }
+        // The last round has no MixColumns
+        c0 = ((static_cast<uint32_t>(t.sbox[s0 >> 24]) << 24) | (t.sbox[(s1 >> 16) & 0xff] << 16) | (t.sbox[(s2 >> 8) & 0xff] << 8) | t.sbox[s3 & 0xff]) ^ rk[40];
+        c1 = ((static_cast<uint32_t>(t.sbox[s1 >> 24]) << 24) | (t.sbox[(s2 >> 16) & 0xff] << 16) | (t.sbox[(s3 >> 8) & 0xff] << 8) | t.sbox[s0 & 0xff]) ^ rk[41];
+        c2 = ((static_cast<uint32_t>(t.sbox[s2 >> 24]) << 24) | (t.sbox[(s3 >> 16) & 0xff] << 16) | (t.sbox[(s0 >> 8) & 0xff] << 8) | t.sbox[s1 & 0xff]) ^ rk[42];
+        c3 = ((static_cast<uint32_t>(t.sbox[s3 >> 24]) << 24) | (t.sbox[(s0 >> 16) & 0xff] << 16) | (t.sbox[(s1 >> 8) & 0xff] << 8) | t.sbox[s2 & 0xff]) ^ rk[43];
+        StoreWord(data, c0);
+        StoreWord(data + 4, c1);
+        StoreWord(data + 8, c2);
+        StoreWord(data + 12, c3);
+    }
+    StoreWord(iv, c0);
+    StoreWord(iv + 4, c1);
+    StoreWord(iv + 8, c2);
+    StoreWord(iv + 12, c3);
+}
+
+#ifdef AES_NI_SUPPORTED
+AES_NI_TARGET
+void CAes128::EncryptCbcAesNi(uint8_t *data, size_t blockNum, uint8_t *iv) const
+{
+    __m128i rk[11];
+    for (int i = 0; i < 11; ++i) {
+        rk[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(m_roundKeys + i * 16));
+    }
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iv));
+    for (size_t i = 0; i < blockNum; ++i, data += 16) {
+        c = _mm_xor_si128(c, _mm_loadu_si128(reinterpret_cast<const __m128i *>(data)));
+        c = _mm_xor_si128(c, rk[0]);
+        for (int r = 1; r < 10; ++r) {
+            c = _mm_aesenc_si128(c, rk[r]);
+        }
+        c = _mm_aesenclast_si128(c, rk[10]);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(data), c);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(iv), c);
+}
+#else
+void CAes128::EncryptCbcAesNi(uint8_t *data, size_t blockNum, uint8_t *iv) const
+{
+    // Never selected
+    EncryptCbcPortable(data, blockNum, iv);
+}
+#endif
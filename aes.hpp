@@ -0,0 +1,34 @@
+#ifndef INCLUDE_AES_HPP
+#define INCLUDE_AES_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+// AES-128 encryption in CBC mode, using AES-NI if the CPU supports it.
+class CAes128
+{
+public:
+    CAes128();
+    // "key" is 16 bytes
+    void SetKey(const uint8_t *key);
+    // Encrypt "blockNum" blocks of 16 bytes in place. "iv" (16 bytes) is updated to chain the following blocks.
+    void EncryptCbc(uint8_t *data, size_t blockNum, uint8_t *iv) const;
+    // Encrypt in place in the pattern of the CENC "cbcs" scheme: the first "cryptBlocks" of every "cryptBlocks + skipBlocks"
+    // blocks are chained from "iv", and the others are left clear. If both are 0, all blocks are encrypted.
+    // The trailing partial block is always left clear.
+    void EncryptPattern(uint8_t *data, size_t size, int cryptBlocks, int skipBlocks, const uint8_t *iv) const;
+    // AES-NI is enabled by default if supported. Disabling it selects the portable implementation.
+    void SetAesNiEnabled(bool enabled);
+    bool IsAesNiEnabled() const { return m_aesNi; }
+
+private:
+    void EncryptCbcPortable(uint8_t *data, size_t blockNum, uint8_t *iv) const;
+    void EncryptCbcAesNi(uint8_t *data, size_t blockNum, uint8_t *iv) const;
+
+    bool m_aesNi;
+    // Expanded key as bytes (for AES-NI) and as big-endian words
+    uint8_t m_roundKeys[176];
+    uint32_t m_roundKeyWords[44];
+};
+
+#endif
@@ -0,0 +1,211 @@
+#include "mp4fragmenter.hpp"
+#include "segmenter.hpp"
+#include "tsgen.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <vector>
+
+namespace
+{
+std::atomic<uint64_t> g_allocCount(0);
+std::atomic<uint64_t> g_allocBytes(0);
+
+int64_t GetNsecTick()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct BENCH_RESULT
+{
+    int64_t elapsedNsec;
+    uint64_t allocCount;
+    uint64_t allocBytes;
+    size_t segNum;
+    size_t cutNum;
+    size_t outputBytes;
+    // Time from reading the packet that triggered the cut to the end of the processing of the cut
+    std::vector<int64_t> cutLatencyNsec;
+};
+
+// Segment "ts" in the same way as the pipe mode of tsmemseg, without pipes.
+// "measureLatency" takes a timestamp on every read, which slightly affects the throughput.
+BENCH_RESULT RunSegmentation(const std::vector<uint8_t> &ts, bool isMp4, bool measureLatency)
+{
+    BENCH_RESULT result = {};
+    result.cutLatencyNsec.reserve(ts.size() / 188);
+    CMp4Fragmenter mp4frag;
+    unsigned int syncError = 0;
+    CUT_POSITION cutPos;
+    size_t readPos = 0;
+    int64_t readTick = 0;
+
+    auto readInput = [&](uint8_t *buf, size_t len) -> size_t {
+        if (measureLatency) {
+            // Packet by packet, so that the latency is measured from the triggering packet
+            len = std::min<size_t>(len, 188);
+        }
+        size_t n = std::min(len, ts.size() - readPos);
+        memcpy(buf, ts.data() + readPos, n);
+        readPos += n;
+        if (measureLatency) {
+            readTick = GetNsecTick();
+        }
+        return n;
+    };
+
+    uint64_t allocCount = g_allocCount;
+    uint64_t allocBytes = g_allocBytes;
+    int64_t beginTick = GetNsecTick();
+    ProcessSegmentation(readInput, isMp4, false, 2000, 2000, 500, 0, 4096 * 1024, 4096 * 1024, syncError, cutPos, nullptr, nullptr,
+        [&](bool isKey, bool forceSegment, bool isChunk, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets) -> bool
+    {
+        static_cast<void>(ptsDiff);
+        if (isMp4) {
+            mp4frag.AddPackets(packets, pmt, !isKey && forceSegment, isChunk);
+            result.outputBytes += mp4frag.GetFragments().size();
+            mp4frag.ClearFragments();
+        }
+        else {
+            result.outputBytes += packets.size();
+        }
+        if (isKey || forceSegment) {
+            ++result.segNum;
+        }
+        ++result.cutNum;
+        if (measureLatency) {
+            result.cutLatencyNsec.push_back(GetNsecTick() - readTick);
+        }
+        return false;
+    });
+    result.elapsedNsec = std::max<int64_t>(GetNsecTick() - beginTick, 1);
+    result.allocCount = g_allocCount - allocCount;
+    result.allocBytes = g_allocBytes - allocBytes;
+    return result;
+}
+
+double GetPercentileUsec(const std::vector<int64_t> &sorted, int percent)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() * percent / 100, sorted.size() - 1)] / 1000.0;
+}
+}
+
+void *operator new(size_t size)
+{
+    g_allocCount.fetch_add(1, std::memory_order_relaxed);
+    g_allocBytes.fetch_add(size, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+int main(int argc, char **argv)
+{
+    int durationSec = 60;
+    int repeatNum = 3;
+    TSGEN_PARAMS params = {};
+    params.frameRate = 30;
+    params.gopFrames = 30;
+    params.videoKbps = 6000;
+    params.audio = true;
+    params.id3 = true;
+    params.extraPidNum = 4;
+    params.seed = 1;
+
+    for (int i = 1; i < argc; ++i) {
+        char c = argv[i][0] == '-' && argv[i][1] && !argv[i][2] ? argv[i][1] : '\0';
+        bool invalid = c == '\0';
+        if (c == 'h') {
+            fprintf(stderr, "Usage: tsmemseg_bench [-t duration][-n repeat][-g gop_frames][-b video_kbps][-x extra_pids]\n");
+            return 2;
+        }
+        else if (c != '\0' && i < argc - 1) {
+            int n = static_cast<int>(strtol(argv[++i], nullptr, 10));
+            if (c == 't') {
+                durationSec = n;
+                invalid = n <= 0 || n > 3600;
+            }
+            else if (c == 'n') {
+                repeatNum = n;
+                invalid = n <= 0;
+            }
+            else if (c == 'g') {
+                params.gopFrames = n;
+                invalid = n <= 0;
+            }
+            else if (c == 'b') {
+                params.videoKbps = n;
+                invalid = n <= 0 || n > 200000;
+            }
+            else if (c == 'x') {
+                params.extraPidNum = n;
+                invalid = n < 0 || n > 100;
+            }
+            else {
+                invalid = true;
+            }
+        }
+        else {
+            invalid = true;
+        }
+        if (invalid) {
+            fprintf(stderr, "Error: argument %d is invalid.\n", i);
+            return 1;
+        }
+    }
+
+    for (int codec = 0; codec < 2; ++codec) {
+        params.h265 = codec != 0;
+        std::vector<uint8_t> ts;
+        GenerateTs(params, durationSec * 1000, ts);
+        printf("%s: %d sec, %.1f MB, gop %d frames, %d kbps, %d extra PIDs\n", params.h265 ? "hevc" : "avc",
+               durationSec, ts.size() / 1000000.0, params.gopFrames, params.videoKbps, params.extraPidNum);
+
+        for (int isMp4 = 0; isMp4 < 2; ++isMp4) {
+            // Best of "repeatNum"
+            BENCH_RESULT best = {};
+            for (int i = 0; i < repeatNum; ++i) {
+                BENCH_RESULT result = RunSegmentation(ts, isMp4 != 0, false);
+                if (i == 0 || result.elapsedNsec < best.elapsedNsec) {
+                    best = std::move(result);
+                }
+            }
+            BENCH_RESULT latency = RunSegmentation(ts, isMp4 != 0, true);
+            std::sort(latency.cutLatencyNsec.begin(), latency.cutLatencyNsec.end());
+
+            double sec = best.elapsedNsec / 1000000000.0;
+            printf("  %-3s %8.1f MB/s %7.2f Mpackets/s, %llu segments, %llu cuts, %.1f MB out, %llu allocs (%.1f per cut, %.1f MB)\n",
+                   isMp4 ? "mp4" : "ts", ts.size() / 1000000.0 / sec, ts.size() / 188 / 1000000.0 / sec,
+                   static_cast<unsigned long long>(best.segNum), static_cast<unsigned long long>(best.cutNum), best.outputBytes / 1000000.0, static_cast<unsigned long long>(best.allocCount),
+                   best.cutNum ? static_cast<double>(best.allocCount) / best.cutNum : 0.0, best.allocBytes / 1000000.0);
+            printf("      cut latency usec: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+                   GetPercentileUsec(latency.cutLatencyNsec, 50), GetPercentileUsec(latency.cutLatencyNsec, 90),
+                   GetPercentileUsec(latency.cutLatencyNsec, 99), GetPercentileUsec(latency.cutLatencyNsec, 100));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include "libtsmemseg.hpp"
+#include <algorithm>
+
+CEmbeddedSegmenter::CEmbeddedSegmenter(const EMBEDDED_SEGMENTER_PARAMS &params)
+    : m_isMp4(params.isMp4)
+    , m_segmenter(params.isMp4, params.filterPids, params.initDurationMsec, params.targetDurationMsec, params.targetFragDurationMsec,
+                  params.chunkFrames, params.segMaxBytes, params.segMaxBytes, nullptr)
+    , m_headerNotified(false)
+    , m_headerVersion(0)
+    , m_segCount(0)
+    , m_partIndex(0)
+    , m_partContinues(false)
+    , m_segPartsDurationMsec(0)
+    , m_segHeaderVersion(0)
+    , m_durationMsecResidual(0)
+    , m_splitPtsDiff(0)
+{
+    m_segmenter.SetOnSegmentOrFragment([this](bool isKey, bool forceSegment, bool isChunk, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets) -> bool {
+        return OnSegmentOrFragment(isKey, forceSegment, isChunk, ptsDiff, pmt, packets);
+    });
+}
+
+bool CEmbeddedSegmenter::OnSegmentOrFragment(bool isKey, bool forceSegment, bool isChunk, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets)
+{
+    ptsDiff -= m_splitPtsDiff;
+    if (m_isMp4) {
+        m_mp4frag.AddPackets(packets, pmt, !isKey && forceSegment, isChunk);
+        if (m_headerNotified && m_mp4frag.GetHeaderVersion() == m_headerVersion && m_mp4frag.GetHeader() != m_header) {
+            // Parameter sets are added to the tables without changing the version, notified before the parts using them
+            m_header = m_mp4frag.GetHeader();
+            if (m_onHeader) {
+                m_onHeader(m_header.data(), m_header.size(), m_headerVersion);
+            }
+        }
+        // More than one fragment may be added (e.g. the last one before a header change and the first one after it)
+        const std::vector<size_t> &fragSizes = m_mp4frag.GetFragmentSizes();
+        const std::vector<uint32_t> &versions = m_mp4frag.GetFragmentHeaderVersions();
+        size_t fragOffset = 0;
+        for (size_t i = 0; i < fragSizes.size(); ++i) {
+            if (!m_headerNotified || versions[i] != m_headerVersion) {
+                if (!m_segment.empty()) {
+                    // Each segment depends on a single header version, so a header change closes the segment
+                    int64_t partPtsDiff = std::min<int64_t>(static_cast<int64_t>(m_segPartsDurationMsec) * 90, ptsDiff);
+                    EndSegment(partPtsDiff, false);
+                    ptsDiff -= partPtsDiff;
+                    m_splitPtsDiff += partPtsDiff;
+                }
+                m_headerNotified = true;
+                m_headerVersion = versions[i];
+                m_header = m_mp4frag.GetHeader();
+                if (m_onHeader) {
+                    m_onHeader(m_header.data(), m_header.size(), m_headerVersion);
+                }
+            }
+            // Only the last fragment can be continued by the next chunk
+            AddPart(m_mp4frag.GetFragments().data() + fragOffset, fragSizes[i], m_mp4frag.GetFragmentDurationsMsec()[i],
+                    isChunk && i + 1 == fragSizes.size(), versions[i]);
+            fragOffset += fragSizes[i];
+        }
+        m_mp4frag.ClearFragments();
+    }
+    else {
+        AddPart(packets.data(), packets.size(), static_cast<int>(ptsDiff / 90) - m_segPartsDurationMsec, isChunk, 0);
+    }
+    if (isKey || forceSegment) {
+        EndSegment(ptsDiff, !isKey);
+        m_splitPtsDiff = 0;
+    }
+    return false;
+}
+
+void CEmbeddedSegmenter::AddPart(const uint8_t *data, size_t size, int durationMsec, bool continues, uint32_t headerVersion)
+{
+    if (size == 0) {
+        return;
+    }
+    if (m_segment.empty()) {
+        ++m_segCount;
+        m_partIndex = 0;
+        m_segPartsDurationMsec = 0;
+    }
+    else if (!m_partContinues) {
+        ++m_partIndex;
+    }
+    m_segment.insert(m_segment.end(), data, data + size);
+    m_segPartsDurationMsec += durationMsec;
+    m_segHeaderVersion = headerVersion;
+    m_partContinues = continues;
+
+    if (m_onPart) {
+        EMBEDDED_SEGMENTER_PART part;
+        part.segCount = m_segCount;
+        part.partIndex = m_partIndex;
+        part.continues = continues;
+        part.durationMsec = durationMsec;
+        part.headerVersion = headerVersion;
+        part.data = data;
+        part.size = size;
+        m_onPart(part);
+    }
+}
+
+void CEmbeddedSegmenter::EndSegment(int64_t segPtsDiff, bool forced)
+{
+    if (m_segment.empty()) {
+        // Nothing has been output yet (e.g. the MP4 header is not determined)
+        return;
+    }
+    if (m_onSegment) {
+        EMBEDDED_SEGMENTER_SEGMENT seg;
+        seg.segCount = m_segCount;
+        seg.durationMsec = static_cast<int>((segPtsDiff + m_durationMsecResidual) / 90);
+        seg.forced = forced;
+        seg.headerVersion = m_segHeaderVersion;
+        seg.data = m_segment.data();
+        seg.size = m_segment.size();
+        m_onSegment(seg);
+    }
+    m_durationMsecResidual = (segPtsDiff + m_durationMsecResidual) % 90;
+    m_segment.clear();
+    m_partContinues = false;
+}
@@ -0,0 +1,114 @@
+#ifndef INCLUDE_LIBTSMEMSEG_HPP
+#define INCLUDE_LIBTSMEMSEG_HPP
+
+#include "mp4fragmenter.hpp"
+#include "segmenter.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+struct EMBEDDED_SEGMENTER_PARAMS
+{
+    // Same defaults as the tool
+    EMBEDDED_SEGMENTER_PARAMS()
+        : isMp4(false)
+        , filterPids(false)
+        , initDurationMsec(1000)
+        , targetDurationMsec(2000)
+        , targetFragDurationMsec(500)
+        , chunkFrames(0)
+        , segMaxBytes(4096 * 1024) {}
+    // Convert to fragmented MP4 (-4)
+    bool isMp4;
+    // Strip packets not used by clients (-F)
+    bool filterPids;
+    // Duration of the initial segment (-i) and the others (-t)
+    uint32_t initDurationMsec;
+    uint32_t targetDurationMsec;
+    // Target duration of parts, which are MP4 fragments (-p)
+    uint32_t targetFragDurationMsec;
+    // Publish chunks every "chunkFrames" frames (-u)
+    uint32_t chunkFrames;
+    // Cut a segment forcibly when it exceeds this size (-m)
+    size_t segMaxBytes;
+};
+
+// A piece of the output published as soon as it is cut: an MP4 fragment, a chunk of it, or MPEG-TS packets of a segment
+struct EMBEDDED_SEGMENTER_PART
+{
+    // Sequential number of the segment containing this part, starting from 1
+    uint32_t segCount;
+    // Index of the part in the segment, starting from 0. Chunks of the same fragment have the same index.
+    uint32_t partIndex;
+    // Whether the next part is a chunk continuing the same fragment
+    bool continues;
+    int durationMsec;
+    // Version of the MP4 header this part depends on (MP4 only)
+    uint32_t headerVersion;
+    const uint8_t *data;
+    size_t size;
+};
+
+// A completed segment, which is the concatenation of its parts
+struct EMBEDDED_SEGMENTER_SEGMENT
+{
+    uint32_t segCount;
+    int durationMsec;
+    // Whether the segment was cut on a non-key packet because of "segMaxBytes"
+    bool forced;
+    uint32_t headerVersion;
+    const uint8_t *data;
+    size_t size;
+};
+
+// Segmenter for embedding in other programs, working like the tool without pipes.
+// TS packets are pushed in chunks of any size, and the output is delivered to the callbacks synchronously.
+// Data pointed to by the callback arguments are valid only during the callback.
+class CEmbeddedSegmenter
+{
+public:
+    explicit CEmbeddedSegmenter(const EMBEDDED_SEGMENTER_PARAMS &params);
+    // Called with the MP4 header box (ftyp/moov) and its version before the first part depending on it. A change of the
+    // version closes the current segment, and is a discontinuity. Called again with the same version when parameter sets
+    // with new IDs are added to the header, which then replaces the previous one.
+    void SetOnHeader(const std::function<void (const uint8_t *, size_t, uint32_t)> &onHeader) { m_onHeader = onHeader; }
+    void SetOnPart(const std::function<void (const EMBEDDED_SEGMENTER_PART &)> &onPart) { m_onPart = onPart; }
+    void SetOnSegment(const std::function<void (const EMBEDDED_SEGMENTER_SEGMENT &)> &onSegment) { m_onSegment = onSegment; }
+    // For the options of the MP4 conversion (SetInbandParameterSets(), SetEncryptionKey(), etc.)
+    CMp4Fragmenter &GetMp4Fragmenter() { return m_mp4frag; }
+    // Process the input. Like the tool, the packets after the last cut are not output at the end of the input.
+    void Push(const uint8_t *data, size_t size) { m_segmenter.Push(data, size); }
+    unsigned int GetSyncErrorCount() const { return m_segmenter.GetSyncErrorCount(); }
+    unsigned int GetWarningCount() const { return m_mp4frag.GetWarningCount(); }
+    CEmbeddedSegmenter(const CEmbeddedSegmenter &) = delete;
+    CEmbeddedSegmenter &operator=(const CEmbeddedSegmenter &) = delete;
+
+private:
+    bool OnSegmentOrFragment(bool isKey, bool forceSegment, bool isChunk, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets);
+    void AddPart(const uint8_t *data, size_t size, int durationMsec, bool continues, uint32_t headerVersion);
+    void EndSegment(int64_t segPtsDiff, bool forced);
+
+    bool m_isMp4;
+    CSegmenter m_segmenter;
+    CMp4Fragmenter m_mp4frag;
+    std::function<void (const uint8_t *, size_t, uint32_t)> m_onHeader;
+    std::function<void (const EMBEDDED_SEGMENTER_PART &)> m_onPart;
+    std::function<void (const EMBEDDED_SEGMENTER_SEGMENT &)> m_onSegment;
+    // Header version notified, valid if (m_headerNotified)
+    bool m_headerNotified;
+    uint32_t m_headerVersion;
+    std::vector<uint8_t> m_header;
+    // Segment in progress
+    std::vector<uint8_t> m_segment;
+    uint32_t m_segCount;
+    uint32_t m_partIndex;
+    bool m_partContinues;
+    int m_segPartsDurationMsec;
+    uint32_t m_segHeaderVersion;
+    int64_t m_durationMsecResidual;
+    // Part of "ptsDiff" already used by a segment closed by a header change
+    int64_t m_splitPtsDiff;
+};
+
+#endif
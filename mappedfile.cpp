@@ -0,0 +1,259 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "mappedfile.hpp"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <thread>
+
+namespace
+{
+void ScanKeyFramesRange(const uint8_t *data, size_t size, size_t begin, size_t end, int keyPid, bool isVideo, bool h265,
+                        std::vector<KEY_FRAME_INDEX> &index)
+{
+    for (size_t pos = begin; pos < end; pos += 188) {
+        const uint8_t *packet = data + pos;
+        if (extract_ts_header_sync(packet) != 0x47 ||
+            extract_ts_header_pid(packet) != keyPid ||
+            !extract_ts_header_unit_start(packet)) {
+            continue;
+        }
+        int payloadSize = get_ts_payload_size(packet);
+        const uint8_t *payload = packet + 188 - payloadSize;
+        if (payloadSize < 14 || payload[0] != 0 || payload[1] != 0 || payload[2] != 1 || (payload[7] >> 6) < 2) {
+            continue;
+        }
+        KEY_FRAME_INDEX entry;
+        entry.pos = pos;
+        entry.pts = get_pes_timestamp(payload + 9);
+        if (!isVideo) {
+            // Always treat as key.
+            index.push_back(entry);
+            continue;
+        }
+
+        int nalState = 0;
+        int pesHeaderLength = payload[8];
+        bool isKey = 9 + pesHeaderLength < payloadSize &&
+                     contains_nal_idr_or_cra(&nalState, payload + 9 + pesHeaderLength, payloadSize - (9 + pesHeaderLength), h265);
+        // The PES may continue beyond the range
+        for (size_t i = pos + 188; !isKey && i < size; i += 188) {
+            const uint8_t *p = data + i;
+            if (extract_ts_header_sync(p) == 0x47 && extract_ts_header_pid(p) == keyPid) {
+                if (extract_ts_header_unit_start(p)) {
+                    break;
+                }
+                int n = get_ts_payload_size(p);
+                isKey = !!contains_nal_idr_or_cra(&nalState, p + 188 - n, n, h265);
+            }
+        }
+        if (isKey) {
+            index.push_back(entry);
+        }
+    }
+}
+}
+
+CMappedFile::CMappedFile()
+#ifdef _WIN32
+    : m_file(INVALID_HANDLE_VALUE)
+    , m_mapping(nullptr)
+#else
+    : m_fd(-1)
+#endif
+    , m_data(nullptr)
+    , m_size(0)
+{
+}
+
+CMappedFile::~CMappedFile()
+{
+    Close();
+}
+
+bool CMappedFile::Open(const char *path)
+{
+    Close();
+#ifdef _WIN32
+    m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER li;
+        if (GetFileSizeEx(m_file, &li) && li.QuadPart > 0 && static_cast<unsigned long long>(li.QuadPart) <= SIZE_MAX) {
+            m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (m_mapping) {
+                m_data = static_cast<uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+                if (m_data) {
+                    m_size = static_cast<size_t>(li.QuadPart);
+                    return true;
+                }
+            }
+        }
+    }
+#else
+    m_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (m_fd >= 0) {
+        struct stat st;
+        if (fstat(m_fd, &st) == 0 && st.st_size > 0 && static_cast<unsigned long long>(st.st_size) <= SIZE_MAX) {
+            void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, m_fd, 0);
+            if (p != MAP_FAILED) {
+                m_data = static_cast<uint8_t *>(p);
+                m_size = static_cast<size_t>(st.st_size);
+                return true;
+            }
+        }
+    }
+#endif
+    Close();
+    return false;
+}
+
+bool CMappedFile::Create(const char *path, size_t size)
+{
+    Close();
+#ifdef _WIN32
+    m_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, CREATE_ALWAYS,
+                         FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (m_file != INVALID_HANDLE_VALUE && size > 0) {
+        LARGE_INTEGER li;
+        li.QuadPart = size;
+        if (SetFilePointerEx(m_file, li, nullptr, FILE_BEGIN) && SetEndOfFile(m_file)) {
+            m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+            if (m_mapping) {
+                m_data = static_cast<uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, 0));
+                if (m_data) {
+                    m_size = size;
+                    return true;
+                }
+            }
+        }
+    }
+#else
+    m_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (m_fd >= 0) {
+        // The mapping keeps the storage alive
+        unlink(path);
+        if (size > 0 && static_cast<unsigned long long>(size) <= static_cast<unsigned long long>(std::numeric_limits<off_t>::max()) &&
+            ftruncate(m_fd, static_cast<off_t>(size)) == 0) {
+            void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+            if (p != MAP_FAILED) {
+                m_data = static_cast<uint8_t *>(p);
+                m_size = size;
+                return true;
+            }
+        }
+    }
+#endif
+    Close();
+    return false;
+}
+
+void CMappedFile::Close()
+{
+#ifdef _WIN32
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+    if (m_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_data) {
+        munmap(m_data, m_size);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
+bool ScanFirstPmt(const uint8_t *data, size_t size, std::vector<uint8_t> &psiPackets, PMT &pmt)
+{
+    PAT pat = {};
+    std::vector<uint8_t> pmtPackets;
+    psiPackets.clear();
+    for (size_t pos = 0; pos + 188 <= size && pat.first_pmt.version_number == 0; pos += 188) {
+        const uint8_t *packet = data + pos;
+        if (extract_ts_header_sync(packet) != 0x47) {
+            continue;
+        }
+        int unitStart = extract_ts_header_unit_start(packet);
+        int pid = extract_ts_header_pid(packet);
+        int counter = extract_ts_header_counter(packet);
+        int payloadSize = get_ts_payload_size(packet);
+        const uint8_t *payload = packet + 188 - payloadSize;
+        if (pid == 0) {
+            if (unitStart) {
+                psiPackets.clear();
+            }
+            psiPackets.insert(psiPackets.end(), packet, packet + 188);
+            extract_pat(&pat, payload, payloadSize, unitStart, counter);
+        }
+        else if (pid == pat.first_pmt.pmt_pid) {
+            if (unitStart) {
+                pmtPackets.clear();
+            }
+            pmtPackets.insert(pmtPackets.end(), packet, packet + 188);
+            extract_pmt(&pat.first_pmt, payload, payloadSize, unitStart, counter);
+        }
+    }
+    if (pat.first_pmt.version_number == 0) {
+        psiPackets.clear();
+        return false;
+    }
+    psiPackets.insert(psiPackets.end(), pmtPackets.begin(), pmtPackets.end());
+    pmt = pat.first_pmt;
+    return true;
+}
+
+bool ScanKeyFrames(const uint8_t *data, size_t size, size_t threadNum,
+                   std::vector<KEY_FRAME_INDEX> &index, std::vector<uint8_t> &psiPackets)
+{
+    index.clear();
+    size = size / 188 * 188;
+
+    PMT pmt;
+    if (!ScanFirstPmt(data, size, psiPackets, pmt)) {
+        return false;
+    }
+    bool isVideo = pmt.first_video_pid != 0 &&
+                   (pmt.first_video_stream_type == AVC_VIDEO || pmt.first_video_stream_type == H_265_VIDEO);
+    int keyPid = isVideo ? pmt.first_video_pid : pmt.first_audio_pid;
+    if (keyPid == 0) {
+        psiPackets.clear();
+        return false;
+    }
+
+    size_t packetNum = size / 188;
+    // Avoid splitting into too small ranges
+    threadNum = std::max<size_t>(std::min<size_t>(threadNum, packetNum / 4096), 1);
+    std::vector<std::vector<KEY_FRAME_INDEX>> results(threadNum);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadNum; ++i) {
+        threads.emplace_back(ScanKeyFramesRange, data, size, packetNum * i / threadNum * 188, packetNum * (i + 1) / threadNum * 188,
+                             keyPid, isVideo, pmt.first_video_stream_type == H_265_VIDEO, std::ref(results[i]));
+    }
+    ScanKeyFramesRange(data, size, 0, packetNum / threadNum * 188, keyPid, isVideo, pmt.first_video_stream_type == H_265_VIDEO, results[0]);
+    for (auto it = threads.begin(); it != threads.end(); ++it) {
+        it->join();
+    }
+    for (auto it = results.begin(); it != results.end(); ++it) {
+        index.insert(index.end(), it->begin(), it->end());
+    }
+    return true;
+}
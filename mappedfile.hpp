@@ -0,0 +1,51 @@
+#ifndef INCLUDE_MAPPEDFILE_HPP
+#define INCLUDE_MAPPEDFILE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "util.hpp"
+
+class CMappedFile
+{
+public:
+    CMappedFile();
+    ~CMappedFile();
+    bool Open(const char *path);
+    // Create a writable scratch file of "size" bytes, which is removed when closed (or immediately on POSIX).
+    bool Create(const char *path, size_t size);
+    void Close();
+    const uint8_t *Data() const { return m_data; }
+    // Writable only if created by Create()
+    uint8_t *Data() { return m_data; }
+    size_t Size() const { return m_size; }
+    CMappedFile(const CMappedFile &) = delete;
+    CMappedFile &operator=(const CMappedFile &) = delete;
+
+private:
+#ifdef _WIN32
+    void *m_file;
+    void *m_mapping;
+#else
+    int m_fd;
+#endif
+    uint8_t *m_data;
+    size_t m_size;
+};
+
+struct KEY_FRAME_INDEX
+{
+    // Position of the unit-start packet of the key PES
+    size_t pos;
+    int64_t pts;
+};
+
+// Find the first PMT. "psiPackets" receives the complete PAT and PMT packets, which should precede the stream when seeking.
+bool ScanFirstPmt(const uint8_t *data, size_t size, std::vector<uint8_t> &psiPackets, PMT &pmt);
+
+// Scan TS packets for key (NAL-IRAP) PES positions of the first video stream (or audio if there is no video).
+// "psiPackets" receives the same as ScanFirstPmt().
+bool ScanKeyFrames(const uint8_t *data, size_t size, size_t threadNum,
+                   std::vector<KEY_FRAME_INDEX> &index, std::vector<uint8_t> &psiPackets);
+
+#endif
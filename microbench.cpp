@@ -0,0 +1,346 @@
+#include "aes.hpp"
+#include "tsgen.hpp"
+#include "util.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace
+{
+// Results are accumulated here so that the measured code is not optimized out
+volatile uint32_t g_sink;
+
+int64_t GetNsecTick()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Run "op" repeatedly for at least "minNsec" a few times and report the best ns/op (and bytes/s if bytesPerOp != 0)
+template <class F>
+void RunBenchmark(const char *name, size_t bytesPerOp, F op)
+{
+    const int64_t minNsec = 100000000;
+    double bestNsecPerOp = 0;
+    for (int i = 0; i < 3; ++i) {
+        size_t opNum = 0;
+        int64_t beginTick = GetNsecTick();
+        int64_t elapsedNsec;
+        do {
+            for (int j = 0; j < 64; ++j) {
+                op();
+            }
+            opNum += 64;
+            elapsedNsec = GetNsecTick() - beginTick;
+        }
+        while (elapsedNsec < minNsec);
+        double nsecPerOp = static_cast<double>(elapsedNsec) / opNum;
+        if (i == 0 || nsecPerOp < bestNsecPerOp) {
+            bestNsecPerOp = nsecPerOp;
+        }
+    }
+    if (bytesPerOp) {
+        printf("%-46s %10.1f ns/op %10.1f MB/s\n", name, bestNsecPerOp, bytesPerOp / bestNsecPerOp * 1000);
+    }
+    else {
+        printf("%-46s %10.1f ns/op\n", name, bestNsecPerOp);
+    }
+}
+
+// Bitwise reference of calc_crc32()
+uint32_t CalcCrc32Reference(const uint8_t *data, int dataSize, uint32_t crc = 0xffffffff)
+{
+    for (int i = 0; i < dataSize; ++i) {
+        uint32_t c = ((crc >> 24) ^ data[i]) << 24;
+        for (int j = 0; j < 8; ++j) {
+            c = (c << 1) ^ (c & 0x80000000 ? 0x04c11db7 : 0);
+        }
+        crc = (crc << 8) ^ c;
+    }
+    return crc;
+}
+
+void PushRandomBytes(std::vector<uint8_t> &data, size_t size, uint32_t &state)
+{
+    for (size_t i = 0; i < size; ++i) {
+        state = state * 1664525 + 1013904223;
+        data.push_back(static_cast<uint8_t>(state >> 24));
+    }
+}
+
+void PutBits(std::vector<uint8_t> &data, size_t &pos, int n, uint32_t v)
+{
+    while (--n >= 0) {
+        if (pos / 8 >= data.size()) {
+            data.push_back(0);
+        }
+        data[pos / 8] |= ((v >> n) & 1) << (7 - pos % 8);
+        ++pos;
+    }
+}
+
+bool ValidateCrc32()
+{
+    uint32_t state = 1;
+    std::vector<uint8_t> data;
+    PushRandomBytes(data, 4096, state);
+    for (int size = 0; size <= 4096; size += size < 64 ? 1 : 61) {
+        for (int offset = 0; offset < 4; ++offset) {
+            int n = std::min(size, 4096 - offset);
+            if (calc_crc32(data.data() + offset, n) != CalcCrc32Reference(data.data() + offset, n) ||
+                calc_crc32(data.data() + offset, n, 0x12345678) != CalcCrc32Reference(data.data() + offset, n, 0x12345678)) {
+                fprintf(stderr, "Error: calc_crc32 mismatch (size=%d, offset=%d).\n", n, offset);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool ValidateAes()
+{
+    // FIPS-197 Appendix C.1
+    static const uint8_t KEY[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+    static const uint8_t CIPHER[16] = {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+    CAes128 aes;
+    aes.SetKey(KEY);
+    uint32_t state = 1;
+    std::vector<uint8_t> data;
+    PushRandomBytes(data, 4096, state);
+    std::vector<uint8_t> reference;
+    for (int aesNi = 0; aesNi < 2; ++aesNi) {
+        aes.SetAesNiEnabled(aesNi != 0);
+        if (aesNi && !aes.IsAesNiEnabled()) {
+            break;
+        }
+        uint8_t block[16];
+        for (int i = 0; i < 16; ++i) {
+            block[i] = static_cast<uint8_t>(i * 0x11);
+        }
+        uint8_t iv[16] = {};
+        aes.EncryptCbc(block, 1, iv);
+        if (memcmp(block, CIPHER, 16) || memcmp(iv, CIPHER, 16)) {
+            fprintf(stderr, "Error: CAes128 mismatch with the test vector (AES-NI=%d).\n", aesNi);
+            return false;
+        }
+        std::vector<uint8_t> cipher = data;
+        memset(iv, 0, 16);
+        aes.EncryptCbc(cipher.data(), cipher.size() / 16, iv);
+        if (aesNi && cipher != reference) {
+            fprintf(stderr, "Error: CAes128 AES-NI result mismatch with the portable one.\n");
+            return false;
+        }
+        reference = cipher;
+    }
+    return true;
+}
+
+bool ValidateUegBits(const std::vector<uint8_t> &data, const std::vector<int> &values)
+{
+    size_t pos = 0;
+    CBitReader br(data.data(), data.size());
+    for (auto it = values.begin(); it != values.end(); ++it) {
+        if (read_ueg_bits(data.data(), pos) != *it) {
+            fprintf(stderr, "Error: read_ueg_bits mismatch.\n");
+            return false;
+        }
+        if (static_cast<int>(br.ReadUeg()) != *it || br.GetPos() != pos) {
+            fprintf(stderr, "Error: CBitReader::ReadUeg mismatch.\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ValidateBitReader(const std::vector<uint8_t> &data)
+{
+    size_t pos = 0;
+    CBitReader br(data.data(), data.size() - 8);
+    for (int n = 0; pos + n <= (data.size() - 8) * 8; n = (n + 7) % 33) {
+        if (br.ReadBits(n) != static_cast<uint32_t>(read_bits(data.data(), pos, n)) || br.IsOverrun()) {
+            fprintf(stderr, "Error: CBitReader::ReadBits mismatch.\n");
+            return false;
+        }
+    }
+    br.ReadBits(32);
+    if (!br.IsOverrun()) {
+        fprintf(stderr, "Error: CBitReader overrun is not detected.\n");
+        return false;
+    }
+    return true;
+}
+
+void CollectPackets(const std::vector<uint8_t> &ts, int pid, std::vector<uint8_t> &packets)
+{
+    for (size_t i = 0; i + 188 <= ts.size(); i += 188) {
+        if (extract_ts_header_pid(&ts[i]) == pid) {
+            packets.insert(packets.end(), ts.begin() + i, ts.begin() + i + 188);
+        }
+    }
+}
+}
+
+int main()
+{
+    if (!ValidateCrc32()) {
+        return 1;
+    }
+    printf("calc_crc32: table-driven result matches the bitwise reference\n");
+    if (!ValidateAes()) {
+        return 1;
+    }
+    printf("CAes128: result matches the test vector\n");
+
+    TSGEN_PARAMS params = {};
+    params.frameRate = 30;
+    params.gopFrames = 30;
+    params.videoKbps = 6000;
+    params.audio = true;
+    params.id3 = true;
+    params.extraPidNum = 16;
+    params.seed = 1;
+    std::vector<uint8_t> ts;
+    GenerateTs(params, 2000, ts);
+    params.h265 = true;
+    std::vector<uint8_t> tsH265;
+    GenerateTs(params, 2000, tsH265);
+
+    // PSI sections of typical sizes
+    uint32_t state = 1;
+    std::vector<uint8_t> data;
+    PushRandomBytes(data, 4096, state);
+    RunBenchmark("calc_crc32 (32 bytes)", 32, [&]() { g_sink = g_sink + calc_crc32(data.data(), 32); });
+    RunBenchmark("calc_crc32 (1021 bytes)", 1021, [&]() { g_sink = g_sink + calc_crc32(data.data(), 1021); });
+    RunBenchmark("reference crc32 (1021 bytes)", 1021, [&]() { g_sink = g_sink + CalcCrc32Reference(data.data(), 1021); });
+
+    // Segment encryption (-K), and the 1:9 pattern of video samples
+    CAes128 aes;
+    aes.SetKey(data.data());
+    for (int aesNi = 0; aesNi < 2; ++aesNi) {
+        aes.SetAesNiEnabled(aesNi != 0);
+        if (aesNi && !aes.IsAesNiEnabled()) {
+            break;
+        }
+        std::vector<uint8_t> buf = data;
+        RunBenchmark(aesNi ? "CAes128::EncryptCbc (AES-NI, 4096 bytes)" : "CAes128::EncryptCbc (portable, 4096 bytes)", 4096, [&]() {
+            uint8_t iv[16] = {};
+            aes.EncryptCbc(buf.data(), 4096 / 16, iv);
+            g_sink = g_sink + buf[0];
+        });
+        RunBenchmark(aesNi ? "CAes128::EncryptPattern (AES-NI, 4096 bytes)" : "CAes128::EncryptPattern (portable, 4096 bytes)", 4096, [&]() {
+            uint8_t iv[16] = {};
+            aes.EncryptPattern(buf.data(), 4096, 1, 9, iv);
+            g_sink = g_sink + buf[0];
+        });
+    }
+
+    // PMT packets with 16 extra streams
+    std::vector<uint8_t> pmtPackets;
+    CollectPackets(ts, 0x1000, pmtPackets);
+    pmtPackets.resize(188);
+    RunBenchmark("extract_psi (PMT packet)", 188, [&]() {
+        PSI psi = {};
+        g_sink = g_sink + extract_psi(&psi, pmtPackets.data() + 188 - get_ts_payload_size(pmtPackets.data()),
+                                      get_ts_payload_size(pmtPackets.data()), 1, extract_ts_header_counter(pmtPackets.data()));
+    });
+    RunBenchmark("extract_pmt (PMT packet)", 188, [&]() {
+        PMT pmt = {};
+        extract_pmt(&pmt, pmtPackets.data() + 188 - get_ts_payload_size(pmtPackets.data()),
+                    get_ts_payload_size(pmtPackets.data()), 1, extract_ts_header_counter(pmtPackets.data()));
+        g_sink = g_sink + pmt.first_video_pid;
+    });
+
+    // Scan the whole video stream, mostly non-key frames
+    for (int h265 = 0; h265 < 2; ++h265) {
+        std::vector<uint8_t> videoPackets;
+        CollectPackets(h265 ? tsH265 : ts, 0x100, videoPackets);
+        // Each specialization, selected once as the segmenter does
+        int (*containsKeyPicture)(int *, const uint8_t *, int) = h265 ? contains_nal_idr_or_cra<true> : contains_nal_idr_or_cra<false>;
+        RunBenchmark(h265 ? "contains_nal_idr_or_cra<true> (HEVC packets)" : "contains_nal_idr_or_cra<false> (AVC packets)", videoPackets.size(), [&]() {
+            int nalState = 0;
+            for (size_t i = 0; i < videoPackets.size(); i += 188) {
+                const uint8_t *packet = videoPackets.data() + i;
+                int payloadSize = get_ts_payload_size(packet);
+                if (extract_ts_header_unit_start(packet)) {
+                    nalState = 0;
+                }
+                g_sink = g_sink + containsKeyPicture(&nalState, packet + 188 - payloadSize, payloadSize);
+            }
+        });
+    }
+
+    RunBenchmark("get_ts_payload_size (all packets)", ts.size(), [&]() {
+        int sum = 0;
+        for (size_t i = 0; i < ts.size(); i += 188) {
+            sum += get_ts_payload_size(ts.data() + i);
+        }
+        g_sink = g_sink + sum;
+    });
+
+    // Fields of 1 to 16 bits, like SPS/PPS parsing
+    RunBenchmark("extract_bit (4096 bytes)", 4096, [&]() {
+        int sum = 0;
+        for (size_t pos = 0; pos < 4096 * 8; ++pos) {
+            sum += extract_bit(data.data(), pos);
+        }
+        g_sink = g_sink + sum;
+    });
+    RunBenchmark("read_bits (1-16 bits, 4096 bytes)", 4096, [&]() {
+        int sum = 0;
+        size_t pos = 0;
+        for (int n = 1; pos + 16 <= 4096 * 8; n = n % 16 + 1) {
+            sum += read_bits(data.data(), pos, n);
+        }
+        g_sink = g_sink + sum;
+    });
+    if (!ValidateBitReader(data)) {
+        return 1;
+    }
+    RunBenchmark("CBitReader::ReadBits (1-16 bits, 4096 bytes)", 4096, [&]() {
+        uint32_t sum = 0;
+        CBitReader br(data.data(), 4096);
+        for (int n = 1; br.GetPos() + 16 <= 4096 * 8; n = n % 16 + 1) {
+            sum += br.ReadBits(n);
+        }
+        g_sink = g_sink + sum;
+    });
+
+    // Small values are common
+    std::vector<uint8_t> uegData;
+    std::vector<int> uegValues;
+    size_t uegBits = 0;
+    while (uegBits < 4096 * 8 - 64) {
+        state = state * 1664525 + 1013904223;
+        int v = static_cast<int>((state >> 16) & ((1 << ((state >> 8) % 12)) - 1));
+        int n = 0;
+        while (((v + 1) >> n) > 1) {
+            ++n;
+        }
+        PutBits(uegData, uegBits, n, 0);
+        PutBits(uegData, uegBits, n + 1, v + 1);
+        uegValues.push_back(v);
+    }
+    // Overrun area
+    uegData.resize(uegData.size() + 8);
+    if (!ValidateUegBits(uegData, uegValues)) {
+        return 1;
+    }
+    RunBenchmark("read_ueg_bits (4096 bytes)", uegBits / 8, [&]() {
+        int sum = 0;
+        size_t pos = 0;
+        for (size_t i = 0; i < uegValues.size(); ++i) {
+            sum += read_ueg_bits(uegData.data(), pos);
+        }
+        g_sink = g_sink + sum;
+    });
+    RunBenchmark("CBitReader::ReadUeg (4096 bytes)", uegBits / 8, [&]() {
+        uint32_t sum = 0;
+        CBitReader br(uegData.data(), uegData.size());
+        for (size_t i = 0; i < uegValues.size(); ++i) {
+            sum += br.ReadUeg();
+        }
+        g_sink = g_sink + sum;
+    });
+    return 0;
+}
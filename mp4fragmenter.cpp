@@ -1,4 +1,5 @@
 #include "mp4fragmenter.hpp"
+#include "trace.hpp"
 #include <stdio.h>
 #include <algorithm>
 
@@ -6,6 +7,13 @@ namespace
 {
 const uint8_t RESERVED_0 = 0;
 const uint8_t PRE_DEFINED_0 = 0;
+// Pattern of the "cbcs" scheme for video, 1 of every 10 blocks is encrypted
+const int CBCS_CRYPT_BLOCKS = 1;
+const int CBCS_SKIP_BLOCKS = 9;
+// Leading bytes of a VCL NAL unit left clear, covering the NAL unit header and the slice header as HLS Sample-AES does
+const size_t CBCS_CLEAR_NAL_BYTES = 32;
+// Limited by the 8-bit sample_info_size of "saiz"
+const size_t CBCS_SUBSAMPLES_MAX = 42;
 
 void PushUshort(std::vector<uint8_t> &data, uint32_t n)
 {
@@ -83,6 +91,51 @@ void ParseNals(const uint8_t *payload, size_t payloadSize, P onNalProc)
     }
 }
 
+// Append subsamples (clear and protected sizes) of a sample of length-prefixed NAL units for the "cbcs" scheme.
+// Returns false if some slice data are left clear because of the limit of the number of subsamples.
+bool PushCbcsSubsamples(std::vector<std::pair<uint32_t, uint32_t>> &subsamples, const uint8_t *sample, size_t sampleSize, bool h265)
+{
+    bool allProtected = true;
+    size_t subsampleNum = 0;
+    size_t clearSize = 0;
+    size_t i = 0;
+    auto pushSubsample = [&subsamples, &subsampleNum, &clearSize](size_t protectedSize) {
+        for (; clearSize > 0xffff; clearSize -= 0xffff, ++subsampleNum) {
+            subsamples.emplace_back(0xffff, 0);
+        }
+        subsamples.emplace_back(static_cast<uint32_t>(clearSize), static_cast<uint32_t>(protectedSize));
+        ++subsampleNum;
+        clearSize = 0;
+    };
+    while (i + 4 < sampleSize) {
+        size_t len = std::min<size_t>((sample[i] << 24) | (sample[i + 1] << 16) | (sample[i + 2] << 8) | sample[i + 3], sampleSize - i - 4);
+        int nalUnitType = h265 ? (sample[i + 4] >> 1) & 0x3f : sample[i + 4] & 0x1f;
+        bool isVcl = h265 ? nalUnitType < 32 : (nalUnitType >= 1 && nalUnitType <= 5);
+        // Leave a room for the trailing clear subsample
+        bool protects = isVcl && len >= CBCS_CLEAR_NAL_BYTES + 16;
+        if (protects && subsampleNum + 2 >= CBCS_SUBSAMPLES_MAX) {
+            allProtected = false;
+            protects = false;
+        }
+        if (protects) {
+            // The protected range ends at a block boundary, the rest is clear
+            size_t protectedSize = (len - CBCS_CLEAR_NAL_BYTES) / 16 * 16;
+            clearSize += 4 + CBCS_CLEAR_NAL_BYTES;
+            pushSubsample(protectedSize);
+            clearSize = len - CBCS_CLEAR_NAL_BYTES - protectedSize;
+        }
+        else {
+            clearSize += 4 + len;
+        }
+        i += 4 + len;
+    }
+    clearSize += sampleSize - i;
+    if (clearSize > 0) {
+        pushSubsample(0);
+    }
+    return allProtected;
+}
+
 std::vector<uint8_t> EbspToRbsp(const std::vector<uint8_t> &src)
 {
     std::vector<uint8_t> dest;
@@ -94,36 +147,76 @@ std::vector<uint8_t> EbspToRbsp(const std::vector<uint8_t> &src)
     return dest;
 }
 
-int ReadUegBits(const uint8_t *data, size_t &pos)
+void PushParameterSets(std::vector<uint8_t> &data, const std::map<int, std::vector<uint8_t>> &table)
+{
+    for (auto it = table.begin(); it != table.end(); ++it) {
+        PushUshort(data, static_cast<uint32_t>(it->second.size()));
+        data.insert(data.end(), it->second.begin(), it->second.end());
+    }
+}
+
+int GetParameterSetID(const uint8_t *nal, size_t len, int nalUnitType, bool h265)
 {
-    // Reads up to 61bits
-    for (int n = 0; n < 31; ++n) {
-        if (read_bool(data, pos)) {
-            return read_bits(data, pos, n) - 1 + (1 << n);
+    if (h265) {
+        std::vector<uint8_t> rbsp = EbspToRbsp(std::vector<uint8_t>(nal, nal + std::min<size_t>(len, 128)));
+        CBitReader br(rbsp.data(), rbsp.size());
+        br.Skip(16);
+        if (nalUnitType == 32) {
+            // vps_video_parameter_set_id
+            return br.ReadBits(4);
         }
+        if (nalUnitType == 33) {
+            // Skip profile_tier_level()
+            br.Skip(4);
+            int maxSubLayersMinus1 = br.ReadBits(3);
+            br.Skip(1 + 88 + 8);
+            int subLayerBits = 0;
+            for (int i = 0; i < maxSubLayersMinus1; ++i) {
+                subLayerBits += br.ReadBool() ? 88 : 0;
+                subLayerBits += br.ReadBool() ? 8 : 0;
+            }
+            br.Skip((maxSubLayersMinus1 > 0 ? 2 * (8 - maxSubLayersMinus1) : 0) + subLayerBits);
+        }
+        int id = br.ReadUeg();
+        return br.IsOverrun() ? 0 : id;
     }
-    return 0;
+    // Emulation prevention should not appear in the first few bytes
+    CBitReader br(nal + std::min<size_t>(len, nalUnitType == 7 ? 4 : 1), len - std::min<size_t>(len, nalUnitType == 7 ? 4 : 1));
+    int id = br.ReadUeg();
+    return br.IsOverrun() ? 0 : id;
 }
 
-int ReadSegBits(const uint8_t *data, size_t &pos)
+// Duration of a picture in 90kHz from the VUI timing info, or 0 if out of range (below 1fps)
+int GetFrameDurationFromTiming(uint32_t numUnitsInTick, uint32_t timeScale, int ticksPerFrame)
 {
-    int r = ReadUegBits(data, pos);
-    return (r >> 1) + (r & 1 ? 1 : -r);
+    int64_t duration = timeScale > 0 ? static_cast<int64_t>(numUnitsInTick) * ticksPerFrame * 90000 / timeScale : 0;
+    return duration <= 90000 ? static_cast<int>(duration) : 0;
 }
 
-bool SyncAdtsPayload(std::vector<uint8_t> &workspace, const uint8_t *payload, size_t lenBytes)
+// Whether "data" begins with the sync word of audio frames of "streamType". Only the first byte is checked if "size" is 1.
+bool IsAudioSyncWord(int streamType, const uint8_t *data, size_t size)
+{
+    if (streamType == AC3_AUDIO || streamType == EAC3_AUDIO) {
+        return data[0] == 0x0b && (size < 2 || data[1] == 0x77);
+    }
+    // 12 bits for ADTS, 11 bits for MPEG audio
+    int mask = streamType == ADTS_TRANSPORT ? 0xf0 : 0xe0;
+    return data[0] == 0xff && (size < 2 || (data[1] & mask) == mask);
+}
+
+bool SyncAudioPayload(std::vector<uint8_t> &workspace, const uint8_t *payload, size_t lenBytes, int streamType)
 {
     if (!workspace.empty() && workspace[0] == 0) {
         // No need to resync
         workspace.insert(workspace.end(), payload, payload + lenBytes);
-        workspace[0] = 0xff;
+        workspace[0] = streamType == AC3_AUDIO || streamType == EAC3_AUDIO ? 0x0b : 0xff;
     }
     else {
         // Resync
         workspace.insert(workspace.end(), payload, payload + lenBytes);
         size_t i = 0;
         for (; i < workspace.size(); ++i) {
-            if (workspace[i] == 0xff && (i + 1 >= workspace.size() || (workspace[i + 1] & 0xf0) == 0xf0)) {
+            if (IsAudioSyncWord(streamType, &workspace[i], workspace.size() - i)) {
                 break;
             }
         }
@@ -134,6 +227,206 @@ bool SyncAdtsPayload(std::vector<uint8_t> &workspace, const uint8_t *payload, si
     }
     return true;
 }
+
+struct AUDIO_FRAME_HEADER
+{
+    // Bytes not stored in the sample (ADTS header)
+    size_t headerSize;
+    size_t frameLenBytes;
+    int aacProfile;
+    // 0 if not supported
+    int samplingFrequency;
+    int samplingFrequencyIndex;
+    int channelConfiguration;
+    // Number of PCM samples of the MP4 sample, and of this frame. An E-AC-3 sample aggregates frames of fewer than 6 blocks.
+    int sampleDuration;
+    int frameDuration;
+    // False if the frame belongs to the sample of the previous frame (E-AC-3 dependent or additional substream)
+    bool startsSample;
+    // Channel locations ("chan_loc" of "dec3") of an E-AC-3 dependent substream, -1 if not a dependent substream
+    int chanLoc;
+    // Payload of the "dac3" or "dec3" box
+    uint8_t specificBox[5];
+    size_t specificBoxSize;
+};
+
+// Parse the header of the audio frame beginning with the sync word.
+// Returns 1 if parsed, 0 if more bytes are needed, or -1 if invalid.
+int ParseAudioFrameHeader(int streamType, const uint8_t *data, size_t size, AUDIO_FRAME_HEADER &header)
+{
+    static const int AC3_SAMPLING_FREQUENCY[3] = {48000, 44100, 32000};
+    // Full bandwidth channels by audio coding mode
+    static const int AC3_CHANNELS[8] = {2, 1, 2, 3, 3, 4, 4, 5};
+    header = AUDIO_FRAME_HEADER();
+    header.startsSample = true;
+    header.chanLoc = -1;
+
+    if (streamType == ADTS_TRANSPORT) {
+        if (size < 7) {
+            return 0;
+        }
+        size_t pos = 12;
+        pos += 3;
+        bool protectionAbsent = read_bool(data, pos);
+        header.aacProfile = read_bits(data, pos, 2);
+        header.samplingFrequencyIndex = read_bits(data, pos, 4);
+        ++pos;
+        header.channelConfiguration = read_bits(data, pos, 3);
+        pos += 4;
+        header.frameLenBytes = read_bits(data, pos, 13);
+        header.headerSize = protectionAbsent ? 7 : 9;
+        if (header.frameLenBytes < header.headerSize) {
+            return -1;
+        }
+        if (header.samplingFrequencyIndex < 13) {
+            static const int SAMPLING_FREQUENCY[13] = {
+                96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+            };
+            header.samplingFrequency = SAMPLING_FREQUENCY[header.samplingFrequencyIndex];
+        }
+        header.sampleDuration = 1024;
+        header.frameDuration = header.sampleDuration;
+        return 1;
+    }
+
+    if (streamType == MPEG1_AUDIO || streamType == MPEG2_AUDIO) {
+        if (size < 4) {
+            return 0;
+        }
+        // 3: MPEG-1, 2: MPEG-2, 0: MPEG-2.5
+        int version = (data[1] >> 3) & 0x03;
+        // 3: Layer I, 2: Layer II, 1: Layer III
+        int layer = (data[1] >> 1) & 0x03;
+        int bitrateIndex = data[2] >> 4;
+        int samplingFrequencyIndex = (data[2] >> 2) & 0x03;
+        int padding = (data[2] >> 1) & 0x01;
+        if (version == 1 || layer == 0 || bitrateIndex == 0 || bitrateIndex == 15 || samplingFrequencyIndex == 3) {
+            // Free format is not supported
+            return -1;
+        }
+        static const int BITRATE_KBPS[5][15] = {
+            {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+            {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}
+        };
+        static const int SAMPLING_FREQUENCY[3] = {44100, 48000, 32000};
+        int bitrate = BITRATE_KBPS[version == 3 ? 3 - layer : layer == 3 ? 3 : 4][bitrateIndex] * 1000;
+        header.samplingFrequency = SAMPLING_FREQUENCY[samplingFrequencyIndex] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+        header.samplingFrequencyIndex = samplingFrequencyIndex;
+        header.channelConfiguration = (data[3] >> 6) == 3 ? 1 : 2;
+        header.sampleDuration = layer == 3 ? 384 : layer == 1 && version != 3 ? 576 : 1152;
+        header.frameLenBytes = layer == 3 ? (12 * bitrate / header.samplingFrequency + padding) * 4 :
+                                            header.sampleDuration / 8 * bitrate / header.samplingFrequency + padding;
+        header.frameDuration = header.sampleDuration;
+        return 1;
+    }
+
+    if (size < 8) {
+        return 0;
+    }
+    // The bit stream identification is at the same position for both
+    int bsid = data[5] >> 3;
+    if (streamType == AC3_AUDIO) {
+        int fscod = data[4] >> 6;
+        int frmsizecod = data[4] & 0x3f;
+        if (bsid > 10 || fscod == 3 || frmsizecod >= 38) {
+            return -1;
+        }
+        static const int BITRATE_KBPS[19] = {32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 576, 640};
+        int bitrate = BITRATE_KBPS[frmsizecod >> 1];
+        // In 16-bit words
+        header.frameLenBytes = 2 * (fscod == 0 ? bitrate * 2 : fscod == 1 ? bitrate * 320 / 147 + (frmsizecod & 1) : bitrate * 3);
+        CBitReader br(data + 5, size - 5);
+        br.Skip(5);
+        int bsmod = br.ReadBits(3);
+        int acmod = br.ReadBits(3);
+        if ((acmod & 1) && acmod != 1) {
+            // cmixlev
+            br.Skip(2);
+        }
+        if (acmod & 4) {
+            // surmixlev
+            br.Skip(2);
+        }
+        if (acmod == 2) {
+            // dsurmod
+            br.Skip(2);
+        }
+        int lfeon = br.ReadBits(1);
+        header.samplingFrequency = AC3_SAMPLING_FREQUENCY[fscod];
+        header.channelConfiguration = AC3_CHANNELS[acmod] + lfeon;
+        header.sampleDuration = 1536;
+        header.frameDuration = header.sampleDuration;
+        header.specificBox[0] = static_cast<uint8_t>((fscod << 6) | (bsid << 1) | (bsmod >> 2));
+        header.specificBox[1] = static_cast<uint8_t>(((bsmod & 0x03) << 6) | (acmod << 3) | (lfeon << 2) | (frmsizecod >> 4));
+        header.specificBox[2] = static_cast<uint8_t>(((frmsizecod >> 1) & 0x07) << 5);
+        header.specificBoxSize = 3;
+        return 1;
+    }
+
+    // E-AC-3
+    CBitReader br(data + 2, size - 2);
+    int strmtyp = br.ReadBits(2);
+    int substreamid = br.ReadBits(3);
+    header.frameLenBytes = (br.ReadBits(11) + 1) * 2;
+    int fscod = br.ReadBits(2);
+    int numblkscod = 3;
+    if (fscod == 3) {
+        int fscod2 = br.ReadBits(2);
+        if (fscod2 == 3) {
+            return -1;
+        }
+        header.samplingFrequency = AC3_SAMPLING_FREQUENCY[fscod2] / 2;
+    }
+    else {
+        numblkscod = br.ReadBits(2);
+        header.samplingFrequency = AC3_SAMPLING_FREQUENCY[fscod];
+    }
+    int acmod = br.ReadBits(3);
+    int lfeon = br.ReadBits(1);
+    if (bsid <= 10 || bsid > 16 || strmtyp == 3) {
+        return -1;
+    }
+    static const int BLOCKS[4] = {1, 2, 3, 6};
+    header.channelConfiguration = AC3_CHANNELS[acmod] + lfeon;
+    header.sampleDuration = 1536;
+    header.frameDuration = 256 * BLOCKS[numblkscod];
+    header.startsSample = strmtyp != 1 && substreamid == 0;
+    if (strmtyp == 1) {
+        header.chanLoc = 0;
+        // bsid, dialnorm, compre and compr
+        br.Skip(10);
+        if (br.ReadBool()) {
+            br.Skip(8);
+        }
+        if (acmod == 0) {
+            // dialnorm2, compr2e and compr2
+            br.Skip(5);
+            if (br.ReadBool()) {
+                br.Skip(8);
+            }
+        }
+        if (br.ReadBool()) {
+            // The MSB of chanmap is location 0. Locations 5-12 (Lc/Rc pair to Cvh) and 14 (LFE2) are in "chan_loc".
+            int chanmap = br.ReadBits(16);
+            for (int i = 0; i < 8; ++i) {
+                header.chanLoc |= ((chanmap >> (10 - i)) & 1) << i;
+            }
+            header.chanLoc |= ((chanmap >> 1) & 1) << 8;
+        }
+    }
+    // In kbps, updated with the whole substreams in AddAudioPes()
+    int dataRate = static_cast<int>(header.frameLenBytes * 8 * header.samplingFrequency / header.frameDuration / 1000);
+    header.specificBox[0] = static_cast<uint8_t>(dataRate >> 5);
+    header.specificBox[1] = static_cast<uint8_t>((dataRate & 0x1f) << 3);
+    header.specificBox[2] = static_cast<uint8_t>((fscod << 6) | (bsid << 1));
+    header.specificBox[3] = static_cast<uint8_t>((acmod << 1) | lfeon);
+    header.specificBox[4] = 0;
+    header.specificBoxSize = 5;
+    return 1;
+}
 }
 
 const int CMp4Fragmenter::VIDEO_TRACK_ID = 1;
@@ -141,7 +434,11 @@ const int CMp4Fragmenter::AUDIO_TRACK_ID = 2;
 
 CMp4Fragmenter::CMp4Fragmenter()
     : m_fragmentCount(0)
+    , m_headerVersion(0)
+    , m_inbandParameterSets(false)
+    , m_warningCount(0)
     , m_fragmentDurationResidual(0)
+    , m_lastFragmentOpen(false)
     , m_videoPts(-1)
     , m_videoDts(-1)
     , m_videoDecodeTime(0)
@@ -149,23 +446,71 @@ CMp4Fragmenter::CMp4Fragmenter()
     , m_audioPts(-1)
     , m_audioDecodeTime(0)
     , m_audioDecodeTimePts(-1)
+    , m_baseVideoDts(-1)
+    , m_baseAudioPts(-1)
+    , m_decodeTimeBase(0)
+    , m_decodeTimeEnd(0)
+    , m_timelineResumed(false)
     , m_codecWidth(-1)
     , m_parallelismType(0)
     , m_numTemporalLayers(1)
     , m_temporalIDNestingFlag(false)
-    , m_aacProfile(-1)
+    , m_videoSampleDurationEstimate(3000)
+    , m_audioStreamType(-1)
+    , m_audioPendingDuration(0)
+    , m_eac3Bytes(0)
+    , m_eac3Duration(0)
+    , m_eac3DepSubCount(0)
+    , m_eac3DepSubNum(0)
+    , m_eac3ChanLoc(0)
+    , m_encrypted(false)
+    , m_keyId()
+    , m_key()
+    , m_constantIv()
+    , m_headerKeyId()
+    , m_headerConstantIv()
 {
 }
 
-void CMp4Fragmenter::AddPackets(const std::vector<uint8_t> &packets, const PMT &pmt, bool packetsMaybeNotEndAtUnitStart)
+void CMp4Fragmenter::SetEncryptionKey(const uint8_t *keyId, const uint8_t *key, const uint8_t *iv)
 {
-    int64_t baseVideoDts = -1;
-    int64_t baseAudioPts = -1;
+    if (m_encrypted && std::equal(keyId, keyId + 16, m_keyId) && std::equal(key, key + 16, m_key) && std::equal(iv, iv + 16, m_constantIv)) {
+        return;
+    }
+    bool wasEncrypted = m_encrypted;
+    m_encrypted = true;
+    std::copy(keyId, keyId + 16, m_keyId);
+    std::copy(key, key + 16, m_key);
+    std::copy(iv, iv + 16, m_constantIv);
+    m_aes.SetKey(key);
+    if (!wasEncrypted || m_moov.empty()) {
+        // The defaults in the header. Later keys are signaled in each fragment instead.
+        std::copy(keyId, keyId + 16, m_headerKeyId);
+        std::copy(iv, iv + 16, m_headerConstantIv);
+        if (!m_moov.empty()) {
+            // Encryption changes the sample entries
+            m_moov.clear();
+            PushFtypAndMoov(m_moov);
+            ++m_headerVersion;
+        }
+    }
+}
+
+void CMp4Fragmenter::AddPackets(const std::vector<uint8_t> &packets, const PMT &pmt, bool packetsMaybeNotEndAtUnitStart, bool fragmentContinues)
+{
+    TRACE_SCOPE("AddPackets");
+    m_baseVideoDts = -1;
+    m_baseAudioPts = -1;
     m_emsg.clear();
     m_videoMdat.clear();
     m_audioMdat.clear();
     m_videoSampleInfos.clear();
     m_audioSampleSizes.clear();
+    // MPEG-2 video cannot be stored, fragment the other streams
+    int videoPid = pmt.first_video_stream_type == MPEG2_VIDEO ? 0 : pmt.first_video_pid;
+    // Select the specialization once for all video PES
+    void (CMp4Fragmenter::*addVideoPes)(const std::vector<uint8_t> &) =
+        pmt.first_video_stream_type == H_265_VIDEO ? &CMp4Fragmenter::AddVideoPes<true> : &CMp4Fragmenter::AddVideoPes<false>;
 
     for (size_t i = 0; i < packets.size(); i += 188) {
         const uint8_t *packet = &packets[i];
@@ -176,11 +521,11 @@ void CMp4Fragmenter::AddPackets(const std::vector<uint8_t> &packets, const PMT &
         const uint8_t *payload = packet + 188 - payloadSize;
 
         if (pid != 0 &&
-            (pid == pmt.first_video_pid ||
-             pid == pmt.first_adts_audio_pid ||
+            (pid == videoPid ||
+             pid == pmt.first_audio_pid ||
              pid == pmt.first_id3_metadata_pid)) {
-            auto &pesPair = pid == pmt.first_video_pid ? m_videoPes :
-                            pid == pmt.first_adts_audio_pid ? m_audioPes : m_id3Pes;
+            auto &pesPair = pid == videoPid ? m_videoPes :
+                            pid == pmt.first_audio_pid ? m_audioPes : m_id3Pes;
             int &pesCounter = pesPair.first;
             std::vector<uint8_t> &pes = pesPair.second;
 
@@ -190,9 +535,9 @@ void CMp4Fragmenter::AddPackets(const std::vector<uint8_t> &packets, const PMT &
                     size_t pesPacketLength = (pes[4] << 8) | pes[5];
                     if (pesPacketLength == 0 && &pesPair == &m_videoPes) {
                         // Video PES has been accumulated
-                        AddVideoPes(pes, pmt.first_video_stream_type == H_265_VIDEO);
-                        if (baseVideoDts < 0) {
-                            baseVideoDts = m_videoDts;
+                        (this->*addVideoPes)(pes);
+                        if (m_baseVideoDts < 0) {
+                            m_baseVideoDts = m_videoDts;
                         }
                     }
                 }
@@ -215,15 +560,20 @@ void CMp4Fragmenter::AddPackets(const std::vector<uint8_t> &packets, const PMT &
                     pes.resize(6 + pesPacketLength);
                     if (pes[0] == 0 && pes[1] == 0 && pes[2] == 1) {
                         if (&pesPair == &m_videoPes) {
-                            AddVideoPes(pes, pmt.first_video_stream_type == H_265_VIDEO);
-                            if (baseVideoDts < 0) {
-                                baseVideoDts = m_videoDts;
+                            (this->*addVideoPes)(pes);
+                            if (m_baseVideoDts < 0) {
+                                m_baseVideoDts = m_videoDts;
                             }
                         }
                         else if (&pesPair == &m_audioPes) {
-                            AddAudioPes(pes);
-                            if (baseAudioPts < 0) {
-                                baseAudioPts = m_audioPts;
+                            int pendingDuration = m_audioPendingDuration;
+                            AddAudioPes(pes, pmt.first_audio_stream_type);
+                            if (m_baseAudioPts < 0) {
+                                m_baseAudioPts = m_audioPts;
+                                if (pendingDuration > 0 && m_audioPts >= 0) {
+                                    // The first sample began with the frames carried over from the previous fragment
+                                    m_baseAudioPts = (0x200000000 + m_audioPts - static_cast<int64_t>(pendingDuration) * 90000 / m_samplingFrequency) & 0x1ffffffff;
+                                }
                             }
                         }
                         else {
@@ -241,55 +591,73 @@ void CMp4Fragmenter::AddPackets(const std::vector<uint8_t> &packets, const PMT &
         size_t pesPacketLength = (pes[4] << 8) | pes[5];
         if (pesPacketLength == 0 && !packetsMaybeNotEndAtUnitStart) {
             // Video PES has been accumulated (Assuming packets are split at the unit start.)
-            AddVideoPes(pes, pmt.first_video_stream_type == H_265_VIDEO);
-            if (baseVideoDts < 0) {
-                baseVideoDts = m_videoDts;
+            (this->*addVideoPes)(pes);
+            if (m_baseVideoDts < 0) {
+                m_baseVideoDts = m_videoDts;
             }
             pes.clear();
         }
     }
 
     if (m_moov.empty()) {
-        if ((pmt.first_video_pid == 0 || m_codecWidth >= 0) &&
-            (pmt.first_adts_audio_pid == 0 || m_aacProfile >= 0)) {
+        if ((videoPid == 0 || m_codecWidth >= 0) &&
+            (pmt.first_audio_pid == 0 || m_audioStreamType >= 0)) {
             PushFtypAndMoov(m_moov);
         }
     }
+    PushFragment();
+    m_lastFragmentOpen = fragmentContinues;
+}
+
+void CMp4Fragmenter::PushFragment()
+{
+    // Move the pending samples into a new fragment
     if (!m_moov.empty()) {
         size_t fragSize = m_fragments.size();
         int fragDurationMsec = 0;
         m_fragments.insert(m_fragments.end(), m_emsg.begin(), m_emsg.end());
         if (!m_videoSampleInfos.empty() || !m_audioSampleSizes.empty()) {
             // Increment playback position
-            if (baseVideoDts >= 0 && m_videoDecodeTimeDts >= 0) {
-                int64_t diff = (0x200000000 + baseVideoDts - m_videoDecodeTimeDts) & 0x1ffffffff;
+            if (m_baseVideoDts >= 0 && m_videoDecodeTimeDts >= 0) {
+                int64_t diff = (0x200000000 + m_baseVideoDts - m_videoDecodeTimeDts) & 0x1ffffffff;
                 m_videoDecodeTime += diff < 0x100000000 ? diff : 0;
-                m_videoDecodeTimeDts = baseVideoDts;
+                m_videoDecodeTimeDts = m_baseVideoDts;
             }
-            if (baseAudioPts >= 0 && m_audioDecodeTimePts >= 0) {
-                int64_t diff = (0x200000000 + baseAudioPts - m_audioDecodeTimePts) & 0x1ffffffff;
+            if (m_baseAudioPts >= 0 && m_audioDecodeTimePts >= 0) {
+                int64_t diff = (0x200000000 + m_baseAudioPts - m_audioDecodeTimePts) & 0x1ffffffff;
                 m_audioDecodeTime += diff < 0x100000000 ? diff : 0;
-                m_audioDecodeTimePts = baseAudioPts;
+                m_audioDecodeTimePts = m_baseAudioPts;
             }
 
             // Adjust difference between video/audio playback positions
-            if (m_videoDecodeTimeDts < 0 && baseVideoDts >= 0) {
-                if (m_audioDecodeTimePts >= 0) {
-                    int64_t diff = (0x200000000 + m_audioDecodeTime + baseVideoDts - m_audioDecodeTimePts) & 0x1ffffffff;
-                    m_videoDecodeTime = std::min<int64_t>(diff < 0x100000000 ? diff : 0, 900000);
+            if (m_videoDecodeTimeDts < 0 && m_baseVideoDts >= 0) {
+                if (m_timelineResumed) {
+                    // The audio may start earlier than the video key
+                    m_videoDecodeTime = m_decodeTimeBase;
                 }
-                else if (baseAudioPts >= 0) {
-                    int64_t diff = (0x200000000 + baseVideoDts - baseAudioPts) & 0x1ffffffff;
-                    m_videoDecodeTime = std::min<int64_t>(diff < 0x100000000 ? diff : 0, 900000);
+                else if (m_audioDecodeTimePts >= 0) {
+                    int64_t diff = (0x200000000 + m_audioDecodeTime - m_decodeTimeBase + m_baseVideoDts - m_audioDecodeTimePts) & 0x1ffffffff;
+                    m_videoDecodeTime = m_decodeTimeBase + std::min<int64_t>(diff < 0x100000000 ? diff : 0, 900000);
                 }
-                m_videoDecodeTimeDts = baseVideoDts;
+                else if (m_baseAudioPts >= 0) {
+                    int64_t diff = (0x200000000 + m_baseVideoDts - m_baseAudioPts) & 0x1ffffffff;
+                    m_videoDecodeTime = m_decodeTimeBase + std::min<int64_t>(diff < 0x100000000 ? diff : 0, 900000);
+                }
+                m_videoDecodeTimeDts = m_baseVideoDts;
             }
-            if (m_audioDecodeTimePts < 0 && baseAudioPts >= 0) {
+            if (m_audioDecodeTimePts < 0 && m_baseAudioPts >= 0) {
                 if (m_videoDecodeTimeDts >= 0) {
-                    int64_t diff = (0x200000000 + m_videoDecodeTime + baseAudioPts - m_videoDecodeTimeDts) & 0x1ffffffff;
-                    m_audioDecodeTime = std::min<int64_t>(diff < 0x100000000 ? diff : 0, 900000);
+                    int64_t diff = (0x200000000 + m_videoDecodeTime - m_decodeTimeBase + m_baseAudioPts - m_videoDecodeTimeDts) & 0x1ffffffff;
+                    if (m_timelineResumed) {
+                        // Keep the offset to the video as it was in the previous process, even if negative
+                        diff = diff < 0x100000000 ? diff : diff - 0x200000000;
+                        m_audioDecodeTime = std::max<int64_t>(m_decodeTimeBase + std::min<int64_t>(diff, 900000), 0);
+                    }
+                    else {
+                        m_audioDecodeTime = m_decodeTimeBase + std::min<int64_t>(diff < 0x100000000 ? diff : 0, 900000);
+                    }
                 }
-                m_audioDecodeTimePts = baseAudioPts;
+                m_audioDecodeTimePts = m_baseAudioPts;
             }
 
             std::pair<int, int> duration;
@@ -298,14 +666,31 @@ void CMp4Fragmenter::AddPackets(const std::vector<uint8_t> &packets, const PMT &
                 int64_t num = static_cast<int64_t>(duration.first) * 1000 + m_fragmentDurationResidual;
                 fragDurationMsec = static_cast<int>(num / duration.second);
                 m_fragmentDurationResidual = static_cast<int>(num % duration.second);
+                m_decodeTimeEnd = (m_videoSampleInfos.empty() ? m_audioDecodeTime : m_videoDecodeTime) +
+                                  static_cast<int64_t>(duration.first) * 90000 / duration.second;
             }
         }
         fragSize = m_fragments.size() - fragSize;
         if (fragSize > 0) {
-            m_fragmentSizes.push_back(fragSize);
-            m_fragmentDurationsMsec.push_back(fragDurationMsec);
+            if (m_lastFragmentOpen && !m_fragmentSizes.empty() && m_fragmentHeaderVersions.back() == m_headerVersion) {
+                // Append as a chunk
+                m_fragmentSizes.back() += fragSize;
+                m_fragmentDurationsMsec.back() += fragDurationMsec;
+            }
+            else {
+                m_fragmentSizes.push_back(fragSize);
+                m_fragmentDurationsMsec.push_back(fragDurationMsec);
+                m_fragmentHeaderVersions.push_back(m_headerVersion);
+            }
         }
     }
+    m_baseVideoDts = -1;
+    m_baseAudioPts = -1;
+    m_emsg.clear();
+    m_videoMdat.clear();
+    m_audioMdat.clear();
+    m_videoSampleInfos.clear();
+    m_audioSampleSizes.clear();
 }
 
 void CMp4Fragmenter::ClearFragments()
@@ -313,10 +698,52 @@ void CMp4Fragmenter::ClearFragments()
     m_fragments.clear();
     m_fragmentSizes.clear();
     m_fragmentDurationsMsec.clear();
+    m_fragmentHeaderVersions.clear();
+}
+
+void CMp4Fragmenter::EraseFrontFragments(size_t n)
+{
+    n = std::min(n, m_fragmentSizes.size());
+    size_t eraseSize = 0;
+    for (size_t i = 0; i < n; ++i) {
+        eraseSize += m_fragmentSizes[i];
+    }
+    m_fragments.erase(m_fragments.begin(), m_fragments.begin() + eraseSize);
+    m_fragmentSizes.erase(m_fragmentSizes.begin(), m_fragmentSizes.begin() + n);
+    m_fragmentDurationsMsec.erase(m_fragmentDurationsMsec.begin(), m_fragmentDurationsMsec.begin() + n);
+    m_fragmentHeaderVersions.erase(m_fragmentHeaderVersions.begin(), m_fragmentHeaderVersions.begin() + n);
+}
+
+void CMp4Fragmenter::ResetContinuity()
+{
+    // Forget the packets and samples immediately before, keeping the timeline and the parameters.
+    // Used to start from a key packet that does not follow the previously added packets.
+    m_videoPes.second.clear();
+    m_audioPes.second.clear();
+    m_id3Pes.second.clear();
+    m_workspace.clear();
+    m_audioPendingSample.clear();
+    m_audioPendingDuration = 0;
+    m_videoPts = -1;
+    m_videoDts = -1;
+}
+
+void CMp4Fragmenter::ResumeTimeline(uint32_t fragmentCount, int64_t decodeTime)
+{
+    // Continue the timeline of a previous process, where "decodeTime" is the end of its video (or audio if no video).
+    // Must be called before adding packets.
+    m_fragmentCount = fragmentCount;
+    m_videoDecodeTime = decodeTime;
+    m_audioDecodeTime = decodeTime;
+    m_decodeTimeBase = decodeTime;
+    m_decodeTimeEnd = decodeTime;
+    m_timelineResumed = true;
 }
 
-void CMp4Fragmenter::AddVideoPes(const std::vector<uint8_t> &pes, bool h265)
+template <bool H265>
+void CMp4Fragmenter::AddVideoPes(const std::vector<uint8_t> &pes)
 {
+    const bool h265 = H265;
     int streamID = pes[3];
     if ((streamID & 0xf0) == 0xe0 && pes.size() >= 9) {
         size_t payloadPos = 9 + pes[8];
@@ -332,61 +759,63 @@ void CMp4Fragmenter::AddVideoPes(const std::vector<uint8_t> &pes, bool h265)
             }
 
             bool parameterChanged = false;
+            bool newIDFound = false;
             bool isKey = false;
             size_t sampleSize = 0;
+            // Parameter sets in this PES, collected after the header is created
+            PARAMETER_SET_MAP vpsMap;
+            PARAMETER_SET_MAP spsMap;
+            PARAMETER_SET_MAP ppsMap;
             ParseNals(&pes[payloadPos], pes.size() - payloadPos,
-                      [this, h265, &parameterChanged, &isKey, &sampleSize](const uint8_t *nal, size_t len) {
+                      [this, h265, &parameterChanged, &newIDFound, &isKey, &sampleSize, &vpsMap, &spsMap, &ppsMap](const uint8_t *nal, size_t len) {
                 if (len >= (h265 ? 2 : 1)) {
                     int nalUnitType = h265 ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
-                    if (h265 && nalUnitType == 32) {
-                        // "Multiple VPS" is not supported
-                        if (m_vps.size() != len || !std::equal(nal, nal + len, m_vps.begin())) {
-                            if (m_moov.empty()) {
-                                m_vps.assign(nal, nal + len);
-                                ParseVps(m_vps);
-                            }
-                            else {
-                                parameterChanged = true;
+                    // 0: VPS, 1: SPS, 2: PPS
+                    int psType = h265 ? (nalUnitType >= 32 && nalUnitType <= 34 ? nalUnitType - 32 : -1) :
+                                        (nalUnitType == 7 ? 1 : nalUnitType == 8 ? 2 : -1);
+                    if (psType >= 0) {
+                        int id = GetParameterSetID(nal, len, nalUnitType, h265);
+                        PARAMETER_SET_MAP &table = psType == 0 ? m_vpsMap : psType == 1 ? m_spsMap : m_ppsMap;
+                        // Limited by the sample entry
+                        size_t maxNum = psType == 0 ? 16 : psType == 1 ? 31 : 255;
+                        if (!m_moov.empty()) {
+                            PARAMETER_SET_MAP &newTable = psType == 0 ? vpsMap : psType == 1 ? spsMap : ppsMap;
+                            if (newTable.size() < maxNum) {
+                                newTable.emplace(id, std::vector<uint8_t>(nal, nal + len));
                             }
                         }
-                    }
-                    else if (nalUnitType == (h265 ? 33 : 7)) {
-                        // "Multiple SPS" is not supported
-                        if (m_sps.size() != len || !std::equal(nal, nal + len, m_sps.begin())) {
-                            if (m_moov.empty()) {
-                                m_sps.assign(nal, nal + len);
-                                if (!(h265 ? ParseH265Sps(m_sps) : ParseSps(m_sps))) {
-                                    m_codecWidth = -1;
-                                }
+                        auto it = table.find(id);
+                        if (it == table.end() || it->second.size() != len || !std::equal(nal, nal + len, it->second.begin())) {
+                            if (it == table.end() && table.size() >= maxNum) {
+                                // Ignore
                             }
-                            else {
-                                parameterChanged = true;
-                            }
-                        }
-                    }
-                    else if (nalUnitType == (h265 ? 34 : 8)) {
-                        uint8_t sliceIntro[8] = {};
-                        std::copy(nal + (h265 ? 2 : 1), nal + std::min(len, (h265 ? 2 : 1) + sizeof(sliceIntro)), sliceIntro);
-                        size_t pos = 0;
-                        int picParameterSetID = ReadUegBits(sliceIntro, pos);
-                        if (m_ppsMap.count(picParameterSetID) == 0) {
-                            if (m_ppsMap.size() < 255) {
-                                m_ppsMap.emplace(picParameterSetID, std::vector<uint8_t>(nal, nal + len));
-                                if (m_moov.empty()) {
-                                    if (h265 && m_ppsMap.size() == 1) {
-                                        ParseH265Pps(m_ppsMap[picParameterSetID]);
+                            else if (m_moov.empty()) {
+                                std::vector<uint8_t> &ps = table[id];
+                                ps.assign(nal, nal + len);
+                                if (psType == 0) {
+                                    ParseVps(ps);
+                                }
+                                else if (psType == 1) {
+                                    if (!(h265 ? ParseH265Sps(ps) : ParseSps(ps))) {
+                                        m_codecWidth = -1;
                                     }
                                 }
-                                else {
-                                    fprintf(stderr, "Warning: New PPS found. Updating moov atom.\n");
-                                    m_moov.clear();
-                                    PushFtypAndMoov(m_moov);
+                                else if (h265 && table.size() == 1) {
+                                    ParseH265Pps(ps);
                                 }
                             }
+                            else if (it == table.end()) {
+                                // New ID, added to the tables at a key frame after the whole access unit is parsed
+                                newIDFound = true;
+                            }
+                            else {
+                                parameterChanged = true;
+                            }
                         }
-                        else if (m_ppsMap[picParameterSetID].size() != len ||
-                                 !std::equal(nal, nal + len, m_ppsMap[picParameterSetID].begin())) {
-                            parameterChanged = true;
+                        if (m_inbandParameterSets) {
+                            sampleSize += 4 + len;
+                            PushUint(m_videoMdat, static_cast<uint32_t>(len));
+                            m_videoMdat.insert(m_videoMdat.end(), nal, nal + len);
                         }
                     }
                     else if (nalUnitType == (h265 ? 35 : 9)) {
@@ -404,12 +833,10 @@ void CMp4Fragmenter::AddVideoPes(const std::vector<uint8_t> &pes, bool h265)
                             // Non-IDR
                             // Emulation prevention should not appear unless first_mb_in_slice value is huge
                             if (len >= 5 && (nal[1] != 0 || nal[2] != 0 || nal[3] != 3)) {
-                                uint8_t sliceIntro[16] = {};
-                                std::copy(nal + 1, nal + 5, sliceIntro);
-                                size_t pos = 0;
+                                CBitReader br(nal + 1, 4);
                                 // first_mb_in_slice
-                                ReadUegBits(sliceIntro, pos);
-                                int sliceType = ReadUegBits(sliceIntro, pos);
+                                br.ReadUeg();
+                                int sliceType = br.ReadUeg();
                                 if (sliceType == 2 || sliceType == 4 || sliceType == 7 || sliceType == 9) {
                                     // I or SI picture
                                     isKey = true;
@@ -430,9 +857,42 @@ void CMp4Fragmenter::AddVideoPes(const std::vector<uint8_t> &pes, bool h265)
                 parameterChanged = true;
             }
 
+            if (parameterChanged && isKey && !spsMap.empty() && !ppsMap.empty() && (!h265 || !vpsMap.empty())) {
+                // Close the samples so far with the current header and start a new header from this IRAP
+                std::vector<uint8_t> sample(m_videoMdat.end() - sampleSize, m_videoMdat.end());
+                m_videoMdat.resize(m_videoMdat.size() - sampleSize);
+                PushFragment();
+                m_lastFragmentOpen = false;
+                SwitchVideoParameters(vpsMap, spsMap, ppsMap, h265, false);
+                fprintf(stderr, "Warning: Video parameters have changed. Header regenerated.\n");
+                ++m_warningCount;
+                m_videoMdat.swap(sample);
+                // The sample duration is unknown since the timeline may be discontinuous
+                lastDts = -1;
+                parameterChanged = false;
+            }
+            else if (!parameterChanged && !m_inbandParameterSets && m_codecWidth >= 0) {
+                // New IDs extend the tables. Fragments so far remain decodable with the extended header, so it keeps the version.
+                if (newIDFound) {
+                    MergeNewParameterSets(m_newVpsMap, vpsMap, m_vpsMap, 16);
+                    MergeNewParameterSets(m_newSpsMap, spsMap, m_spsMap, 31);
+                    MergeNewParameterSets(m_newPpsMap, ppsMap, m_ppsMap, 255);
+                }
+                if (isKey && (!m_newVpsMap.empty() || !m_newSpsMap.empty() || !m_newPpsMap.empty())) {
+                    PARAMETER_SET_MAP newVpsMap = m_vpsMap;
+                    PARAMETER_SET_MAP newSpsMap = m_spsMap;
+                    PARAMETER_SET_MAP newPpsMap = m_ppsMap;
+                    newVpsMap.insert(m_newVpsMap.begin(), m_newVpsMap.end());
+                    newSpsMap.insert(m_newSpsMap.begin(), m_newSpsMap.end());
+                    newPpsMap.insert(m_newPpsMap.begin(), m_newPpsMap.end());
+                    SwitchVideoParameters(newVpsMap, newSpsMap, newPpsMap, h265, true);
+                }
+            }
+
             if (m_codecWidth < 0 || parameterChanged) {
                 if (parameterChanged) {
                     fprintf(stderr, "Warning: Video parameters have changed.\n");
+                    ++m_warningCount;
                 }
                 m_videoMdat.clear();
                 m_videoSampleInfos.clear();
@@ -443,6 +903,9 @@ void CMp4Fragmenter::AddVideoPes(const std::vector<uint8_t> &pes, bool h265)
                 info.isKey = isKey;
                 int64_t diff = (0x200000000 + m_videoDts - lastDts) & 0x1ffffffff;
                 info.sampleDuration = lastDts < 0 || diff > 900000 ? -1 : static_cast<int>(diff);
+                if (0 < info.sampleDuration && info.sampleDuration <= 90000) {
+                    m_videoSampleDurationEstimate = info.sampleDuration;
+                }
                 diff = (0x200000000 + m_videoPts - m_videoDts) & 0x1ffffffff;
                 info.compositionTimeOffsets = diff > 900000 ? 0 : static_cast<int>(diff);
                 m_videoSampleInfos.push_back(info);
@@ -451,70 +914,151 @@ void CMp4Fragmenter::AddVideoPes(const std::vector<uint8_t> &pes, bool h265)
     }
 }
 
-void CMp4Fragmenter::AddAudioPes(const std::vector<uint8_t> &pes)
+void CMp4Fragmenter::MergeNewParameterSets(PARAMETER_SET_MAP &newMap, const PARAMETER_SET_MAP &auMap, const PARAMETER_SET_MAP &table, size_t maxNum)
+{
+    for (auto it = auMap.begin(); it != auMap.end(); ++it) {
+        if (table.find(it->first) == table.end() && (newMap.count(it->first) || table.size() + newMap.size() < maxNum)) {
+            newMap[it->first] = it->second;
+        }
+    }
+}
+
+void CMp4Fragmenter::SwitchVideoParameters(const PARAMETER_SET_MAP &vpsMap, const PARAMETER_SET_MAP &spsMap, const PARAMETER_SET_MAP &ppsMap, bool h265,
+                                           bool extendsTables)
+{
+    m_h265 = h265;
+    m_parallelismType = 0;
+    m_numTemporalLayers = 1;
+    m_temporalIDNestingFlag = false;
+    m_vpsMap = vpsMap;
+    m_spsMap = spsMap;
+    m_ppsMap = ppsMap;
+    if (h265) {
+        ParseVps(m_vpsMap.begin()->second);
+    }
+    if (!(h265 ? ParseH265Sps(m_spsMap.begin()->second) : ParseSps(m_spsMap.begin()->second))) {
+        m_codecWidth = -1;
+    }
+    if (h265) {
+        ParseH265Pps(m_ppsMap.begin()->second);
+    }
+    m_newVpsMap.clear();
+    m_newSpsMap.clear();
+    m_newPpsMap.clear();
+    m_moov.clear();
+    if (m_codecWidth >= 0) {
+        PushFtypAndMoov(m_moov);
+    }
+    // Otherwise the header is recreated when valid parameters are found
+    if (!extendsTables || m_moov.empty()) {
+        ++m_headerVersion;
+    }
+}
+
+void CMp4Fragmenter::AddAudioPes(const std::vector<uint8_t> &pes, int streamType)
 {
+    const uint8_t PRIVATE_STREAM_1 = 0xbd;
+
     int streamID = pes[3];
-    if ((streamID & 0xe0) == 0xc0 && pes.size() >= 9) {
+    if (((streamID & 0xe0) == 0xc0 || ((streamType == AC3_AUDIO || streamType == EAC3_AUDIO) && streamID == PRIVATE_STREAM_1)) &&
+        pes.size() >= 9) {
         size_t payloadPos = 9 + pes[8];
-        if (payloadPos < pes.size() && SyncAdtsPayload(m_workspace, &pes[payloadPos], pes.size() - payloadPos)) {
+        if (payloadPos < pes.size() && SyncAudioPayload(m_workspace, &pes[payloadPos], pes.size() - payloadPos, streamType)) {
             int ptsDtsFlags = pes[7] >> 6;
             if (ptsDtsFlags >= 2 && pes.size() >= 14) {
                 m_audioPts = get_pes_timestamp(&pes[9]);
             }
+            // Whether the frame continuing the sample can be appended
+            bool sampleAppendable = !m_audioSampleSizes.empty() || !m_audioPendingSample.empty();
             while (m_workspace.size() > 0) {
-                if (m_workspace[0] != 0xff) {
+                if (!IsAudioSyncWord(streamType, m_workspace.data(), m_workspace.size())) {
                     // Need to resync
                     m_workspace.clear();
                     break;
                 }
-                if (m_workspace.size() < 7) {
-                    break;
-                }
-                if ((m_workspace[1] & 0xf0) != 0xf0) {
-                    m_workspace.clear();
-                    break;
-                }
-
-                // ADTS header
-                size_t pos = 12;
-                pos += 3;
-                bool protectionAbsent = read_bool(m_workspace.data(), pos);
-                int profile = read_bits(m_workspace.data(), pos, 2);
-                int samplingFrequencyIndex = read_bits(m_workspace.data(), pos, 4);
-                ++pos;
-                int channelConfiguration = read_bits(m_workspace.data(), pos, 3);
-                pos += 4;
-                size_t frameLenBytes = read_bits(m_workspace.data(), pos, 13);
-                size_t headerSize = protectionAbsent ? 7 : 9;
-                if (frameLenBytes < headerSize) {
+                AUDIO_FRAME_HEADER header;
+                int parsed = ParseAudioFrameHeader(streamType, m_workspace.data(), m_workspace.size(), header);
+                if (parsed < 0) {
                     m_workspace.clear();
                     break;
                 }
-                if (m_workspace.size() < frameLenBytes) {
+                if (parsed == 0 || m_workspace.size() < header.frameLenBytes) {
                     break;
                 }
 
-                if (m_moov.empty() && samplingFrequencyIndex < 13) {
-                    static const int SAMPLING_FREQUENCY[13] = {
-                        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
-                    };
-                    m_aacProfile = profile;
-                    m_samplingFrequency = SAMPLING_FREQUENCY[samplingFrequencyIndex];
-                    m_samplingFrequencyIndex = samplingFrequencyIndex;
-                    m_channelConfiguration = channelConfiguration;
+                if (!header.startsSample) {
+                    if (sampleAppendable) {
+                        if (!m_audioPendingSample.empty()) {
+                            m_audioPendingSample.insert(m_audioPendingSample.end(), m_workspace.begin(), m_workspace.begin() + header.frameLenBytes);
+                        }
+                        else {
+                            m_audioMdat.insert(m_audioMdat.end(), m_workspace.begin(), m_workspace.begin() + header.frameLenBytes);
+                            m_audioSampleSizes.back() = static_cast<uint16_t>(m_audioSampleSizes.back() + header.frameLenBytes);
+                        }
+                        if (header.chanLoc >= 0) {
+                            ++m_eac3DepSubCount;
+                            m_eac3DepSubNum = std::max(m_eac3DepSubNum, m_eac3DepSubCount);
+                            m_eac3ChanLoc |= header.chanLoc;
+                        }
+                    }
                 }
-                if (m_aacProfile == profile &&
-                    m_samplingFrequencyIndex == samplingFrequencyIndex &&
-                    m_channelConfiguration == channelConfiguration)
-                {
-                    m_audioMdat.insert(m_audioMdat.end(), m_workspace.begin() + headerSize, m_workspace.begin() + frameLenBytes);
-                    m_audioSampleSizes.push_back(static_cast<uint16_t>(frameLenBytes - headerSize));
+                else {
+                    if (m_moov.empty() && header.samplingFrequency > 0) {
+                        m_audioStreamType = streamType;
+                        m_aacProfile = header.aacProfile;
+                        m_samplingFrequency = header.samplingFrequency;
+                        m_samplingFrequencyIndex = header.samplingFrequencyIndex;
+                        m_channelConfiguration = header.channelConfiguration;
+                        m_audioSampleDuration = header.sampleDuration;
+                        m_audioSpecificBox.assign(header.specificBox, header.specificBox + header.specificBoxSize);
+                    }
+                    sampleAppendable = m_audioStreamType == streamType &&
+                                       m_aacProfile == header.aacProfile &&
+                                       m_samplingFrequency == header.samplingFrequency &&
+                                       m_samplingFrequencyIndex == header.samplingFrequencyIndex &&
+                                       m_channelConfiguration == header.channelConfiguration &&
+                                       m_audioSampleDuration == header.sampleDuration;
+                    m_eac3DepSubCount = 0;
+                    if (!sampleAppendable || header.frameDuration >= header.sampleDuration) {
+                        m_audioPendingSample.clear();
+                        m_audioPendingDuration = 0;
+                    }
+                    if (sampleAppendable && header.frameDuration < header.sampleDuration) {
+                        // Aggregate frames until the sample is filled, even across fragments
+                        m_audioPendingSample.insert(m_audioPendingSample.end(), m_workspace.begin() + header.headerSize, m_workspace.begin() + header.frameLenBytes);
+                        m_audioPendingDuration += header.frameDuration;
+                        if (m_audioPendingDuration >= header.sampleDuration) {
+                            m_audioMdat.insert(m_audioMdat.end(), m_audioPendingSample.begin(), m_audioPendingSample.end());
+                            m_audioSampleSizes.push_back(static_cast<uint16_t>(m_audioPendingSample.size()));
+                            m_audioPendingSample.clear();
+                            m_audioPendingDuration = 0;
+                        }
+                    }
+                    else if (sampleAppendable) {
+                        m_audioMdat.insert(m_audioMdat.end(), m_workspace.begin() + header.headerSize, m_workspace.begin() + header.frameLenBytes);
+                        m_audioSampleSizes.push_back(static_cast<uint16_t>(header.frameLenBytes - header.headerSize));
+                    }
                 }
-                m_workspace.erase(m_workspace.begin(), m_workspace.begin() + frameLenBytes);
+                if (m_moov.empty() && m_audioStreamType == EAC3_AUDIO && streamType == EAC3_AUDIO && m_audioSpecificBox.size() >= 5) {
+                    // Derive data_rate and the dependent substreams of "dec3" from all the frames so far
+                    m_eac3Bytes += header.frameLenBytes;
+                    if (header.startsSample) {
+                        m_eac3Duration += header.frameDuration;
+                    }
+                    int dataRate = m_eac3Duration > 0 ? static_cast<int>(m_eac3Bytes * 8 * m_samplingFrequency / m_eac3Duration / 1000) : 0;
+                    m_audioSpecificBox[0] = static_cast<uint8_t>(dataRate >> 5);
+                    m_audioSpecificBox[1] = static_cast<uint8_t>(((dataRate & 0x1f) << 3) | (m_audioSpecificBox[1] & 0x07));
+                    m_audioSpecificBox.resize(5);
+                    m_audioSpecificBox[4] = static_cast<uint8_t>((m_eac3DepSubNum << 1) | (m_eac3DepSubNum > 0 ? m_eac3ChanLoc >> 8 : 0));
+                    if (m_eac3DepSubNum > 0) {
+                        m_audioSpecificBox.push_back(static_cast<uint8_t>(m_eac3ChanLoc));
+                    }
+                }
+                m_workspace.erase(m_workspace.begin(), m_workspace.begin() + header.frameLenBytes);
             }
 
             if (!m_workspace.empty()) {
-                // This 0 means synchronized 0xff.
+                // This 0 means synchronized 0xff (or 0x0b for AC-3).
                 m_workspace[0] = 0;
             }
         }
@@ -653,7 +1197,8 @@ void CMp4Fragmenter::PushFtypAndMoov(std::vector<uint8_t> &data) const
                         PushBox(data, "stbl", [this](std::vector<uint8_t> &data) {
                             PushFullBox(data, "stsd", 0x00000000, [this](std::vector<uint8_t> &data) {
                                 PushUint(data, 1);
-                                PushBox(data, m_h265 ? "hvc1" : "avc1", [this](std::vector<uint8_t> &data) {
+                                const char *sampleEntryType = m_h265 ? (m_inbandParameterSets ? "hev1" : "hvc1") : (m_inbandParameterSets ? "avc3" : "avc1");
+                                PushBox(data, m_encrypted ? "encv" : sampleEntryType, [this, sampleEntryType](std::vector<uint8_t> &data) {
                                     for (int i = 0; i < 6; ++i) {
                                         data.push_back(RESERVED_0);
                                     }
@@ -695,71 +1240,45 @@ void CMp4Fragmenter::PushFtypAndMoov(std::vector<uint8_t> &data) const
                                             data.push_back(0);
                                             data.push_back(((m_numTemporalLayers & 0x07) << 3) | (m_temporalIDNestingFlag << 2) | 3);
                                             data.push_back(3);
-                                            data.push_back(0x80 | 32);
-                                            PushUshort(data, m_vps.empty() ? 0 : 1);
-                                            if (m_vps.empty()) {
+                                            // array_completeness is 0 if parameter sets may also be in samples
+                                            uint8_t completeness = m_inbandParameterSets ? 0 : 0x80;
+                                            data.push_back(completeness | 32);
+                                            PushUshort(data, static_cast<uint32_t>(m_vpsMap.size()));
+                                            if (m_vpsMap.empty()) {
                                                 fprintf(stderr, "Warning: No VPS was found when generating moov atom.\n");
+                                                ++m_warningCount;
                                             }
-                                            else {
-                                                PushUshort(data, static_cast<uint32_t>(m_vps.size()));
-                                                data.insert(data.end(), m_vps.begin(), m_vps.end());
-                                            }
-                                            data.push_back(0x80 | 33);
-                                            PushUshort(data, 1);
-                                            PushUshort(data, static_cast<uint32_t>(m_sps.size()));
-                                            data.insert(data.end(), m_sps.begin(), m_sps.end());
-                                            data.push_back(0x80 | 34);
+                                            PushParameterSets(data, m_vpsMap);
+                                            data.push_back(completeness | 33);
+                                            PushUshort(data, static_cast<uint32_t>(m_spsMap.size()));
+                                            PushParameterSets(data, m_spsMap);
+                                            data.push_back(completeness | 34);
                                             PushUshort(data, static_cast<uint32_t>(m_ppsMap.size()));
                                             if (m_ppsMap.empty()) {
                                                 fprintf(stderr, "Warning: No PPS was found when generating moov atom.\n");
+                                                ++m_warningCount;
                                             }
-                                            for (int idMin = -1;;) {
-                                                // ascending order
-                                                auto itMin = m_ppsMap.end();
-                                                for (auto it = m_ppsMap.begin(); it != m_ppsMap.end(); ++it) {
-                                                    if (it->first > idMin && (itMin == m_ppsMap.end() || itMin->first > it->first)) {
-                                                        itMin = it;
-                                                    }
-                                                }
-                                                if (itMin == m_ppsMap.end()) {
-                                                    break;
-                                                }
-                                                idMin = itMin->first;
-                                                PushUshort(data, static_cast<uint32_t>(itMin->second.size()));
-                                                data.insert(data.end(), itMin->second.begin(), itMin->second.end());
-                                            }
+                                            PushParameterSets(data, m_ppsMap);
                                         });
                                     }
                                     else {
                                         PushBox(data, "avcC", [this](std::vector<uint8_t> &data) {
+                                            const std::vector<uint8_t> &sps = m_spsMap.begin()->second;
+                                            int profileIdc = sps.size() >= 4 ? sps[1] : 0;
                                             data.push_back(1);
-                                            data.push_back(m_sps[1]);
-                                            data.push_back(m_sps[2]);
-                                            data.push_back(m_sps[3]);
+                                            data.push_back(static_cast<uint8_t>(profileIdc));
+                                            data.push_back(sps.size() >= 4 ? sps[2] : 0);
+                                            data.push_back(sps.size() >= 4 ? sps[3] : 0);
                                             data.push_back(0xff);
-                                            data.push_back(0xe1);
-                                            PushUshort(data, static_cast<uint32_t>(m_sps.size()));
-                                            data.insert(data.end(), m_sps.begin(), m_sps.end());
+                                            data.push_back(static_cast<uint8_t>(0xe0 | m_spsMap.size()));
+                                            PushParameterSets(data, m_spsMap);
                                             data.push_back(static_cast<uint8_t>(m_ppsMap.size()));
                                             if (m_ppsMap.empty()) {
                                                 fprintf(stderr, "Warning: No PPS was found when generating moov atom.\n");
+                                                ++m_warningCount;
                                             }
-                                            for (int idMin = -1;;) {
-                                                // ascending order
-                                                auto itMin = m_ppsMap.end();
-                                                for (auto it = m_ppsMap.begin(); it != m_ppsMap.end(); ++it) {
-                                                    if (it->first > idMin && (itMin == m_ppsMap.end() || itMin->first > it->first)) {
-                                                        itMin = it;
-                                                    }
-                                                }
-                                                if (itMin == m_ppsMap.end()) {
-                                                    break;
-                                                }
-                                                idMin = itMin->first;
-                                                PushUshort(data, static_cast<uint32_t>(itMin->second.size()));
-                                                data.insert(data.end(), itMin->second.begin(), itMin->second.end());
-                                            }
-                                            if (m_sps[3] != 66 && m_sps[3] != 77 && m_sps[3] != 88) {
+                                            PushParameterSets(data, m_ppsMap);
+                                            if (profileIdc != 66 && profileIdc != 77 && profileIdc != 88) {
                                                 data.push_back(static_cast<uint8_t>(0xfc | m_chromaFormatIdc));
                                                 data.push_back(static_cast<uint8_t>(0xf8 | m_bitDepthLumaMinus8));
                                                 data.push_back(static_cast<uint8_t>(0xf8 | m_bitDepthChromaMinus8));
@@ -767,6 +1286,9 @@ void CMp4Fragmenter::PushFtypAndMoov(std::vector<uint8_t> &data) const
                                             }
                                         });
                                     }
+                                    if (m_encrypted) {
+                                        PushProtectionSchemeInfo(data, sampleEntryType, true);
+                                    }
                                 });
                             });
                             PushFullBox(data, "stts", 0x00000000, [](std::vector<uint8_t> &data) {
@@ -788,7 +1310,7 @@ void CMp4Fragmenter::PushFtypAndMoov(std::vector<uint8_t> &data) const
             });
         }
 
-        if (m_aacProfile >= 0) {
+        if (m_audioStreamType >= 0) {
             PushBox(data, "trak", [this](std::vector<uint8_t> &data) {
                 PushFullBox(data, "tkhd", 0x00000003, [](std::vector<uint8_t> &data) {
                     PushUint(data, 0);
@@ -850,7 +1372,8 @@ void CMp4Fragmenter::PushFtypAndMoov(std::vector<uint8_t> &data) const
                         PushBox(data, "stbl", [this](std::vector<uint8_t> &data) {
                             PushFullBox(data, "stsd", 0x00000000, [this](std::vector<uint8_t> &data) {
                                 PushUint(data, 1);
-                                PushBox(data, "mp4a", [this](std::vector<uint8_t> &data) {
+                                const char *sampleEntryType = m_audioStreamType == AC3_AUDIO ? "ac-3" : m_audioStreamType == EAC3_AUDIO ? "ec-3" : "mp4a";
+                                PushBox(data, m_encrypted ? "enca" : sampleEntryType, [this, sampleEntryType](std::vector<uint8_t> &data) {
                                     for (int i = 0; i < 6; ++i) {
                                         data.push_back(RESERVED_0);
                                     }
@@ -862,35 +1385,50 @@ void CMp4Fragmenter::PushFtypAndMoov(std::vector<uint8_t> &data) const
                                     PushUint(data, RESERVED_0);
                                     PushUshort(data, m_samplingFrequency);
                                     PushUshort(data, 0);
-                                    PushFullBox(data, "esds", 0x00000000, [this](std::vector<uint8_t> &data) {
-                                        // ES_Descriptor {
-                                        data.push_back(0x03);
-                                        data.push_back(25);
-                                        PushUshort(data, 1);
-                                        data.push_back(0);
-                                        // DecoderConfigDescriptor {
-                                        data.push_back(0x04);
-                                        data.push_back(17);
-                                        data.push_back(0x40);
-                                        data.push_back(0x15);
-                                        data.push_back(0);
-                                        data.push_back(0);
-                                        data.push_back(0);
-                                        PushUint(data, 0);
-                                        PushUint(data, 0);
-                                        // DecoderSpecificInfo {
-                                        data.push_back(0x05);
-                                        data.push_back(2);
-                                        // (AudioSpecificConfig)
-                                        data.push_back(static_cast<uint8_t>(((m_aacProfile + 1) << 3) | (m_samplingFrequencyIndex >> 1)));
-                                        data.push_back(static_cast<uint8_t>(((m_samplingFrequencyIndex & 0x01) << 7) | (m_channelConfiguration << 3)));
-                                        // }}
-                                        // SLConfigDescriptor {
-                                        data.push_back(0x06);
-                                        data.push_back(1);
-                                        data.push_back(2);
-                                        // }}
-                                    });
+                                    if (m_audioStreamType == AC3_AUDIO || m_audioStreamType == EAC3_AUDIO) {
+                                        PushBox(data, m_audioStreamType == AC3_AUDIO ? "dac3" : "dec3", [this](std::vector<uint8_t> &data) {
+                                            data.insert(data.end(), m_audioSpecificBox.begin(), m_audioSpecificBox.end());
+                                        });
+                                    }
+                                    else {
+                                        PushFullBox(data, "esds", 0x00000000, [this](std::vector<uint8_t> &data) {
+                                            bool isAac = m_audioStreamType == ADTS_TRANSPORT;
+                                            // ES_Descriptor {
+                                            data.push_back(0x03);
+                                            data.push_back(isAac ? 25 : 21);
+                                            PushUshort(data, 1);
+                                            data.push_back(0);
+                                            // DecoderConfigDescriptor {
+                                            data.push_back(0x04);
+                                            data.push_back(isAac ? 17 : 13);
+                                            // MPEG-4 audio, or MPEG-1 (or MPEG-2 lower sampling frequency) audio
+                                            data.push_back(isAac ? 0x40 : m_samplingFrequency >= 32000 ? 0x6b : 0x69);
+                                            data.push_back(0x15);
+                                            data.push_back(0);
+                                            data.push_back(0);
+                                            data.push_back(0);
+                                            PushUint(data, 0);
+                                            PushUint(data, 0);
+                                            if (isAac) {
+                                                // DecoderSpecificInfo {
+                                                data.push_back(0x05);
+                                                data.push_back(2);
+                                                // (AudioSpecificConfig)
+                                                data.push_back(static_cast<uint8_t>(((m_aacProfile + 1) << 3) | (m_samplingFrequencyIndex >> 1)));
+                                                data.push_back(static_cast<uint8_t>(((m_samplingFrequencyIndex & 0x01) << 7) | (m_channelConfiguration << 3)));
+                                                // }
+                                            }
+                                            // }
+                                            // SLConfigDescriptor {
+                                            data.push_back(0x06);
+                                            data.push_back(1);
+                                            data.push_back(2);
+                                            // }}
+                                        });
+                                    }
+                                    if (m_encrypted) {
+                                        PushProtectionSchemeInfo(data, sampleEntryType, false);
+                                    }
                                 });
                             });
                             PushFullBox(data, "stts", 0x00000000, [](std::vector<uint8_t> &data) {
@@ -922,7 +1460,7 @@ void CMp4Fragmenter::PushFtypAndMoov(std::vector<uint8_t> &data) const
                     PushUint(data, 0);
                 });
             }
-            if (m_aacProfile >= 0) {
+            if (m_audioStreamType >= 0) {
                 PushFullBox(data, "trex", 0x00000000, [](std::vector<uint8_t> &data) {
                     PushUint(data, AUDIO_TRACK_ID);
                     PushUint(data, 1);
@@ -943,12 +1481,27 @@ void CMp4Fragmenter::PushMoof(std::vector<uint8_t> &data, std::pair<int, int> &f
     if (!m_videoSampleInfos.empty()) {
         size_t moofBegin = data.size();
         size_t offsetFieldPos = 0;
+        // Subsamples of all samples in order, and the number of them in each sample
+        std::vector<std::pair<uint32_t, uint32_t>> subsamples;
+        std::vector<size_t> subsampleNums;
+        if (m_encrypted) {
+            size_t samplePos = 0;
+            for (auto it = m_videoSampleInfos.begin(); it != m_videoSampleInfos.end(); ++it) {
+                size_t subsampleNum = subsamples.size();
+                if (!PushCbcsSubsamples(subsamples, m_videoMdat.data() + samplePos, it->sampleSize, m_h265)) {
+                    fprintf(stderr, "Warning: Too many slices in a sample. Some of them are left clear.\n");
+                    ++m_warningCount;
+                }
+                subsampleNums.push_back(subsamples.size() - subsampleNum);
+                samplePos += it->sampleSize;
+            }
+        }
         ++fragCount;
-        PushBox(data, "moof", [this, fragCount, &fragDuration, &offsetFieldPos](std::vector<uint8_t> &data) {
+        PushBox(data, "moof", [this, moofBegin, fragCount, &fragDuration, &offsetFieldPos, &subsamples, &subsampleNums](std::vector<uint8_t> &data) {
             PushFullBox(data, "mfhd", 0x00000000, [fragCount](std::vector<uint8_t> &data) {
                 PushUint(data, fragCount);
             });
-            PushBox(data, "traf", [this, &fragDuration, &offsetFieldPos](std::vector<uint8_t> &data) {
+            PushBox(data, "traf", [this, moofBegin, &fragDuration, &offsetFieldPos, &subsamples, &subsampleNums](std::vector<uint8_t> &data) {
                 PushFullBox(data, "tfhd", 0x00000000, [](std::vector<uint8_t> &data) {
                     PushUint(data, VIDEO_TRACK_ID);
                 });
@@ -959,24 +1512,66 @@ void CMp4Fragmenter::PushMoof(std::vector<uint8_t> &data, std::pair<int, int> &f
                     PushUint(data, static_cast<uint32_t>(m_videoSampleInfos.size()));
                     offsetFieldPos = data.size();
                     PushUint(data, 0);
-                    for (auto it = m_videoSampleInfos.begin(); it != m_videoSampleInfos.end(); ++it) {
-                        auto itDuration = std::find_if(it, m_videoSampleInfos.end(),
-                                                       [](const VIDEO_SAMPLE_INFO &a) { return a.sampleDuration >= 0; });
-                        int duration = itDuration == m_videoSampleInfos.end() ? 3000 : itDuration->sampleDuration;
-                        fragDuration.first += duration;
+                    // A sample of unknown duration takes that of the nearest following known one, or the estimate if none
+                    std::vector<int> durations(m_videoSampleInfos.size());
+                    int duration = m_videoSampleDurationEstimate;
+                    for (size_t i = durations.size(); i > 0; --i) {
+                        if (m_videoSampleInfos[i - 1].sampleDuration >= 0) {
+                            duration = m_videoSampleInfos[i - 1].sampleDuration;
+                        }
+                        durations[i - 1] = duration;
+                    }
+                    for (size_t i = 0; i < m_videoSampleInfos.size(); ++i) {
+                        fragDuration.first += durations[i];
                         fragDuration.second = 90000;
-                        PushUint(data, duration);
-                        PushUint(data, it->sampleSize);
-                        PushUint(data, it->isKey ? 0x02400000 : 0x01010000);
-                        PushUint(data, it->compositionTimeOffsets);
+                        PushUint(data, durations[i]);
+                        PushUint(data, m_videoSampleInfos[i].sampleSize);
+                        PushUint(data, m_videoSampleInfos[i].isKey ? 0x02400000 : 0x01010000);
+                        PushUint(data, m_videoSampleInfos[i].compositionTimeOffsets);
                     }
                 });
+                if (m_encrypted) {
+                    PushSeigSampleGroup(data, static_cast<uint32_t>(m_videoSampleInfos.size()), true);
+                    // Sample auxiliary information holds only the subsamples since the IV is constant
+                    PushFullBox(data, "saiz", 0x00000000, [&subsampleNums](std::vector<uint8_t> &data) {
+                        data.push_back(0);
+                        PushUint(data, static_cast<uint32_t>(subsampleNums.size()));
+                        for (auto it = subsampleNums.begin(); it != subsampleNums.end(); ++it) {
+                            data.push_back(static_cast<uint8_t>(2 + 6 * *it));
+                        }
+                    });
+                    size_t auxOffsetFieldPos = 0;
+                    PushFullBox(data, "saio", 0x00000000, [&auxOffsetFieldPos](std::vector<uint8_t> &data) {
+                        PushUint(data, 1);
+                        auxOffsetFieldPos = data.size();
+                        PushUint(data, 0);
+                    });
+                    PushFullBox(data, "senc", 0x00000002, [moofBegin, auxOffsetFieldPos, &subsamples, &subsampleNums](std::vector<uint8_t> &data) {
+                        PushUint(data, static_cast<uint32_t>(subsampleNums.size()));
+                        WriteUint(&data[auxOffsetFieldPos], static_cast<uint32_t>(data.size() - moofBegin));
+                        auto jt = subsamples.begin();
+                        for (auto it = subsampleNums.begin(); it != subsampleNums.end(); ++it) {
+                            PushUshort(data, static_cast<uint32_t>(*it));
+                            for (size_t i = 0; i < *it; ++i, ++jt) {
+                                PushUshort(data, jt->first);
+                                PushUint(data, jt->second);
+                            }
+                        }
+                    });
+                }
             });
         });
 
-        PushBox(data, "mdat", [this, moofBegin, offsetFieldPos](std::vector<uint8_t> &data) {
+        PushBox(data, "mdat", [this, moofBegin, offsetFieldPos, &subsamples](std::vector<uint8_t> &data) {
             WriteUint(&data[offsetFieldPos], static_cast<uint32_t>(data.size() - moofBegin));
             data.insert(data.end(), m_videoMdat.begin(), m_videoMdat.end());
+            // Encrypt in place, the IV is reset for each subsample
+            uint8_t *sample = data.data() + data.size() - m_videoMdat.size();
+            for (auto it = subsamples.begin(); it != subsamples.end(); ++it) {
+                sample += it->first;
+                m_aes.EncryptPattern(sample, it->second, CBCS_CRYPT_BLOCKS, CBCS_SKIP_BLOCKS, m_constantIv);
+                sample += it->second;
+            }
         });
     }
 
@@ -989,9 +1584,9 @@ void CMp4Fragmenter::PushMoof(std::vector<uint8_t> &data, std::pair<int, int> &f
                 PushUint(data, fragCount);
             });
             PushBox(data, "traf", [this, &fragDuration, &offsetFieldPos](std::vector<uint8_t> &data) {
-                PushFullBox(data, "tfhd", 0x00000028, [](std::vector<uint8_t> &data) {
+                PushFullBox(data, "tfhd", 0x00000028, [this](std::vector<uint8_t> &data) {
                     PushUint(data, AUDIO_TRACK_ID);
-                    PushUint(data, 1024);
+                    PushUint(data, m_audioSampleDuration);
                     PushUint(data, 0x02000000);
                 });
                 PushFullBox(data, "tfdt", 0x01000000, [this](std::vector<uint8_t> &data) {
@@ -1005,37 +1600,99 @@ void CMp4Fragmenter::PushMoof(std::vector<uint8_t> &data, std::pair<int, int> &f
                         PushUint(data, m_audioSampleSizes[i]);
                     }
                     if (m_codecWidth < 0) {
-                        fragDuration.first = static_cast<int>(1024 * m_audioSampleSizes.size());
+                        fragDuration.first = static_cast<int>(m_audioSampleDuration * m_audioSampleSizes.size());
                         fragDuration.second = m_samplingFrequency;
                     }
                 });
+                if (m_encrypted) {
+                    PushSeigSampleGroup(data, static_cast<uint32_t>(m_audioSampleSizes.size()), false);
+                }
             });
         });
 
         PushBox(data, "mdat", [this, moofBegin, offsetFieldPos](std::vector<uint8_t> &data) {
             WriteUint(&data[offsetFieldPos], static_cast<uint32_t>(data.size() - moofBegin));
             data.insert(data.end(), m_audioMdat.begin(), m_audioMdat.end());
+            if (m_encrypted) {
+                // Whole samples are encrypted without pattern, needing no auxiliary information
+                uint8_t *sample = data.data() + data.size() - m_audioMdat.size();
+                for (auto it = m_audioSampleSizes.begin(); it != m_audioSampleSizes.end(); ++it) {
+                    m_aes.EncryptPattern(sample, *it, 0, 0, m_constantIv);
+                    sample += *it;
+                }
+            }
+        });
+    }
+}
+
+void CMp4Fragmenter::PushProtectionSchemeInfo(std::vector<uint8_t> &data, const char *originalFormat, bool isVideo) const
+{
+    PushBox(data, "sinf", [this, originalFormat, isVideo](std::vector<uint8_t> &data) {
+        PushBox(data, "frma", [originalFormat](std::vector<uint8_t> &data) {
+            PushString(data, originalFormat);
+        });
+        PushFullBox(data, "schm", 0x00000000, [](std::vector<uint8_t> &data) {
+            PushString(data, "cbcs");
+            PushUint(data, 0x00010000);
+        });
+        PushBox(data, "schi", [this, isVideo](std::vector<uint8_t> &data) {
+            PushFullBox(data, "tenc", 0x01000000, [this, isVideo](std::vector<uint8_t> &data) {
+                data.push_back(RESERVED_0);
+                // default_crypt_byte_block and default_skip_byte_block
+                data.push_back(isVideo ? (CBCS_CRYPT_BLOCKS << 4) | CBCS_SKIP_BLOCKS : 0);
+                // default_isProtected and default_Per_Sample_IV_Size (0 for the constant IV)
+                data.push_back(1);
+                data.push_back(0);
+                data.insert(data.end(), m_headerKeyId, m_headerKeyId + 16);
+                data.push_back(16);
+                data.insert(data.end(), m_headerConstantIv, m_headerConstantIv + 16);
+            });
         });
+    });
+}
+
+void CMp4Fragmenter::PushSeigSampleGroup(std::vector<uint8_t> &data, uint32_t sampleCount, bool isVideo) const
+{
+    if (std::equal(m_keyId, m_keyId + 16, m_headerKeyId) && std::equal(m_constantIv, m_constantIv + 16, m_headerConstantIv)) {
+        // The defaults in "tenc" apply
+        return;
     }
+    PushFullBox(data, "sbgp", 0x00000000, [sampleCount](std::vector<uint8_t> &data) {
+        PushString(data, "seig");
+        PushUint(data, 1);
+        PushUint(data, sampleCount);
+        // The first entry of "sgpd" in this fragment
+        PushUint(data, 0x10001);
+    });
+    PushFullBox(data, "sgpd", 0x01000000, [this, isVideo](std::vector<uint8_t> &data) {
+        PushString(data, "seig");
+        // default_length
+        PushUint(data, 37);
+        PushUint(data, 1);
+        data.push_back(RESERVED_0);
+        data.push_back(isVideo ? (CBCS_CRYPT_BLOCKS << 4) | CBCS_SKIP_BLOCKS : 0);
+        data.push_back(1);
+        data.push_back(0);
+        data.insert(data.end(), m_keyId, m_keyId + 16);
+        data.push_back(16);
+        data.insert(data.end(), m_constantIv, m_constantIv + 16);
+    });
 }
 
 bool CMp4Fragmenter::ParseSps(const std::vector<uint8_t> &ebspSps)
 {
     std::vector<uint8_t> rbspSps = EbspToRbsp(ebspSps);
-    size_t lenBits = rbspSps.size() * 8;
-    // 512bits overrun area
-    rbspSps.insert(rbspSps.end(), 64, 0);
-    const uint8_t *sps = rbspSps.data();
+    CBitReader br(rbspSps.data(), rbspSps.size());
     // for debug
     int r;
     static_cast<void>(r);
 
-    size_t pos = 8;
-    int profileIdc = read_bits(sps, pos, 8);
-    pos += 16;
-    r = ReadUegBits(sps, pos);
+    br.Skip(8);
+    int profileIdc = br.ReadBits(8);
+    br.Skip(16);
+    r = br.ReadUeg();
 
-    if (pos > lenBits) {
+    if (br.IsOverrun()) {
         return false;
     }
     m_chromaFormatIdc = 1;
@@ -1043,24 +1700,24 @@ bool CMp4Fragmenter::ParseSps(const std::vector<uint8_t> &ebspSps)
     m_bitDepthChromaMinus8 = 0;
     static const int HAS_CHROMA_INFO[12] = {100, 110, 122, 244, 44, 83, 86, 118, 128, 138, 139, 134};
     if (std::find(HAS_CHROMA_INFO, HAS_CHROMA_INFO + 12, profileIdc) != HAS_CHROMA_INFO + 12) {
-        m_chromaFormatIdc = ReadUegBits(sps, pos);
+        m_chromaFormatIdc = br.ReadUeg();
         if (m_chromaFormatIdc == 3) {
-            ++pos;
+            br.Skip(1);
         }
-        m_bitDepthLumaMinus8 = ReadUegBits(sps, pos);
-        m_bitDepthChromaMinus8 = ReadUegBits(sps, pos);
-        ++pos;
-        if (read_bool(sps, pos)) {
+        m_bitDepthLumaMinus8 = br.ReadUeg();
+        m_bitDepthChromaMinus8 = br.ReadUeg();
+        br.Skip(1);
+        if (br.ReadBool()) {
             int scalingListCount = m_chromaFormatIdc != 3 ? 8 : 12;
             for (int i = 0; i < scalingListCount; ++i) {
-                if (read_bool(sps, pos)) {
+                if (br.ReadBool()) {
                     int count = i < 6 ? 16 : 64;
                     int lastScale = 8;
                     while (--count >= 0 && lastScale != 0) {
-                        if (pos > lenBits) {
+                        if (br.IsOverrun()) {
                             return false;
                         }
-                        int deltaScale = ReadSegBits(sps, pos);
+                        int deltaScale = br.ReadSeg();
                         lastScale = (lastScale + deltaScale) & 0xff;
                     }
                 }
@@ -1068,57 +1725,57 @@ bool CMp4Fragmenter::ParseSps(const std::vector<uint8_t> &ebspSps)
         }
     }
 
-    if (pos > lenBits) {
+    if (br.IsOverrun()) {
         return false;
     }
-    r = ReadUegBits(sps, pos);
-    int picOrderCntType = ReadUegBits(sps, pos);
+    r = br.ReadUeg();
+    int picOrderCntType = br.ReadUeg();
     if (picOrderCntType == 0) {
-        r = ReadUegBits(sps, pos);
+        r = br.ReadUeg();
     }
     else if (picOrderCntType == 1) {
-        ++pos;
-        r = ReadSegBits(sps, pos);
-        r = ReadSegBits(sps, pos);
-        int numRefFramesInPicOrderCntCycle = ReadUegBits(sps, pos);
+        br.Skip(1);
+        r = br.ReadSeg();
+        r = br.ReadSeg();
+        int numRefFramesInPicOrderCntCycle = br.ReadUeg();
         for (int i = 0; i < numRefFramesInPicOrderCntCycle; ++i) {
-            if (pos > lenBits) {
+            if (br.IsOverrun()) {
                 return false;
             }
-            r = ReadSegBits(sps, pos);
+            r = br.ReadSeg();
         }
     }
 
-    r = ReadUegBits(sps, pos);
-    ++pos;
-    int picWidthInMbsMinus1 = ReadUegBits(sps, pos);
-    int picHeightInMapUnitsMinus1 = ReadUegBits(sps, pos);
-    bool frameMbsOnlyFlag = read_bool(sps, pos);
+    r = br.ReadUeg();
+    br.Skip(1);
+    int picWidthInMbsMinus1 = br.ReadUeg();
+    int picHeightInMapUnitsMinus1 = br.ReadUeg();
+    bool frameMbsOnlyFlag = br.ReadBool();
     if (!frameMbsOnlyFlag) {
-        ++pos;
+        br.Skip(1);
     }
-    ++pos;
+    br.Skip(1);
 
-    if (pos > lenBits) {
+    if (br.IsOverrun()) {
         return false;
     }
     int frameCropLeftOffset = 0;
     int frameCropRightOffset = 0;
     int frameCropTopOffset = 0;
     int frameCropBottomOffset = 0;
-    if (read_bool(sps, pos)) {
-        frameCropLeftOffset = ReadUegBits(sps, pos);
-        frameCropRightOffset = ReadUegBits(sps, pos);
-        frameCropTopOffset = ReadUegBits(sps, pos);
-        frameCropBottomOffset = ReadUegBits(sps, pos);
+    if (br.ReadBool()) {
+        frameCropLeftOffset = br.ReadUeg();
+        frameCropRightOffset = br.ReadUeg();
+        frameCropTopOffset = br.ReadUeg();
+        frameCropBottomOffset = br.ReadUeg();
     }
 
     m_sarWidth = 1;
     m_sarHeight = 1;
-    if (read_bool(sps, pos)) {
+    if (br.ReadBool()) {
         // VUI
-        if (read_bool(sps, pos)) {
-            int aspectRatioIdc = read_bits(sps, pos, 8);
+        if (br.ReadBool()) {
+            int aspectRatioIdc = br.ReadBits(8);
             static const int SAR_W_TABLE[17] = {1, 1, 12, 10, 16, 40, 24, 20, 32, 80, 18, 15, 64, 160, 4, 3, 2};
             static const int SAR_H_TABLE[17] = {1, 1, 11, 11, 11, 33, 11, 11, 11, 33, 11, 11, 33, 99, 3, 2, 1};
             if (aspectRatioIdc < 17) {
@@ -1126,8 +1783,34 @@ bool CMp4Fragmenter::ParseSps(const std::vector<uint8_t> &ebspSps)
                 m_sarHeight = SAR_H_TABLE[aspectRatioIdc];
             }
             else if (aspectRatioIdc == 255) {
-                m_sarWidth = read_bits(sps, pos, 16);
-                m_sarHeight = std::max(read_bits(sps, pos, 16), 1);
+                m_sarWidth = br.ReadBits(16);
+                m_sarHeight = std::max<int>(br.ReadBits(16), 1);
+            }
+        }
+        if (!br.IsOverrun()) {
+            // The rest is optional, so keep the result of the mandatory part
+            CBitReader vuiBr = br;
+            if (vuiBr.ReadBool()) {
+                vuiBr.Skip(1);
+            }
+            if (vuiBr.ReadBool()) {
+                vuiBr.Skip(4);
+                if (vuiBr.ReadBool()) {
+                    vuiBr.Skip(24);
+                }
+            }
+            if (vuiBr.ReadBool()) {
+                r = vuiBr.ReadUeg();
+                r = vuiBr.ReadUeg();
+            }
+            if (vuiBr.ReadBool()) {
+                // timing_info (a tick is a field)
+                uint32_t numUnitsInTick = vuiBr.ReadBits(32);
+                uint32_t timeScale = vuiBr.ReadBits(32);
+                int duration = GetFrameDurationFromTiming(numUnitsInTick, timeScale, 2);
+                if (!vuiBr.IsOverrun() && duration > 0) {
+                    m_videoSampleDurationEstimate = duration;
+                }
             }
         }
     }
@@ -1139,169 +1822,166 @@ bool CMp4Fragmenter::ParseSps(const std::vector<uint8_t> &ebspSps)
     m_codecWidth -= (frameCropLeftOffset + frameCropRightOffset) * cropUnitX;
     m_codecHeight -= (frameCropTopOffset + frameCropBottomOffset) * cropUnitY;
 
-    return pos <= lenBits;
+    return !br.IsOverrun();
 }
 
 bool CMp4Fragmenter::ParseH265Sps(const std::vector<uint8_t> &ebspSps)
 {
     std::vector<uint8_t> rbspSps = EbspToRbsp(ebspSps);
-    size_t lenBits = rbspSps.size() * 8;
-    // 512bits overrun area
-    rbspSps.insert(rbspSps.end(), 64, 0);
-    const uint8_t *sps = rbspSps.data();
-    size_t pos = 16;
+    CBitReader br(rbspSps.data(), rbspSps.size());
+    br.Skip(16);
     // for debug
     int r;
     static_cast<void>(r);
 
-    pos += 4;
-    int maxSubLayersMinus1 = read_bits(sps, pos, 3);
-    m_temporalIDNestingFlag = read_bool(sps, pos);
+    br.Skip(4);
+    int maxSubLayersMinus1 = br.ReadBits(3);
+    m_temporalIDNestingFlag = br.ReadBool();
 
-    m_generalProfileSpace = read_bits(sps, pos, 2);
-    m_generalTierFlag = read_bool(sps, pos);
-    m_generalProfileIdc = read_bits(sps, pos, 5);
+    m_generalProfileSpace = br.ReadBits(2);
+    m_generalTierFlag = br.ReadBool();
+    m_generalProfileIdc = br.ReadBits(5);
     for (int i = 0; i < 4; ++i) {
-        m_generalProfileCompatibilityFlags[i] = read_bits(sps, pos, 8) & 0xff;
+        m_generalProfileCompatibilityFlags[i] = br.ReadBits(8) & 0xff;
     }
     for (int i = 0; i < 6; ++i) {
-        m_generalConstraintIndicatorFlags[i] = read_bits(sps, pos, 8) & 0xff;
+        m_generalConstraintIndicatorFlags[i] = br.ReadBits(8) & 0xff;
     }
-    m_generalLevelIdc = read_bits(sps, pos, 8);
+    m_generalLevelIdc = br.ReadBits(8);
 
     bool subLayerProfilePresentFlag[8];
     bool subLayerLevelPresentFlag[8];
     for (int i = 0; i < maxSubLayersMinus1; ++i) {
-        subLayerProfilePresentFlag[i] = read_bool(sps, pos);
-        subLayerLevelPresentFlag[i] = read_bool(sps, pos);
+        subLayerProfilePresentFlag[i] = br.ReadBool();
+        subLayerLevelPresentFlag[i] = br.ReadBool();
     }
     if (maxSubLayersMinus1 > 0) {
         for (int i = maxSubLayersMinus1; i < 8; ++i) {
-            pos += 2;
+            br.Skip(2);
         }
     }
     for (int i = 0; i < maxSubLayersMinus1; ++i) {
         if (subLayerProfilePresentFlag[i]) {
-            pos += 88;
+            br.Skip(88);
         }
         if (subLayerLevelPresentFlag[i]) {
-            pos += 8;
+            br.Skip(8);
         }
     }
 
-    if (pos > lenBits) {
+    if (br.IsOverrun()) {
         return false;
     }
-    r = ReadUegBits(sps, pos);
-    m_chromaFormatIdc = ReadUegBits(sps, pos);
+    r = br.ReadUeg();
+    m_chromaFormatIdc = br.ReadUeg();
     if (m_chromaFormatIdc == 3) {
-        ++pos;
+        br.Skip(1);
     }
-    int picWidthInLumaSamples = ReadUegBits(sps, pos);
-    int picHeightInLumaSamples = ReadUegBits(sps, pos);
+    int picWidthInLumaSamples = br.ReadUeg();
+    int picHeightInLumaSamples = br.ReadUeg();
     int leftOffset = 0;
     int rightOffset = 0;
     int topOffset = 0;
     int bottomOffset = 0;
 
-    if (pos > lenBits) {
+    if (br.IsOverrun()) {
         return false;
     }
-    if (read_bool(sps, pos)) {
-        leftOffset = ReadUegBits(sps, pos);
-        rightOffset = ReadUegBits(sps, pos);
-        topOffset = ReadUegBits(sps, pos);
-        bottomOffset = ReadUegBits(sps, pos);
+    if (br.ReadBool()) {
+        leftOffset = br.ReadUeg();
+        rightOffset = br.ReadUeg();
+        topOffset = br.ReadUeg();
+        bottomOffset = br.ReadUeg();
     }
-    m_bitDepthLumaMinus8 = ReadUegBits(sps, pos);
-    m_bitDepthChromaMinus8 = ReadUegBits(sps, pos);
-    int log2MaxPicOrderCntLsbMinus4 = ReadUegBits(sps, pos);
-    bool subLayerOrderingInfoPresentFlag = read_bool(sps, pos);
+    m_bitDepthLumaMinus8 = br.ReadUeg();
+    m_bitDepthChromaMinus8 = br.ReadUeg();
+    int log2MaxPicOrderCntLsbMinus4 = br.ReadUeg();
+    bool subLayerOrderingInfoPresentFlag = br.ReadBool();
     for (int i = 0; i <= (subLayerOrderingInfoPresentFlag ? maxSubLayersMinus1 : 0); ++i) {
-        if (pos > lenBits) {
+        if (br.IsOverrun()) {
             return false;
         }
-        r = ReadUegBits(sps, pos);
-        r = ReadUegBits(sps, pos);
-        r = ReadUegBits(sps, pos);
+        r = br.ReadUeg();
+        r = br.ReadUeg();
+        r = br.ReadUeg();
     }
 
-    if (pos > lenBits) {
+    if (br.IsOverrun()) {
         return false;
     }
-    r = ReadUegBits(sps, pos);
-    r = ReadUegBits(sps, pos);
-    r = ReadUegBits(sps, pos);
-    r = ReadUegBits(sps, pos);
-    r = ReadUegBits(sps, pos);
-    r = ReadUegBits(sps, pos);
-
-    if (pos > lenBits) {
+    r = br.ReadUeg();
+    r = br.ReadUeg();
+    r = br.ReadUeg();
+    r = br.ReadUeg();
+    r = br.ReadUeg();
+    r = br.ReadUeg();
+
+    if (br.IsOverrun()) {
         return false;
     }
-    if (read_bool(sps, pos)) {
-        if (read_bool(sps, pos)) {
+    if (br.ReadBool()) {
+        if (br.ReadBool()) {
             // sps_scaling_list_data
             for (int i = 0; i < 4; ++i) {
                 for (int j = 0; j < (i == 3 ? 2 : 6); ++j) {
-                    if (pos > lenBits) {
+                    if (br.IsOverrun()) {
                         return false;
                     }
-                    if (read_bool(sps, pos)) {
+                    if (br.ReadBool()) {
                         int coefNum = std::min(64, 1 << (4 + (i << 1)));
                         if (i > 1) {
-                            r = ReadSegBits(sps, pos);
+                            r = br.ReadSeg();
                         }
                         while (--coefNum >= 0) {
-                            if (pos > lenBits) {
+                            if (br.IsOverrun()) {
                                 return false;
                             }
-                            r = ReadSegBits(sps, pos);
+                            r = br.ReadSeg();
                         }
                     }
                     else {
-                        r = ReadUegBits(sps, pos);
+                        r = br.ReadUeg();
                     }
                 }
             }
         }
     }
 
-    if (pos > lenBits) {
+    if (br.IsOverrun()) {
         return false;
     }
-    pos += 2;
-    if (read_bool(sps, pos)) {
-        pos += 8;
-        r = ReadUegBits(sps, pos);
-        r = ReadUegBits(sps, pos);
-        ++pos;
+    br.Skip(2);
+    if (br.ReadBool()) {
+        br.Skip(8);
+        r = br.ReadUeg();
+        r = br.ReadUeg();
+        br.Skip(1);
     }
-    int numShortTermRefPicSets = ReadUegBits(sps, pos);
+    int numShortTermRefPicSets = br.ReadUeg();
     int numDeltaPocs = 0;
     for (int i = 0; i < numShortTermRefPicSets; ++i) {
-        if (pos > lenBits) {
+        if (br.IsOverrun()) {
             return false;
         }
         bool interRefPicSetPredictionFlag = false;
         if (i != 0) {
-            interRefPicSetPredictionFlag = read_bool(sps, pos);
+            interRefPicSetPredictionFlag = br.ReadBool();
         }
         if (interRefPicSetPredictionFlag) {
             if (i == numShortTermRefPicSets) {
-                r = ReadUegBits(sps, pos);
+                r = br.ReadUeg();
             }
-            read_bool(sps, pos);
-            r = ReadUegBits(sps, pos);
+            br.ReadBool();
+            r = br.ReadUeg();
             int nextNumDeltaPocs = 0;
             for (int j = 0; j <= numDeltaPocs; ++j) {
-                if (pos > lenBits) {
+                if (br.IsOverrun()) {
                     return false;
                 }
-                bool usedByCurrPicFlag = read_bool(sps, pos);
+                bool usedByCurrPicFlag = br.ReadBool();
                 bool useDeltaFlag = false;
                 if (!usedByCurrPicFlag) {
-                    useDeltaFlag = read_bool(sps, pos);
+                    useDeltaFlag = br.ReadBool();
                 }
                 if (usedByCurrPicFlag || useDeltaFlag) {
                     ++nextNumDeltaPocs;
@@ -1310,23 +1990,23 @@ bool CMp4Fragmenter::ParseH265Sps(const std::vector<uint8_t> &ebspSps)
             numDeltaPocs = nextNumDeltaPocs;
         }
         else {
-            int numNegativePics = ReadUegBits(sps, pos);
-            int numPositivePics = ReadUegBits(sps, pos);
+            int numNegativePics = br.ReadUeg();
+            int numPositivePics = br.ReadUeg();
             numDeltaPocs = numNegativePics + numPositivePics;
             for (int j = 0; j < numDeltaPocs; ++j) {
-                if (pos > lenBits) {
+                if (br.IsOverrun()) {
                     return false;
                 }
-                r = ReadUegBits(sps, pos);
-                read_bool(sps, pos);
+                r = br.ReadUeg();
+                br.ReadBool();
             }
         }
     }
-    if (read_bool(sps, pos)) {
-        int numLongTermRefPicsSps = ReadUegBits(sps, pos);
-        while (--numLongTermRefPicsSps >= 0) {
-            pos += log2MaxPicOrderCntLsbMinus4 + 4;
-            ++pos;
+    if (br.ReadBool()) {
+        int numLongTermRefPicsSps = br.ReadUeg();
+        while (--numLongTermRefPicsSps >= 0 && !br.IsOverrun()) {
+            br.Skip(log2MaxPicOrderCntLsbMinus4 + 4);
+            br.Skip(1);
         }
     }
 
@@ -1334,14 +2014,14 @@ bool CMp4Fragmenter::ParseH265Sps(const std::vector<uint8_t> &ebspSps)
     m_sarWidth = 1;
     m_sarHeight = 1;
 
-    if (pos > lenBits) {
+    if (br.IsOverrun()) {
         return false;
     }
-    pos += 2;
-    if (read_bool(sps, pos)) {
+    br.Skip(2);
+    if (br.ReadBool()) {
         // VUI
-        if (read_bool(sps, pos)) {
-            int aspectRatioIdc = read_bits(sps, pos, 8);
+        if (br.ReadBool()) {
+            int aspectRatioIdc = br.ReadBits(8);
             static const int SAR_W_TABLE[17] = {1, 1, 12, 10, 16, 40, 24, 20, 32, 80, 18, 15, 64, 160, 4, 3, 2};
             static const int SAR_H_TABLE[17] = {1, 1, 11, 11, 11, 33, 11, 11, 11, 33, 11, 11, 33, 99, 3, 2, 1};
             if (aspectRatioIdc < 17) {
@@ -1349,108 +2029,113 @@ bool CMp4Fragmenter::ParseH265Sps(const std::vector<uint8_t> &ebspSps)
                 m_sarHeight = SAR_H_TABLE[aspectRatioIdc];
             }
             else if (aspectRatioIdc == 255) {
-                m_sarWidth = read_bits(sps, pos, 16);
-                m_sarHeight = std::max(read_bits(sps, pos, 16), 1);
+                m_sarWidth = br.ReadBits(16);
+                m_sarHeight = std::max<int>(br.ReadBits(16), 1);
             }
         }
-        if (read_bool(sps, pos)) {
-            ++pos;
+        if (br.ReadBool()) {
+            br.Skip(1);
         }
-        if (read_bool(sps, pos)) {
-            pos += 4;
-            if (read_bool(sps, pos)) {
-                pos += 24;
+        if (br.ReadBool()) {
+            br.Skip(4);
+            if (br.ReadBool()) {
+                br.Skip(24);
             }
         }
 
-        if (pos > lenBits) {
+        if (br.IsOverrun()) {
             return false;
         }
-        if (read_bool(sps, pos)) {
-            r = ReadUegBits(sps, pos);
-            r = ReadUegBits(sps, pos);
+        if (br.ReadBool()) {
+            r = br.ReadUeg();
+            r = br.ReadUeg();
         }
-        pos += 3;
-        if (read_bool(sps, pos)) {
-            r = ReadUegBits(sps, pos);
-            r = ReadUegBits(sps, pos);
-            r = ReadUegBits(sps, pos);
-            r = ReadUegBits(sps, pos);
+        br.Skip(3);
+        if (br.ReadBool()) {
+            r = br.ReadUeg();
+            r = br.ReadUeg();
+            r = br.ReadUeg();
+            r = br.ReadUeg();
         }
 
-        if (pos > lenBits) {
+        if (br.IsOverrun()) {
             return false;
         }
-        if (read_bool(sps, pos)) {
+        if (br.ReadBool()) {
             // vui_timing_info
-            pos += 64;
-            if (read_bool(sps, pos)) {
-                r = ReadUegBits(sps, pos);
+            uint32_t numUnitsInTick = br.ReadBits(32);
+            uint32_t timeScale = br.ReadBits(32);
+            int duration = GetFrameDurationFromTiming(numUnitsInTick, timeScale, 1);
+            if (!br.IsOverrun() && duration > 0) {
+                m_videoSampleDurationEstimate = duration;
+            }
+            if (br.ReadBool()) {
+                r = br.ReadUeg();
             }
-            if (read_bool(sps, pos)) {
+            if (br.ReadBool()) {
                 // vui_hrd_parameters
                 bool subPicHrdParamsPresentFlag = false;
-                bool nalHrdParametersPresentFlag = read_bool(sps, pos);
-                bool vclHrdParametersPresentFlag = read_bool(sps, pos);
+                bool nalHrdParametersPresentFlag = br.ReadBool();
+                bool vclHrdParametersPresentFlag = br.ReadBool();
                 if (nalHrdParametersPresentFlag || vclHrdParametersPresentFlag) {
-                    subPicHrdParamsPresentFlag = read_bool(sps, pos);
+                    subPicHrdParamsPresentFlag = br.ReadBool();
                     if (subPicHrdParamsPresentFlag) {
-                        pos += 19;
+                        br.Skip(19);
                     }
-                    pos += 8;
+                    br.Skip(8);
                     if (subPicHrdParamsPresentFlag) {
-                        pos += 4;
+                        br.Skip(4);
                     }
-                    pos += 15;
+                    br.Skip(15);
                 }
                 for (int i = 0; i <= maxSubLayersMinus1; ++i) {
-                    if (pos > lenBits) {
+                    if (br.IsOverrun()) {
                         return false;
                     }
-                    bool fixedPicRateGeneralFlag = read_bool(sps, pos);
+                    bool fixedPicRateGeneralFlag = br.ReadBool();
                     bool fixedPicRateWithinCvsFlag = false;
                     int cpbCnt = 1;
                     if (!fixedPicRateGeneralFlag) {
-                        fixedPicRateWithinCvsFlag = read_bool(sps, pos);
+                        fixedPicRateWithinCvsFlag = br.ReadBool();
                     }
                     bool lowDelayHrdFlag = false;
                     if (fixedPicRateWithinCvsFlag) {
-                        r = ReadSegBits(sps, pos);
+                        r = br.ReadSeg();
                     }
                     else {
-                        lowDelayHrdFlag = read_bool(sps, pos);
+                        lowDelayHrdFlag = br.ReadBool();
                     }
                     if (!lowDelayHrdFlag) {
-                        cpbCnt = ReadUegBits(sps, pos) + 1;
+                        cpbCnt = br.ReadUeg() + 1;
                     }
                     for (int j = 0; j < nalHrdParametersPresentFlag + vclHrdParametersPresentFlag; ++j) {
                         for (int k = 0; k < cpbCnt; ++k) {
-                            if (pos > lenBits) {
+                            if (br.IsOverrun()) {
                                 return false;
                             }
-                            r = ReadUegBits(sps, pos);
-                            r = ReadUegBits(sps, pos);
+                            r = br.ReadUeg();
+                            r = br.ReadUeg();
                             if (subPicHrdParamsPresentFlag) {
-                                r = ReadUegBits(sps, pos);
-                                r = ReadUegBits(sps, pos);
+                                r = br.ReadUeg();
+                                r = br.ReadUeg();
                             }
-                            ++pos;
+                            br.Skip(1);
                         }
                     }
                 }
             }
         }
 
-        if (pos > lenBits) {
+        if (br.IsOverrun()) {
             return false;
         }
-        if (read_bool(sps, pos)) {
-            pos += 3;
-            m_minSpatialSegmentationIdc = ReadUegBits(sps, pos);
-            r = ReadUegBits(sps, pos);
-            r = ReadUegBits(sps, pos);
-            r = ReadUegBits(sps, pos);
-            r = ReadUegBits(sps, pos);
+        if (br.ReadBool()) {
+            br.Skip(3);
+            m_minSpatialSegmentationIdc = br.ReadUeg();
+            r = br.ReadUeg();
+            r = br.ReadUeg();
+            r = br.ReadUeg();
+            r = br.ReadUeg();
         }
     }
 
@@ -1459,57 +2144,51 @@ bool CMp4Fragmenter::ParseH265Sps(const std::vector<uint8_t> &ebspSps)
     m_codecWidth = picWidthInLumaSamples - (leftOffset + rightOffset) * subWC;
     m_codecHeight = picHeightInLumaSamples - (topOffset + bottomOffset) * subHC;
 
-    return pos <= lenBits;
+    return !br.IsOverrun();
 }
 
 bool CMp4Fragmenter::ParseVps(const std::vector<uint8_t> &ebspVps)
 {
     std::vector<uint8_t> rbspVps = EbspToRbsp(ebspVps);
-    size_t lenBits = rbspVps.size() * 8;
-    // 512bits overrun area
-    rbspVps.insert(rbspVps.end(), 64, 0);
-    const uint8_t *vps = rbspVps.data();
-    size_t pos = 16;
+    CBitReader br(rbspVps.data(), rbspVps.size());
+    br.Skip(16);
 
-    pos += 12;
-    m_numTemporalLayers = read_bits(vps, pos, 3) + 1;
-    m_temporalIDNestingFlag = read_bool(vps, pos);
+    br.Skip(12);
+    m_numTemporalLayers = br.ReadBits(3) + 1;
+    m_temporalIDNestingFlag = br.ReadBool();
 
-    return pos <= lenBits;
+    return !br.IsOverrun();
 }
 
 bool CMp4Fragmenter::ParseH265Pps(const std::vector<uint8_t> &ebspPps)
 {
     std::vector<uint8_t> rbspPps = EbspToRbsp(ebspPps);
-    size_t lenBits = rbspPps.size() * 8;
-    // 512bits overrun area
-    rbspPps.insert(rbspPps.end(), 64, 0);
-    const uint8_t *pps = rbspPps.data();
-    size_t pos = 16;
+    CBitReader br(rbspPps.data(), rbspPps.size());
+    br.Skip(16);
     // for debug
     int r;
     static_cast<void>(r);
 
-    r = ReadUegBits(pps, pos);
-    r = ReadUegBits(pps, pos);
-    pos += 7;
-    r = ReadUegBits(pps, pos);
-    r = ReadUegBits(pps, pos);
-    r = ReadSegBits(pps, pos);
-    pos += 2;
+    r = br.ReadUeg();
+    r = br.ReadUeg();
+    br.Skip(7);
+    r = br.ReadUeg();
+    r = br.ReadUeg();
+    r = br.ReadSeg();
+    br.Skip(2);
 
-    if (pos > lenBits) {
+    if (br.IsOverrun()) {
         return false;
     }
-    if (read_bool(pps, pos)) {
-        r = ReadUegBits(pps, pos);
+    if (br.ReadBool()) {
+        r = br.ReadUeg();
     }
-    r = ReadSegBits(pps, pos);
-    r = ReadSegBits(pps, pos);
-    pos += 4;
-    bool tilesEnabledFlag = read_bool(pps, pos);
-    bool entropyCodingSyncEnabledFlag = read_bool(pps, pos);
+    r = br.ReadSeg();
+    r = br.ReadSeg();
+    br.Skip(4);
+    bool tilesEnabledFlag = br.ReadBool();
+    bool entropyCodingSyncEnabledFlag = br.ReadBool();
     m_parallelismType = entropyCodingSyncEnabledFlag ? (tilesEnabledFlag ? 0 : 3) : (tilesEnabledFlag ? 2 : 1);
 
-    return pos <= lenBits;
+    return !br.IsOverrun();
 }
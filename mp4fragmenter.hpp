@@ -1,9 +1,10 @@
 #ifndef INCLUDE_MP4FRAGMENTER_HPP
 #define INCLUDE_MP4FRAGMENTER_HPP
 
+#include "aes.hpp"
 #include "util.hpp"
 #include <stdint.h>
-#include <unordered_map>
+#include <map>
 #include <utility>
 #include <vector>
 
@@ -11,19 +12,52 @@ class CMp4Fragmenter
 {
 public:
     CMp4Fragmenter();
-    void AddPackets(const std::vector<uint8_t> &packets, const PMT &pmt, bool packetsMaybeNotEndAtUnitStart);
+    // Keep parameter sets also in samples (avc3/hev1 sample entry). Must be called before adding packets.
+    void SetInbandParameterSets(bool inband) { m_inbandParameterSets = inband; }
+    // Encrypt samples in the CENC "cbcs" scheme with a constant IV. Each argument is 16 bytes.
+    // If the key changes after the header is created, the new key is signaled in each fragment by a "seig" sample group and
+    // the header is kept.
+    void SetEncryptionKey(const uint8_t *keyId, const uint8_t *key, const uint8_t *iv);
+    // If "fragmentContinues" is true, the output is a chunk (moof+mdat) and the output of the next call is appended to the same fragment.
+    void AddPackets(const std::vector<uint8_t> &packets, const PMT &pmt, bool packetsMaybeNotEndAtUnitStart, bool fragmentContinues = false);
     void ClearFragments();
+    // Remove the first "n" fragments
+    void EraseFrontFragments(size_t n);
+    void ResetContinuity();
+    void ResumeTimeline(uint32_t fragmentCount, int64_t decodeTime);
+    uint32_t GetFragmentCount() const { return m_fragmentCount; }
+    int64_t GetDecodeTimeEnd() const { return m_decodeTimeEnd; }
+    unsigned int GetWarningCount() const { return m_warningCount; }
     const std::vector<uint8_t> &GetFragments() const { return m_fragments; }
     const std::vector<size_t> &GetFragmentSizes() const { return m_fragmentSizes; }
     const std::vector<int> &GetFragmentDurationsMsec() const { return m_fragmentDurationsMsec; }
+    // Version of the header each fragment depends on
+    const std::vector<uint32_t> &GetFragmentHeaderVersions() const { return m_fragmentHeaderVersions; }
+    // Whether the last fragment has not been completed yet (more chunks will be appended)
+    bool IsLastFragmentOpen() const { return m_lastFragmentOpen && !m_fragmentSizes.empty(); }
     const std::vector<uint8_t> &GetHeader() const { return m_moov; }
+    // Incremented each time the header is regenerated by a change of the video parameters
+    uint32_t GetHeaderVersion() const { return m_headerVersion; }
 
 private:
-    void AddVideoPes(const std::vector<uint8_t> &pes, bool h265);
-    void AddAudioPes(const std::vector<uint8_t> &pes);
+    // Specialized on the codec (false: AVC, true: HEVC)
+    template <bool H265>
+    void AddVideoPes(const std::vector<uint8_t> &pes);
+    void AddAudioPes(const std::vector<uint8_t> &pes, int streamType);
     void AddID3Pes(const std::vector<uint8_t> &pes);
+    void PushFragment();
+    typedef std::map<int, std::vector<uint8_t>> PARAMETER_SET_MAP;
+    // Replace the parameter set tables and regenerate the header. If "extendsTables" is true, the tables are a superset of
+    // the current ones and the header keeps its version.
+    void SwitchVideoParameters(const PARAMETER_SET_MAP &vpsMap, const PARAMETER_SET_MAP &spsMap, const PARAMETER_SET_MAP &ppsMap, bool h265,
+                               bool extendsTables);
+    // Add parameter sets of the access unit "auMap" not in "table" to "newMap", within "maxNum" entries in total
+    static void MergeNewParameterSets(PARAMETER_SET_MAP &newMap, const PARAMETER_SET_MAP &auMap, const PARAMETER_SET_MAP &table, size_t maxNum);
     void PushFtypAndMoov(std::vector<uint8_t> &data) const;
     void PushMoof(std::vector<uint8_t> &data, std::pair<int, int> &fragDuration, uint32_t &fragCount) const;
+    void PushProtectionSchemeInfo(std::vector<uint8_t> &data, const char *originalFormat, bool isVideo) const;
+    // Push "sbgp" and "sgpd" boxes overriding the key in the header for all samples of a track fragment, if the key differs
+    void PushSeigSampleGroup(std::vector<uint8_t> &data, uint32_t sampleCount, bool isVideo) const;
     bool ParseSps(const std::vector<uint8_t> &ebspSps);
     bool ParseH265Sps(const std::vector<uint8_t> &ebspSps);
     bool ParseVps(const std::vector<uint8_t> &ebspVps);
@@ -33,10 +67,15 @@ private:
     static const int AUDIO_TRACK_ID;
 
     uint32_t m_fragmentCount;
+    uint32_t m_headerVersion;
+    bool m_inbandParameterSets;
+    mutable unsigned int m_warningCount;
     int m_fragmentDurationResidual;
     std::vector<uint8_t> m_fragments;
     std::vector<size_t> m_fragmentSizes;
     std::vector<int> m_fragmentDurationsMsec;
+    std::vector<uint32_t> m_fragmentHeaderVersions;
+    bool m_lastFragmentOpen;
     std::pair<int, std::vector<uint8_t>> m_videoPes;
     std::pair<int, std::vector<uint8_t>> m_audioPes;
     std::pair<int, std::vector<uint8_t>> m_id3Pes;
@@ -49,6 +88,14 @@ private:
     int64_t m_audioPts;
     int64_t m_audioDecodeTime;
     int64_t m_audioDecodeTimePts;
+    // Timestamps of the first samples pending for the next fragment
+    int64_t m_baseVideoDts;
+    int64_t m_baseAudioPts;
+    // Decode time (90kHz) where the timeline starts and where the last fragment ends
+    int64_t m_decodeTimeBase;
+    int64_t m_decodeTimeEnd;
+    // Whether the timeline continues from where the video of a previous process ended
+    bool m_timelineResumed;
     std::vector<uint8_t> m_workspace;
     std::vector<uint8_t> m_emsg;
     std::vector<uint8_t> m_videoMdat;
@@ -74,9 +121,14 @@ private:
     int m_parallelismType;
     int m_numTemporalLayers;
     bool m_temporalIDNestingFlag;
-    std::vector<uint8_t> m_vps;
-    std::vector<uint8_t> m_sps;
-    std::unordered_map<int, std::vector<uint8_t>> m_ppsMap;
+    // Parameter sets by ID, stored in the sample entry in ascending order
+    PARAMETER_SET_MAP m_vpsMap;
+    PARAMETER_SET_MAP m_spsMap;
+    PARAMETER_SET_MAP m_ppsMap;
+    // Parameter sets with new IDs, added to the tables at the next key frame (without -n)
+    PARAMETER_SET_MAP m_newVpsMap;
+    PARAMETER_SET_MAP m_newSpsMap;
+    PARAMETER_SET_MAP m_newPpsMap;
 
     struct VIDEO_SAMPLE_INFO
     {
@@ -86,13 +138,41 @@ private:
         int compositionTimeOffsets;
     };
     std::vector<VIDEO_SAMPLE_INFO> m_videoSampleInfos;
+    // Duration of video samples (90kHz) used if unknown, from the recent DTS difference or the VUI timing info
+    int m_videoSampleDurationEstimate;
 
-    // These members are valid if (m_aacProfile >= 0)
+    // These members are valid if (m_audioStreamType >= 0)
+    int m_audioStreamType;
     int m_aacProfile;
     int m_samplingFrequency;
     int m_samplingFrequencyIndex;
+    // Channel configuration for AAC, otherwise the number of channels
     int m_channelConfiguration;
+    // Number of PCM samples per audio sample
+    int m_audioSampleDuration;
+    // Payload of the "dac3" or "dec3" box
+    std::vector<uint8_t> m_audioSpecificBox;
     std::vector<uint16_t> m_audioSampleSizes;
+    // E-AC-3 frames of the sample not filled yet, and their number of PCM samples
+    std::vector<uint8_t> m_audioPendingSample;
+    int m_audioPendingDuration;
+    // E-AC-3 bytes and PCM samples, and dependent substreams (the current and maximum numbers per frame and their
+    // channel locations) seen until the header is created, for "dec3"
+    int64_t m_eac3Bytes;
+    int64_t m_eac3Duration;
+    int m_eac3DepSubCount;
+    int m_eac3DepSubNum;
+    int m_eac3ChanLoc;
+
+    // These members are valid if (m_encrypted)
+    bool m_encrypted;
+    CAes128 m_aes;
+    uint8_t m_keyId[16];
+    uint8_t m_key[16];
+    uint8_t m_constantIv[16];
+    // Key ID and IV stored in the header
+    uint8_t m_headerKeyId[16];
+    uint8_t m_headerConstantIv[16];
 };
 
 #endif
@@ -0,0 +1,418 @@
+#include "segmenter.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <unordered_map>
+
+// Append TS packets carrying a section, continuing the continuity counter "counter"
+void PushSectionPackets(std::vector<uint8_t> &dest, const uint8_t *section, int sectionSize, int pid, int &counter)
+{
+    for (int pos = 0; pos < sectionSize; ) {
+        uint8_t *p = &*dest.insert(dest.end(), 188, 0xff);
+        p[0] = 0x47;
+        p[1] = static_cast<uint8_t>((pos == 0 ? 0x40 : 0) | (pid >> 8));
+        p[2] = static_cast<uint8_t>(pid);
+        p[3] = static_cast<uint8_t>(0x10 | counter);
+        counter = (counter + 1) & 0x0f;
+        // Pointer field
+        int headerSize = pos == 0 ? 5 : 4;
+        if (pos == 0) {
+            p[4] = 0;
+        }
+        int n = std::min(188 - headerSize, sectionSize - pos);
+        std::copy(section + pos, section + pos + n, p + headerSize);
+        pos += n;
+    }
+}
+
+CSegmenter::CSegmenter(bool enableFragmentation, bool filterPids, uint32_t targetDurationMsec, uint32_t nextTargetDurationMsec,
+                       uint32_t targetFragDurationMsec, uint32_t chunkFrames, size_t segMaxBytes, size_t fragMaxBytes, CRuntimeStats *stats)
+    : m_enableFragmentation(enableFragmentation)
+    , m_filterPids(filterPids)
+    , m_targetDurationMsec(targetDurationMsec)
+    , m_nextTargetDurationMsec(nextTargetDurationMsec)
+    , m_targetFragDurationMsec(targetFragDurationMsec)
+    , m_chunkFrames(chunkFrames)
+    , m_segMaxBytes(segMaxBytes)
+    , m_fragMaxBytes(fragMaxBytes)
+    , m_stats(stats)
+    , m_stopped(false)
+    , m_syncError(0)
+    , m_cutPos()
+    , m_keyPid(0)
+    , m_nalState(0)
+    , m_containsKeyPicture(contains_nal_idr_or_cra<false>)
+    , m_segBytes(0)
+    , m_pts(-1)
+    , m_lastSegPts(-1)
+    , m_lastFragPts(-1)
+    , m_markedFragPts(-1)
+    , m_inputPos(-188)
+    , m_keyStartInputPos(0)
+    , m_markedKeyStartInputPos(0)
+    , m_firstAudioPacketArrived(false)
+    , m_isFirstKey(true)
+    , m_chunkFrameCount(0)
+    , m_pat()
+    , m_countForOnRead(0)
+    , m_statsPendingPackets(0)
+    , m_patCounter(0)
+    , m_pmtCounter(0)
+    , m_bufCount(0)
+{
+}
+
+bool CSegmenter::Push(const uint8_t *data, size_t size)
+{
+    if (m_stopped) {
+        return false;
+    }
+    if (m_bufCount > 0) {
+        // Complete the divided packet
+        size_t n = std::min(size, sizeof(m_buf) - m_bufCount);
+        std::copy(data, data + n, m_buf + m_bufCount);
+        m_bufCount += n;
+        data += n;
+        size -= n;
+        if (m_bufCount < sizeof(m_buf)) {
+            return true;
+        }
+        m_bufCount = 0;
+        if (ProcessPacket(m_buf)) {
+            m_stopped = true;
+            return false;
+        }
+    }
+    for (; size >= 188; data += 188, size -= 188) {
+        if (ProcessPacket(data)) {
+            m_stopped = true;
+            return false;
+        }
+    }
+    std::copy(data, data + size, m_buf);
+    m_bufCount = size;
+    return true;
+}
+
+void CSegmenter::FlushStats()
+{
+    if (m_stats) {
+        m_stats->Add(CRuntimeStats::INPUT_PACKETS, m_statsPendingPackets);
+        m_stats->Add(CRuntimeStats::INPUT_BYTES, m_statsPendingPackets * 188);
+    }
+    m_statsPendingPackets = 0;
+}
+
+bool CSegmenter::ProcessPacket(const uint8_t *packet)
+{
+    m_inputPos += 188;
+
+    if (m_stats && ++m_statsPendingPackets == 64) {
+        m_stats->Add(CRuntimeStats::INPUT_PACKETS, m_statsPendingPackets);
+        m_stats->Add(CRuntimeStats::INPUT_BYTES, m_statsPendingPackets * 188);
+        m_statsPendingPackets = 0;
+    }
+
+    if (m_onRead && ++m_countForOnRead == 16) {
+        m_countForOnRead = 0;
+        int64_t ptsDiff = (0x200000000 + m_pts - m_lastSegPts) & 0x1ffffffff;
+        if (ptsDiff >= 0x100000000) {
+            // PTS went back.
+            ptsDiff = 0;
+        }
+        if (m_onRead(ptsDiff)) {
+            return true;
+        }
+    }
+
+    if (extract_ts_header_sync(packet) != 0x47) {
+        // Resynchronization is not implemented.
+        ++m_syncError;
+        if (m_stats) {
+            m_stats->Add(CRuntimeStats::SYNC_ERRORS);
+        }
+        return false;
+    }
+
+    int unitStart = extract_ts_header_unit_start(packet);
+    int pid = extract_ts_header_pid(packet);
+    int counter = extract_ts_header_counter(packet);
+    if (m_stats && pid != 0x1fff) {
+        int adaptation = extract_ts_header_adaptation(packet);
+        auto ret = m_lastCounterMap.emplace(pid, counter);
+        if (!ret.second && (adaptation & 1)) {
+            bool discontinuity = (adaptation & 2) && packet[4] > 0 && (packet[5] & 0x80);
+            // A duplicate packet is allowed
+            if (!discontinuity && counter != ret.first->second && counter != ((ret.first->second + 1) & 0x0f)) {
+                m_stats->Add(CRuntimeStats::CC_ERRORS);
+            }
+            ret.first->second = counter;
+        }
+    }
+    bool isRewrittenPsi = false;
+    if (m_filterPids) {
+        if (pid == 0x1fff ||
+            (pid != 0 && pid != m_pat.first_pmt.pmt_pid && pid != m_pat.first_pmt.pcr_pid && pid != m_pat.first_pmt.first_video_pid &&
+             pid != m_pat.first_pmt.first_audio_pid && pid != m_pat.first_pmt.first_id3_metadata_pid)) {
+            // Not used by clients
+            return false;
+        }
+        isRewrittenPsi = pid == 0 || pid == m_pat.first_pmt.pmt_pid;
+    }
+    if (unitStart && !isRewrittenPsi) {
+        UNIT_START_POSITION unitStartPos = {SIZE_MAX, SIZE_MAX, SIZE_MAX, -1, -1, -1};
+        UNIT_START_POSITION &pos = m_unitStartMap.emplace(pid, unitStartPos).first->second;
+        pos.lastPos = m_packets.size();
+        pos.lastInputPos = m_inputPos;
+    }
+    int payloadSize = get_ts_payload_size(packet);
+    const uint8_t *payload = packet + 188 - payloadSize;
+
+    bool isKey = false;
+    bool cutChunk = false;
+    if (pid == 0) {
+        int lastVersion = m_pat.psi.version_number;
+        extract_pat(&m_pat, payload, payloadSize, unitStart, counter);
+        if (isRewrittenPsi && m_pat.psi.version_number && (!lastVersion || unitStart)) {
+            // The section is complete
+            uint8_t section[1024];
+            int sectionSize = make_filtered_pat_section(section, &m_pat);
+            PushSectionPackets(m_patPackets, section, sectionSize, pid, m_patCounter);
+        }
+    }
+    else if (pid == m_pat.first_pmt.pmt_pid) {
+        int lastVersion = m_pat.first_pmt.psi.version_number;
+        extract_pmt(&m_pat.first_pmt, payload, payloadSize, unitStart, counter);
+        m_containsKeyPicture = m_pat.first_pmt.first_video_stream_type == H_265_VIDEO ? contains_nal_idr_or_cra<true> :
+                             m_pat.first_pmt.first_video_stream_type == MPEG2_VIDEO ? contains_mpeg2_sequence_header_or_i_picture :
+                             contains_nal_idr_or_cra<false>;
+        if (isRewrittenPsi && m_pat.first_pmt.psi.version_number && (!lastVersion || unitStart)) {
+            // The section is complete
+            uint8_t section[1024];
+            int sectionSize = make_filtered_pmt_section(section, &m_pat.first_pmt);
+            PushSectionPackets(m_pmtPackets, section, sectionSize, pid, m_pmtCounter);
+        }
+    }
+    else if (pid == m_pat.first_pmt.first_video_pid) {
+        if (unitStart) {
+            m_keyPid = pid;
+        }
+    }
+    else if (pid == m_pat.first_pmt.first_audio_pid) {
+        if (unitStart && m_pat.first_pmt.first_video_pid == 0) {
+            m_keyPid = pid;
+        }
+        m_firstAudioPacketArrived = true;
+    }
+
+    if (m_keyPid != 0 && pid == m_keyPid &&
+        (pid == m_pat.first_pmt.first_audio_pid ||
+         (pid == m_pat.first_pmt.first_video_pid &&
+          (m_pat.first_pmt.first_video_stream_type == AVC_VIDEO ||
+           m_pat.first_pmt.first_video_stream_type == H_265_VIDEO ||
+           m_pat.first_pmt.first_video_stream_type == MPEG2_VIDEO)))) {
+        if (unitStart) {
+            bool markForFrag = false;
+            int64_t ptsDiff = (0x200000000 + m_pts - m_lastFragPts) & 0x1ffffffff;
+            // Defer fragmentation until the arrival of first audio packet.
+            if (m_chunkFrames != 0) {
+                // Cut chunks immediately before this unit-start, and fragments only at chunk boundaries
+                cutChunk = m_enableFragmentation && ++m_chunkFrameCount > m_chunkFrames &&
+                           (m_pat.first_pmt.first_audio_pid == 0 || m_firstAudioPacketArrived) && m_lastFragPts >= 0;
+            }
+            else if ((m_pat.first_pmt.first_audio_pid == 0 || m_firstAudioPacketArrived) &&
+                     m_markedFragPts < 0 && m_lastFragPts >= 0 &&
+                     (ptsDiff < 0x100000000 ? ptsDiff : 0) / 90 >= m_targetFragDurationMsec)
+            {
+                markForFrag = true;
+                m_markedFragPts = m_pts;
+            }
+
+            m_keyStartInputPos = m_inputPos;
+            if (markForFrag) {
+                m_markedKeyStartInputPos = m_inputPos;
+            }
+            for (auto it = m_unitStartMap.begin(); it != m_unitStartMap.end(); ++it) {
+                it->second.beforeKeyStart = it->second.lastPos;
+                it->second.beforeKeyStartInputPos = it->second.lastInputPos;
+                if (markForFrag) {
+                    it->second.beforeMarkedKeyStart = it->second.beforeKeyStart;
+                    it->second.beforeMarkedKeyStartInputPos = it->second.beforeKeyStartInputPos;
+                }
+            }
+            if (payloadSize >= 9 && payload[0] == 0 && payload[1] == 0 && payload[2] == 1) {
+                int ptsDtsFlags = payload[7] >> 6;
+                int pesHeaderLength = payload[8];
+                if (ptsDtsFlags >= 2 && payloadSize >= 14) {
+                    m_pts = get_pes_timestamp(payload + 9);
+                    if (m_lastSegPts < 0) {
+                        m_lastSegPts = m_pts;
+                        m_lastFragPts = m_pts;
+                    }
+                }
+                if (pid == m_pat.first_pmt.first_video_pid) {
+                    TRACE_SCOPE("key detection");
+                    m_nalState = 0;
+                    if (9 + pesHeaderLength < payloadSize) {
+                        if (m_containsKeyPicture(&m_nalState, payload + 9 + pesHeaderLength, payloadSize - (9 + pesHeaderLength))) {
+                            isKey = !m_isFirstKey;
+                            m_isFirstKey = false;
+                        }
+                    }
+                }
+                else {
+                    // Always treat as key.
+                    isKey = !m_isFirstKey;
+                    m_isFirstKey = false;
+                }
+            }
+        }
+        else if (pid == m_pat.first_pmt.first_video_pid) {
+            if (m_containsKeyPicture(&m_nalState, payload, payloadSize)) {
+                isKey = !m_isFirstKey;
+                m_isFirstKey = false;
+            }
+        }
+    }
+
+    bool forceSegment = (m_segMaxBytes != 0 && m_packets.size() + m_segBytes + 188 > m_segMaxBytes) ||
+                        m_packets.size() + 188 > m_fragMaxBytes;
+    // Avoid making the last fragment too small.
+    int64_t markedPtsDiff = (0x200000000 + m_pts - m_markedFragPts) & 0x1ffffffff;
+    bool createFragment = m_enableFragmentation && m_markedFragPts >= 0 &&
+                          (markedPtsDiff < 0x100000000 ? markedPtsDiff : 0) / 90 >= m_targetFragDurationMsec / 4;
+    if (isKey || forceSegment || createFragment || cutChunk) {
+        int64_t ptsDiff = (0x200000000 + m_pts - m_lastSegPts) & 0x1ffffffff;
+        if (ptsDiff >= 0x100000000) {
+            // PTS went back, rare case.
+            ptsDiff = 0;
+        }
+        bool isSegmentKey = isKey && ptsDiff >= m_targetDurationMsec * 90;
+        if (isSegmentKey || forceSegment || createFragment || cutChunk) {
+            TRACE_DUMP_IF_REQUESTED();
+            TRACE_SCOPE("cut");
+            m_workPackets.clear();
+            m_backPackets.clear();
+
+            if (isKey || !forceSegment) {
+                size_t keyUnitStartPos = isKey || cutChunk ? m_unitStartMap[m_keyPid].beforeKeyStart :
+                    m_unitStartMap[m_keyPid].beforeMarkedKeyStart;
+                // Bring PAT and PMT to the front
+                int bringState = 0;
+                for (size_t i = 0; i < m_packets.size() && i < keyUnitStartPos && bringState < 2; i += 188) {
+                    int p = extract_ts_header_pid(&m_packets[i]);
+                    if (p == 0 || p == m_pat.first_pmt.pmt_pid) {
+                        bringState = p == 0 ? 1 : bringState == 1 ? 2 : bringState;
+                        m_workPackets.insert(m_workPackets.end(), m_packets.begin() + i, m_packets.begin() + i + 188);
+                    }
+                }
+                bringState = 0;
+                for (size_t i = 0; i < m_packets.size(); i += 188) {
+                    if (i < keyUnitStartPos) {
+                        int p = extract_ts_header_pid(&m_packets[i]);
+                        if ((p == 0 || p == m_pat.first_pmt.pmt_pid) && bringState < 2) {
+                            bringState = p == 0 ? 1 : bringState == 1 ? 2 : bringState;
+                            // Already inserted
+                        }
+                        else {
+                            auto it = m_unitStartMap.find(p);
+                            if (it == m_unitStartMap.end() ||
+                                i < std::min(it->second.lastPos, isKey || cutChunk ? it->second.beforeKeyStart : it->second.beforeMarkedKeyStart)) {
+                                m_workPackets.insert(m_workPackets.end(), m_packets.begin() + i, m_packets.begin() + i + 188);
+                            }
+                            else {
+                                m_backPackets.insert(m_backPackets.end(), m_packets.begin() + i, m_packets.begin() + i + 188);
+                            }
+                        }
+                    }
+                    else {
+                        m_backPackets.insert(m_backPackets.end(), m_packets.begin() + i, m_packets.begin() + i + 188);
+                    }
+                }
+            }
+            else {
+                // Packets have been accumulated over the limit, simply segment everything.
+                m_workPackets.assign(m_packets.begin(), m_packets.end());
+            }
+            m_packets.swap(m_backPackets);
+
+            m_cutPos.keyInputPos = isKey || cutChunk ? m_keyStartInputPos : !forceSegment ? m_markedKeyStartInputPos : m_inputPos;
+            m_cutPos.inputPos = m_cutPos.keyInputPos;
+            m_cutPos.pts = isKey || cutChunk ? m_pts : !forceSegment ? m_markedFragPts : -1;
+            if (isKey || !forceSegment) {
+                // The next segment begins at the earliest unit-start moved with the key
+                for (auto it = m_unitStartMap.begin(); it != m_unitStartMap.end(); ++it) {
+                    if (it->first != 0 && it->first != m_pat.first_pmt.pmt_pid && it->first != m_keyPid) {
+                        int64_t startInputPos = isKey || cutChunk ? it->second.beforeKeyStartInputPos : it->second.beforeMarkedKeyStartInputPos;
+                        if (startInputPos >= 0) {
+                            m_cutPos.inputPos = std::min(m_cutPos.inputPos, startInputPos);
+                        }
+                    }
+                }
+            }
+
+            // A chunk not reaching the fragment duration continues the fragment
+            int64_t fragPtsDiff = (0x200000000 + m_pts - m_lastFragPts) & 0x1ffffffff;
+            bool isChunk = cutChunk && !isSegmentKey && !forceSegment &&
+                           (fragPtsDiff < 0x100000000 ? fragPtsDiff : 0) / 90 < m_targetFragDurationMsec;
+            m_chunkFrameCount = isKey || cutChunk ? 1 : 0;
+
+            if (isChunk) {
+                m_segBytes += m_workPackets.size();
+            }
+            else if (!isSegmentKey && !forceSegment) {
+                // fragment
+                m_lastFragPts = cutChunk ? m_pts : m_markedFragPts;
+                m_segBytes += m_workPackets.size();
+            }
+            else {
+                // segment
+                m_lastFragPts = m_pts;
+                m_lastSegPts = m_pts;
+                m_targetDurationMsec = m_nextTargetDurationMsec;
+                m_segBytes = 0;
+            }
+            m_markedFragPts = -1;
+
+            if (m_onSegmentOrFragment(isSegmentKey, forceSegment, isChunk, ptsDiff, m_pat.first_pmt, m_workPackets)) {
+                return true;
+            }
+            m_unitStartMap.clear();
+        }
+    }
+    if (isRewrittenPsi) {
+        std::vector<uint8_t> &psiPackets = pid == 0 ? m_patPackets : m_pmtPackets;
+        if (!psiPackets.empty()) {
+            UNIT_START_POSITION unitStartPos = {SIZE_MAX, SIZE_MAX, SIZE_MAX, -1, -1, -1};
+            m_unitStartMap.emplace(pid, unitStartPos).first->second.lastPos = m_packets.size();
+            m_packets.insert(m_packets.end(), psiPackets.begin(), psiPackets.end());
+            psiPackets.clear();
+        }
+    }
+    else {
+        m_packets.insert(m_packets.end(), packet, packet + 188);
+    }
+    return false;
+}
+
+void ProcessSegmentation(const std::function<size_t (uint8_t *, size_t)> &readInput, bool enableFragmentation, bool filterPids, uint32_t targetDurationMsec, uint32_t nextTargetDurationMsec,
+                         uint32_t targetFragDurationMsec, uint32_t chunkFrames, size_t segMaxBytes, size_t fragMaxBytes, unsigned int &syncError, CUT_POSITION &cutPos,
+                         CRuntimeStats *stats, const std::function<bool (int64_t)> &onRead,
+                         const std::function<bool (bool, bool, bool, int64_t, const PMT &, std::vector<uint8_t> &)> &onSegmentOrFragment)
+{
+    CSegmenter segmenter(enableFragmentation, filterPids, targetDurationMsec, nextTargetDurationMsec, targetFragDurationMsec, chunkFrames,
+                         segMaxBytes, fragMaxBytes, stats);
+    segmenter.SetOnRead(onRead);
+    segmenter.SetOnSegmentOrFragment([&](bool isKey, bool forceSegment, bool isChunk, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets) -> bool {
+        cutPos = segmenter.GetCutPosition();
+        return onSegmentOrFragment(isKey, forceSegment, isChunk, ptsDiff, pmt, packets);
+    });
+    uint8_t buf[188 * 64];
+    size_t nRead;
+    while ((nRead = readInput(buf, sizeof(buf))) != 0) {
+        if (!segmenter.Push(buf, nRead)) {
+            break;
+        }
+    }
+    segmenter.FlushStats();
+    syncError += segmenter.GetSyncErrorCount();
+}
@@ -0,0 +1,178 @@
+#ifndef INCLUDE_SEGMENTER_HPP
+#define INCLUDE_SEGMENTER_HPP
+
+#include "util.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+class CRuntimeStats
+{
+public:
+    // Counters exposed by the stats pipe in this order. Add new ones to the end.
+    enum {
+        INPUT_BYTES,
+        INPUT_PACKETS,
+        SYNC_ERRORS,
+        CC_ERRORS,
+        FORCED_SEGMENTATIONS,
+        FRAGMENTER_WARNINGS,
+        SEGMENTS,
+        FRAGMENTS,
+        // Time from reading the packet that triggered the cut to updating the listing
+        SEGMENT_LATENCY_USEC_LAST,
+        SEGMENT_LATENCY_USEC_MAX,
+        SEGMENT_LATENCY_USEC_SUM,
+        FRAGMENT_LATENCY_USEC_LAST,
+        FRAGMENT_LATENCY_USEC_MAX,
+        FRAGMENT_LATENCY_USEC_SUM,
+        // Uptime when the last segment/fragment was cut
+        LAST_SEGMENT_CUT_MSEC,
+        LAST_FRAGMENT_CUT_MSEC,
+        READ_THROTTLE_MSEC,
+        READER_CONNECTS,
+        BYTES_SERVED,
+        PIPE_FULL_STALLS,
+        COUNTER_NUM
+    };
+    CRuntimeStats() {
+        for (int i = 0; i < COUNTER_NUM; ++i) {
+            m_counters[i] = 0;
+        }
+    }
+    void Add(int index, uint64_t n = 1) { m_counters[index].fetch_add(n, std::memory_order_relaxed); }
+    void Set(int index, uint64_t n) { m_counters[index].store(n, std::memory_order_relaxed); }
+    void SetMax(int index, uint64_t n) {
+        uint64_t current = m_counters[index].load(std::memory_order_relaxed);
+        while (current < n && !m_counters[index].compare_exchange_weak(current, n, std::memory_order_relaxed));
+    }
+    uint64_t Get(int index) const { return m_counters[index].load(std::memory_order_relaxed); }
+    CRuntimeStats(const CRuntimeStats &) = delete;
+    CRuntimeStats &operator=(const CRuntimeStats &) = delete;
+
+private:
+    std::atomic<uint64_t> m_counters[COUNTER_NUM];
+};
+
+struct CUT_POSITION
+{
+    // Input byte position where the packets following the last cut begin, which may be before "keyInputPos" because PES
+    // packets of the other streams that started before the key unit-start are moved to the next segment
+    int64_t inputPos;
+    // Input byte position and PTS of the key unit-start where the last cut was made (pts is -1 if the cut was forced)
+    int64_t keyInputPos;
+    int64_t pts;
+};
+
+// Cut TS packets pushed in chunks of any size at key packets (segment) or at marked positions (fragment).
+// If "filterPids" is true, only PAT, PMT (rewritten to list the selected streams), PCR and the selected streams are kept.
+// If "chunkFrames" is not 0, fragments are further cut into chunks every "chunkFrames" frames, and fragments end only at chunk boundaries.
+class CSegmenter
+{
+public:
+    CSegmenter(bool enableFragmentation, bool filterPids, uint32_t targetDurationMsec, uint32_t nextTargetDurationMsec,
+               uint32_t targetFragDurationMsec, uint32_t chunkFrames, size_t segMaxBytes, size_t fragMaxBytes, CRuntimeStats *stats);
+    // "onRead" is called every 16 packets with the PTS elapsed since the last segment, returning true stops the processing.
+    void SetOnRead(const std::function<bool (int64_t)> &onRead) { m_onRead = onRead; }
+    // "onSegmentOrFragment" receives the packets before each cut and whether the cut is a chunk continuing the fragment,
+    // returning true stops the processing.
+    void SetOnSegmentOrFragment(const std::function<bool (bool, bool, bool, int64_t, const PMT &, std::vector<uint8_t> &)> &onSegmentOrFragment) {
+        m_onSegmentOrFragment = onSegmentOrFragment;
+    }
+    // Process the input, which may end in the middle of a packet. Returns false if the processing has been stopped,
+    // after which the input is ignored.
+    bool Push(const uint8_t *data, size_t size);
+    // Add the packets not yet counted to "stats", at the end of the input
+    void FlushStats();
+    unsigned int GetSyncErrorCount() const { return m_syncError; }
+    // Input byte position (from the first pushed byte) and PTS of the last cut, updated before "onSegmentOrFragment"
+    const CUT_POSITION &GetCutPosition() const { return m_cutPos; }
+    CSegmenter(const CSegmenter &) = delete;
+    CSegmenter &operator=(const CSegmenter &) = delete;
+
+private:
+    // Returns true if the processing is stopped
+    bool ProcessPacket(const uint8_t *packet);
+
+    struct UNIT_START_POSITION
+    {
+        size_t lastPos;
+        // The last unit-start immediately before "keyPid" unit-start
+        size_t beforeKeyStart;
+        // The last unit-start immediately before "keyPid" unit-start marked for fragmentation
+        size_t beforeMarkedKeyStart;
+        // Input byte positions of the unit-starts above
+        int64_t lastInputPos;
+        int64_t beforeKeyStartInputPos;
+        int64_t beforeMarkedKeyStartInputPos;
+    };
+
+    bool m_enableFragmentation;
+    bool m_filterPids;
+    uint32_t m_targetDurationMsec;
+    uint32_t m_nextTargetDurationMsec;
+    uint32_t m_targetFragDurationMsec;
+    uint32_t m_chunkFrames;
+    size_t m_segMaxBytes;
+    size_t m_fragMaxBytes;
+    CRuntimeStats *m_stats;
+    std::function<bool (int64_t)> m_onRead;
+    std::function<bool (bool, bool, bool, int64_t, const PMT &, std::vector<uint8_t> &)> m_onSegmentOrFragment;
+    bool m_stopped;
+    unsigned int m_syncError;
+    CUT_POSITION m_cutPos;
+
+    // PID of the packet to determine segmentation (AVC_VIDEO or H_265_VIDEO or MPEG2_VIDEO or audio stream)
+    int m_keyPid;
+    // AVC-NAL's (or MPEG-2 video start code's) parsing state
+    int m_nalState;
+    // Key picture detector specialized on the codec of the first video stream, selected when PMT is extracted
+    int (*m_containsKeyPicture)(int *, const uint8_t *, int);
+    // Map of PID and unit-start position
+    std::unordered_map<int, UNIT_START_POSITION> m_unitStartMap;
+    // Packets accumulating for next segmentation
+    std::vector<uint8_t> m_packets;
+    std::vector<uint8_t> m_backPackets;
+    std::vector<uint8_t> m_workPackets;
+
+    size_t m_segBytes;
+    int64_t m_pts;
+    int64_t m_lastSegPts;
+    int64_t m_lastFragPts;
+    // PTS marking for fragmentation
+    int64_t m_markedFragPts;
+    // Input byte position of the current packet, the last "keyPid" unit-start, and that marked for fragmentation
+    int64_t m_inputPos;
+    int64_t m_keyStartInputPos;
+    int64_t m_markedKeyStartInputPos;
+    bool m_firstAudioPacketArrived;
+    bool m_isFirstKey;
+    // Number of "keyPid" unit-starts since the last cut, for cutting chunks
+    uint32_t m_chunkFrameCount;
+    PAT m_pat;
+    int m_countForOnRead;
+    // Packets not yet added to "stats", and the last continuity counter of each PID
+    uint64_t m_statsPendingPackets;
+    std::unordered_map<int, int> m_lastCounterMap;
+    // Rewritten PAT and PMT waiting to replace the last packet of the original sections, and their continuity counters
+    std::vector<uint8_t> m_patPackets;
+    int m_patCounter;
+    std::vector<uint8_t> m_pmtPackets;
+    int m_pmtCounter;
+    // Packet divided between pushes
+    uint8_t m_buf[188];
+    size_t m_bufCount;
+};
+
+// Read TS packets by "readInput" and process them by CSegmenter until the end of the input or stopped by the callbacks.
+// "readInput" is asked for up to 64 packets at a time and may return fewer bytes, not necessarily whole packets.
+// "syncError" is incremented by the number of sync errors, and "cutPos" is updated before "onSegmentOrFragment".
+void ProcessSegmentation(const std::function<size_t (uint8_t *, size_t)> &readInput, bool enableFragmentation, bool filterPids, uint32_t targetDurationMsec, uint32_t nextTargetDurationMsec,
+                         uint32_t targetFragDurationMsec, uint32_t chunkFrames, size_t segMaxBytes, size_t fragMaxBytes, unsigned int &syncError, CUT_POSITION &cutPos,
+                         CRuntimeStats *stats, const std::function<bool (int64_t)> &onRead,
+                         const std::function<bool (bool, bool, bool, int64_t, const PMT &, std::vector<uint8_t> &)> &onSegmentOrFragment);
+
+#endif
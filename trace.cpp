@@ -0,0 +1,179 @@
+#include "trace.hpp"
+
+#ifdef TSMEMSEG_TRACE
+#ifndef _WIN32
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace
+{
+// Number of events kept per thread (power of 2)
+const size_t TRACE_RING_SIZE = 16384;
+
+struct TRACE_EVENT
+{
+    // Fields are atomic so that the dumping thread may read them while being overwritten.
+    // A torn event is possible but harmless.
+    std::atomic<const char *> name;
+    std::atomic<int64_t> beginUsec;
+    std::atomic<int64_t> durationUsec;
+};
+
+struct TRACE_RING
+{
+    TRACE_EVENT events[TRACE_RING_SIZE];
+    // Total number of events ever written, only the owner thread writes
+    std::atomic<uint64_t> count;
+    std::atomic<const char *> threadName;
+    int tid;
+};
+
+std::mutex g_traceLock;
+// Rings are never freed so that events of exited threads can be dumped.
+std::vector<std::unique_ptr<TRACE_RING>> g_traceRings;
+std::string g_tracePath;
+std::atomic_bool g_traceDumpRequested(false);
+thread_local TRACE_RING *t_traceRing = nullptr;
+
+TRACE_RING &GetTraceRing()
+{
+    if (!t_traceRing) {
+        std::unique_ptr<TRACE_RING> ring(new TRACE_RING);
+        ring->count = 0;
+        ring->threadName = nullptr;
+        std::lock_guard<std::mutex> lock(g_traceLock);
+        ring->tid = static_cast<int>(g_traceRings.size()) + 1;
+        t_traceRing = ring.get();
+        g_traceRings.push_back(std::move(ring));
+    }
+    return *t_traceRing;
+}
+
+int64_t GetTraceUsecTick()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void WriteJsonString(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', fp);
+        }
+        if (static_cast<unsigned char>(*s) >= 0x20) {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+}
+
+CTraceScope::CTraceScope(const char *name, int64_t minDurationUsec)
+    : m_name(name)
+    , m_minDurationUsec(minDurationUsec)
+    , m_beginUsec(GetTraceUsecTick())
+{
+}
+
+CTraceScope::~CTraceScope()
+{
+    int64_t durationUsec = GetTraceUsecTick() - m_beginUsec;
+    if (durationUsec >= m_minDurationUsec) {
+        TRACE_RING &ring = GetTraceRing();
+        uint64_t n = ring.count.load(std::memory_order_relaxed);
+        TRACE_EVENT &ev = ring.events[n % TRACE_RING_SIZE];
+        ev.name.store(m_name, std::memory_order_relaxed);
+        ev.beginUsec.store(m_beginUsec, std::memory_order_relaxed);
+        ev.durationUsec.store(durationUsec, std::memory_order_relaxed);
+        ring.count.store(n + 1, std::memory_order_release);
+    }
+}
+
+void TraceInit(const char *path)
+{
+    std::lock_guard<std::mutex> lock(g_traceLock);
+    g_tracePath = path;
+}
+
+void TraceSetThreadName(const char *name)
+{
+    GetTraceRing().threadName = name;
+}
+
+void TraceRequestDump()
+{
+    g_traceDumpRequested = true;
+}
+
+bool TraceDump(bool force)
+{
+    if (!g_traceDumpRequested.exchange(false) && !force) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(g_traceLock);
+    if (g_tracePath.empty()) {
+        return false;
+    }
+#ifdef _WIN32
+    FILE *fp = fopen(g_tracePath.c_str(), "w");
+#else
+    // Write to a new file and rename it, so that a file or a symbolic link placed at the path by others is never written
+    std::string tempPath = g_tracePath + ".XXXXXX";
+    int fd = mkstemp(&tempPath[0]);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : nullptr;
+    if (!fp && fd >= 0) {
+        close(fd);
+        unlink(tempPath.c_str());
+    }
+#endif
+    if (!fp) {
+        fprintf(stderr, "Warning: failed to open trace file.\n");
+        return false;
+    }
+    fprintf(fp, "{\"traceEvents\":[");
+    bool first = true;
+    for (auto it = g_traceRings.begin(); it != g_traceRings.end(); ++it) {
+        const TRACE_RING &ring = **it;
+        const char *threadName = ring.threadName;
+        if (threadName) {
+            fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",", ring.tid);
+            WriteJsonString(fp, threadName);
+            fprintf(fp, "}}");
+            first = false;
+        }
+        uint64_t n = ring.count.load(std::memory_order_acquire);
+        for (uint64_t i = n > TRACE_RING_SIZE ? n - TRACE_RING_SIZE : 0; i < n; ++i) {
+            const TRACE_EVENT &ev = ring.events[i % TRACE_RING_SIZE];
+            const char *name = ev.name.load(std::memory_order_relaxed);
+            fprintf(fp, "%s\n{\"name\":", first ? "" : ",");
+            WriteJsonString(fp, name ? name : "");
+            fprintf(fp, ",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d}",
+                    static_cast<long long>(ev.beginUsec.load(std::memory_order_relaxed)),
+                    static_cast<long long>(ev.durationUsec.load(std::memory_order_relaxed)), ring.tid);
+            first = false;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    bool ok = fclose(fp) == 0;
+#ifndef _WIN32
+    if (!ok || rename(tempPath.c_str(), g_tracePath.c_str()) != 0) {
+        ok = false;
+        unlink(tempPath.c_str());
+    }
+#endif
+    if (!ok) {
+        fprintf(stderr, "Warning: failed to write trace file.\n");
+    }
+    return ok;
+}
+#endif
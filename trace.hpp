@@ -0,0 +1,51 @@
+#ifndef INCLUDE_TRACE_HPP
+#define INCLUDE_TRACE_HPP
+
+// Trace points are compiled only when TSMEMSEG_TRACE is defined (e.g. "make CPPFLAGS=-DTSMEMSEG_TRACE").
+#ifdef TSMEMSEG_TRACE
+#include <stdint.h>
+
+class CTraceScope
+{
+public:
+    // "name" must be a string literal. The event is recorded only if it lasts at least "minDurationUsec".
+    explicit CTraceScope(const char *name, int64_t minDurationUsec = 0);
+    ~CTraceScope();
+    CTraceScope(const CTraceScope &) = delete;
+    CTraceScope &operator=(const CTraceScope &) = delete;
+
+private:
+    const char *m_name;
+    int64_t m_minDurationUsec;
+    int64_t m_beginUsec;
+};
+
+// Set the path of the dump file
+void TraceInit(const char *path);
+// Name the calling thread in the dump. "name" must be a string literal.
+void TraceSetThreadName(const char *name);
+// Async-signal-safe
+void TraceRequestDump();
+// Write events of all threads in Chrome trace JSON if requested (or always if "force")
+bool TraceDump(bool force);
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) CTraceScope TRACE_CONCAT(traceScope_, __LINE__)(name)
+#define TRACE_SCOPE_MIN(name, usec) CTraceScope TRACE_CONCAT(traceScope_, __LINE__)(name, usec)
+#define TRACE_INIT(path) TraceInit(path)
+#define TRACE_THREAD_NAME(name) TraceSetThreadName(name)
+#define TRACE_REQUEST_DUMP() TraceRequestDump()
+#define TRACE_DUMP_IF_REQUESTED() TraceDump(false)
+#define TRACE_DUMP() TraceDump(true)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_MIN(name, usec)
+#define TRACE_INIT(path)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_REQUEST_DUMP()
+#define TRACE_DUMP_IF_REQUESTED()
+#define TRACE_DUMP()
+#endif
+
+#endif
@@ -0,0 +1,413 @@
+#include "tsgen.hpp"
+#include "util.hpp"
+#include <algorithm>
+
+namespace
+{
+const int PMT_PID = 0x1000;
+const int VIDEO_PID = 0x100;
+const int AUDIO_PID = 0x101;
+const int ID3_PID = 0x102;
+const int EXTRA_PID_BEGIN = 0x110;
+const int64_t PTS_BEGIN = 900000;
+
+class CBitWriter
+{
+public:
+    void PutBits(int n, uint32_t v) {
+        while (--n >= 0) {
+            if (m_bitCount % 8 == 0) {
+                m_data.push_back(0);
+            }
+            m_data.back() |= ((v >> n) & 1) << (7 - m_bitCount % 8);
+            ++m_bitCount;
+        }
+    }
+    void PutUeg(uint32_t v) {
+        int n = 0;
+        while (((v + 1) >> n) > 1) {
+            ++n;
+        }
+        PutBits(n, 0);
+        PutBits(n + 1, v + 1);
+    }
+    void PutSeg(int v) { PutUeg(v > 0 ? v * 2 - 1 : -v * 2); }
+    // Append rbsp_trailing_bits and return EBSP
+    std::vector<uint8_t> GetEbsp() {
+        PutBits(1, 1);
+        std::vector<uint8_t> ebsp;
+        int zeros = 0;
+        for (auto it = m_data.begin(); it != m_data.end(); ++it) {
+            if (zeros >= 2 && *it <= 3) {
+                // emulation_prevention_three_byte
+                ebsp.push_back(3);
+                zeros = 0;
+            }
+            ebsp.push_back(*it);
+            zeros = *it == 0 ? zeros + 1 : 0;
+        }
+        return ebsp;
+    }
+
+private:
+    std::vector<uint8_t> m_data;
+    size_t m_bitCount = 0;
+};
+
+class CPacketizer
+{
+public:
+    CPacketizer(std::vector<uint8_t> &ts) : m_ts(ts) {}
+    // Split "payload" into TS packets. PCR (if pcr >= 0) is placed on the first packet.
+    void Put(int pid, const std::vector<uint8_t> &payload, bool unitStart, int64_t pcr = -1) {
+        size_t pos = 0;
+        do {
+            int &counter = m_counters[pid];
+            uint8_t packet[188];
+            packet[0] = 0x47;
+            packet[1] = static_cast<uint8_t>((pos == 0 && unitStart ? 0x40 : 0) | (pid >> 8));
+            packet[2] = static_cast<uint8_t>(pid);
+            size_t adaptationLen = pos == 0 && pcr >= 0 ? 8 : 0;
+            size_t room = 184 - adaptationLen;
+            size_t n = std::min(payload.size() - pos, room);
+            if (n < room) {
+                // Stuffing
+                adaptationLen = 184 - n;
+            }
+            packet[3] = static_cast<uint8_t>((adaptationLen ? 0x30 : 0x10) | counter);
+            counter = (counter + 1) & 0x0f;
+            if (adaptationLen) {
+                packet[4] = static_cast<uint8_t>(adaptationLen - 1);
+                if (adaptationLen >= 2) {
+                    packet[5] = 0;
+                    std::fill(packet + 6, packet + 4 + adaptationLen, 0xff);
+                    if (pos == 0 && pcr >= 0) {
+                        packet[5] = 0x10;
+                        packet[6] = static_cast<uint8_t>(pcr >> 25);
+                        packet[7] = static_cast<uint8_t>(pcr >> 17);
+                        packet[8] = static_cast<uint8_t>(pcr >> 9);
+                        packet[9] = static_cast<uint8_t>(pcr >> 1);
+                        packet[10] = static_cast<uint8_t>((pcr << 7) | 0x7e);
+                        packet[11] = 0;
+                    }
+                }
+            }
+            std::copy(payload.begin() + pos, payload.begin() + pos + n, packet + 4 + adaptationLen);
+            m_ts.insert(m_ts.end(), packet, packet + 188);
+            pos += n;
+        }
+        while (pos < payload.size());
+    }
+
+private:
+    std::vector<uint8_t> &m_ts;
+    int m_counters[0x2000] = {};
+};
+
+void PushTimestamp(std::vector<uint8_t> &data, int marker, int64_t t)
+{
+    data.push_back(static_cast<uint8_t>((marker << 4) | ((t >> 29) & 0x0e) | 1));
+    data.push_back(static_cast<uint8_t>(t >> 22));
+    data.push_back(static_cast<uint8_t>((t >> 14) | 1));
+    data.push_back(static_cast<uint8_t>(t >> 7));
+    data.push_back(static_cast<uint8_t>((t << 1) | 1));
+}
+
+// PES header with PTS (and DTS if dts >= 0). PES_packet_length is 0 (unbounded) unless "bounded".
+std::vector<uint8_t> CreatePesHeader(int streamID, size_t payloadSize, int64_t pts, int64_t dts, bool bounded)
+{
+    std::vector<uint8_t> pes = {0, 0, 1, static_cast<uint8_t>(streamID), 0, 0, 0x80,
+                                static_cast<uint8_t>(dts >= 0 ? 0xc0 : 0x80), static_cast<uint8_t>(dts >= 0 ? 10 : 5)};
+    PushTimestamp(pes, dts >= 0 ? 3 : 2, pts);
+    if (dts >= 0) {
+        PushTimestamp(pes, 1, dts);
+    }
+    size_t pesLength = pes.size() - 6 + payloadSize;
+    if (bounded && pesLength < 65536) {
+        pes[4] = static_cast<uint8_t>(pesLength >> 8);
+        pes[5] = static_cast<uint8_t>(pesLength);
+    }
+    return pes;
+}
+
+std::vector<uint8_t> CreateSection(int tableID, int tableIDExtension, const std::vector<uint8_t> &body)
+{
+    size_t sectionLength = body.size() + 9;
+    // pointer_field and the section
+    std::vector<uint8_t> psi(9 + body.size());
+    psi[1] = static_cast<uint8_t>(tableID);
+    psi[2] = static_cast<uint8_t>(0xb0 | (sectionLength >> 8));
+    psi[3] = static_cast<uint8_t>(sectionLength);
+    psi[4] = static_cast<uint8_t>(tableIDExtension >> 8);
+    psi[5] = static_cast<uint8_t>(tableIDExtension);
+    psi[6] = 0xc1;
+    std::copy(body.begin(), body.end(), psi.begin() + 9);
+    uint32_t crc = calc_crc32(psi.data() + 1, static_cast<int>(psi.size() - 1));
+    for (int i = 24; i >= 0; i -= 8) {
+        psi.push_back(static_cast<uint8_t>(crc >> i));
+    }
+    return psi;
+}
+
+void PushProfileTierLevel(CBitWriter &bw)
+{
+    // Main profile, level 4
+    bw.PutBits(2, 0);
+    bw.PutBits(1, 0);
+    bw.PutBits(5, 1);
+    bw.PutBits(32, 0x60000000);
+    bw.PutBits(32, 0x90000000);
+    bw.PutBits(16, 0);
+    bw.PutBits(8, 120);
+}
+
+void PushParameterSets(std::vector<uint8_t> &es, bool h265, int frameRate)
+{
+    static const uint8_t START_CODE[4] = {0, 0, 0, 1};
+    std::vector<std::vector<uint8_t>> nals;
+    if (h265) {
+        CBitWriter vps;
+        vps.PutBits(16, 0x4001);
+        vps.PutBits(4, 0);
+        vps.PutBits(2, 3);
+        vps.PutBits(6, 0);
+        vps.PutBits(3, 0);
+        vps.PutBits(1, 1);
+        vps.PutBits(16, 0xffff);
+        PushProfileTierLevel(vps);
+        vps.PutBits(1, 1);
+        vps.PutUeg(1);
+        vps.PutUeg(0);
+        vps.PutUeg(0);
+        vps.PutBits(6, 0);
+        vps.PutUeg(0);
+        vps.PutBits(1, 0);
+        vps.PutBits(1, 0);
+        nals.push_back(vps.GetEbsp());
+
+        // 1280x720 4:2:0 8bit
+        CBitWriter sps;
+        sps.PutBits(16, 0x4201);
+        sps.PutBits(4, 0);
+        sps.PutBits(3, 0);
+        sps.PutBits(1, 1);
+        PushProfileTierLevel(sps);
+        sps.PutUeg(0);
+        sps.PutUeg(1);
+        sps.PutUeg(1280);
+        sps.PutUeg(720);
+        sps.PutBits(1, 0);
+        sps.PutUeg(0);
+        sps.PutUeg(0);
+        sps.PutUeg(4);
+        sps.PutBits(1, 1);
+        sps.PutUeg(1);
+        sps.PutUeg(0);
+        sps.PutUeg(0);
+        sps.PutUeg(0);
+        sps.PutUeg(2);
+        sps.PutUeg(0);
+        sps.PutUeg(3);
+        sps.PutUeg(0);
+        sps.PutUeg(0);
+        sps.PutBits(1, 0);
+        sps.PutBits(2, 0);
+        sps.PutBits(1, 0);
+        sps.PutUeg(0);
+        sps.PutBits(1, 0);
+        sps.PutBits(2, 0);
+        sps.PutBits(1, 0);
+        sps.PutBits(1, 0);
+        nals.push_back(sps.GetEbsp());
+
+        CBitWriter pps;
+        pps.PutBits(16, 0x4401);
+        pps.PutUeg(0);
+        pps.PutUeg(0);
+        pps.PutBits(7, 0);
+        pps.PutUeg(0);
+        pps.PutUeg(0);
+        pps.PutSeg(0);
+        pps.PutBits(2, 0);
+        pps.PutBits(1, 0);
+        pps.PutSeg(0);
+        pps.PutSeg(0);
+        pps.PutBits(4, 0);
+        pps.PutBits(2, 0);
+        pps.PutBits(1, 1);
+        pps.PutBits(1, 0);
+        pps.PutBits(1, 0);
+        pps.PutBits(1, 0);
+        pps.PutUeg(0);
+        pps.PutBits(1, 0);
+        pps.PutBits(1, 0);
+        nals.push_back(pps.GetEbsp());
+    }
+    else {
+        // Main profile, level 3.1, 1280x720
+        CBitWriter sps;
+        sps.PutBits(8, 0x67);
+        sps.PutBits(8, 77);
+        sps.PutBits(8, 0);
+        sps.PutBits(8, 31);
+        sps.PutUeg(0);
+        sps.PutUeg(0);
+        sps.PutUeg(2);
+        sps.PutUeg(1);
+        sps.PutBits(1, 0);
+        sps.PutUeg(79);
+        sps.PutUeg(44);
+        sps.PutBits(1, 1);
+        sps.PutBits(1, 1);
+        sps.PutBits(1, 0);
+        // VUI with timing info
+        sps.PutBits(1, 1);
+        sps.PutBits(1, 1);
+        sps.PutBits(8, 1);
+        sps.PutBits(1, 0);
+        sps.PutBits(1, 0);
+        sps.PutBits(1, 0);
+        sps.PutBits(1, 1);
+        sps.PutBits(32, 1);
+        sps.PutBits(32, frameRate * 2);
+        sps.PutBits(1, 1);
+        sps.PutBits(1, 0);
+        sps.PutBits(1, 0);
+        sps.PutBits(1, 0);
+        sps.PutBits(1, 0);
+        nals.push_back(sps.GetEbsp());
+
+        CBitWriter pps;
+        pps.PutBits(8, 0x68);
+        pps.PutUeg(0);
+        pps.PutUeg(0);
+        pps.PutBits(1, 0);
+        pps.PutBits(1, 0);
+        pps.PutUeg(0);
+        pps.PutUeg(0);
+        pps.PutUeg(0);
+        pps.PutBits(1, 0);
+        pps.PutBits(2, 0);
+        pps.PutSeg(0);
+        pps.PutSeg(0);
+        pps.PutSeg(0);
+        pps.PutBits(1, 1);
+        pps.PutBits(1, 0);
+        pps.PutBits(1, 0);
+        nals.push_back(pps.GetEbsp());
+    }
+    for (auto it = nals.begin(); it != nals.end(); ++it) {
+        es.insert(es.end(), START_CODE, START_CODE + 4);
+        es.insert(es.end(), it->begin(), it->end());
+    }
+}
+
+// Dummy slice data, never containing 0x00 so that no start code is emulated
+void PushDummyData(std::vector<uint8_t> &data, size_t size, uint32_t &state)
+{
+    for (size_t i = 0; i < size; ++i) {
+        state = state * 1664525 + 1013904223;
+        data.push_back(static_cast<uint8_t>((state >> 24) | 0x01));
+    }
+}
+}
+
+void GenerateTs(const TSGEN_PARAMS &params, int durationMsec, std::vector<uint8_t> &ts)
+{
+    CPacketizer packetizer(ts);
+    uint32_t state = params.seed;
+    int frameRate = std::max(params.frameRate, 1);
+    int gopFrames = std::max(params.gopFrames, 1);
+    int frameTicks = 90000 / frameRate;
+    size_t frameBytes = static_cast<size_t>(std::max(params.videoKbps, 1)) * 1000 / 8 / frameRate;
+    // Key frames are 4 times larger keeping the bitrate
+    size_t interFrameBytes = frameBytes * gopFrames / (gopFrames + 3);
+    size_t keyFrameBytes = interFrameBytes * 4;
+
+    std::vector<uint8_t> pmtBody = {0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff, 0xf0, 0,
+                                    params.h265 ? H_265_VIDEO : AVC_VIDEO, 0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff, 0xf0, 0};
+    if (params.audio) {
+        pmtBody.insert(pmtBody.end(), {ADTS_TRANSPORT, 0xe0 | (AUDIO_PID >> 8), AUDIO_PID & 0xff, 0xf0, 0});
+    }
+    if (params.id3) {
+        pmtBody.insert(pmtBody.end(), {PES_ID3_METADATA, 0xe0 | (ID3_PID >> 8), ID3_PID & 0xff, 0xf0, 0});
+    }
+    for (int i = 0; i < params.extraPidNum && EXTRA_PID_BEGIN + i < 0x1fff; ++i) {
+        int pid = EXTRA_PID_BEGIN + i;
+        // Private data
+        pmtBody.insert(pmtBody.end(), {0x06, static_cast<uint8_t>(0xe0 | (pid >> 8)), static_cast<uint8_t>(pid), 0xf0, 0});
+    }
+    std::vector<uint8_t> pat = CreateSection(0, 1, {0, 1, 0xe0 | (PMT_PID >> 8), PMT_PID & 0xff});
+    std::vector<uint8_t> pmt = CreateSection(2, 1, pmtBody);
+
+    int64_t audioPts = PTS_BEGIN;
+    int64_t id3Pts = PTS_BEGIN;
+    int64_t lastPsiPts = -1;
+    std::vector<uint8_t> es;
+    std::vector<uint8_t> pes;
+    int frameNum = static_cast<int>(static_cast<int64_t>(durationMsec) * frameRate / 1000);
+
+    for (int i = 0; i < frameNum; ++i) {
+        int64_t dts = PTS_BEGIN + static_cast<int64_t>(i) * frameTicks;
+        if (lastPsiPts < 0 || dts - lastPsiPts >= 9000) {
+            packetizer.Put(0, pat, true);
+            packetizer.Put(PMT_PID, pmt, true);
+            lastPsiPts = dts;
+        }
+
+        bool isKey = i % gopFrames == 0;
+        es.clear();
+        if (params.h265) {
+            // AUD
+            es.insert(es.end(), {0, 0, 0, 1, 0x46, 0x01, 0x50});
+            if (isKey) {
+                PushParameterSets(es, true, frameRate);
+            }
+            // IDR_W_RADL or TRAIL_R
+            es.insert(es.end(), {0, 0, 1, static_cast<uint8_t>(isKey ? 0x26 : 0x02), 0x01, 0xaf});
+        }
+        else {
+            es.insert(es.end(), {0, 0, 0, 1, 0x09, 0xf0});
+            if (isKey) {
+                PushParameterSets(es, false, frameRate);
+            }
+            es.insert(es.end(), {0, 0, 1, static_cast<uint8_t>(isKey ? 0x65 : 0x41), 0x88, 0x84});
+        }
+        PushDummyData(es, isKey ? keyFrameBytes : interFrameBytes, state);
+        pes = CreatePesHeader(0xe0, es.size(), dts + frameTicks, dts, false);
+        pes.insert(pes.end(), es.begin(), es.end());
+        packetizer.Put(VIDEO_PID, pes, true, dts - 6000);
+
+        while (params.audio && audioPts < dts + frameTicks) {
+            // 3 AAC frames (1024 samples each) per PES
+            es.clear();
+            for (int j = 0; j < 3; ++j) {
+                size_t frameLen = 7 + 334;
+                es.insert(es.end(), {0xff, 0xf1, 0x4c, static_cast<uint8_t>(0x80 | (frameLen >> 11)),
+                                     static_cast<uint8_t>(frameLen >> 3), static_cast<uint8_t>(((frameLen & 7) << 5) | 0x1f), 0xfc});
+                PushDummyData(es, frameLen - 7, state);
+            }
+            pes = CreatePesHeader(0xc0, es.size(), audioPts, -1, true);
+            pes.insert(pes.end(), es.begin(), es.end());
+            packetizer.Put(AUDIO_PID, pes, true);
+            audioPts += 3 * 1920;
+        }
+
+        if (params.id3 && id3Pts < dts + frameTicks) {
+            // ID3v2.4 tag with a TXXX frame
+            static const char TEXT[] = "\x03" "bench" "\0" "tsmemseg";
+            es.assign({'I', 'D', '3', 4, 0, 0, 0, 0, 0, sizeof(TEXT) - 1 + 10, 'T', 'X', 'X', 'X', 0, 0, 0, sizeof(TEXT) - 1, 0, 0});
+            es.insert(es.end(), TEXT, TEXT + sizeof(TEXT) - 1);
+            pes = CreatePesHeader(0xbd, es.size(), id3Pts, -1, true);
+            pes.insert(pes.end(), es.begin(), es.end());
+            packetizer.Put(ID3_PID, pes, true);
+            id3Pts += 90000;
+        }
+
+        for (int j = 0; j < params.extraPidNum && EXTRA_PID_BEGIN + j < 0x1fff; ++j) {
+            es.clear();
+            PushDummyData(es, 184, state);
+            packetizer.Put(EXTRA_PID_BEGIN + j, es, false);
+        }
+    }
+}
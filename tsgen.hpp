@@ -0,0 +1,29 @@
+#ifndef INCLUDE_TSGEN_HPP
+#define INCLUDE_TSGEN_HPP
+
+#include <stdint.h>
+#include <vector>
+
+struct TSGEN_PARAMS
+{
+    bool h265;
+    int frameRate;
+    // Frames per GOP, the first of which is IDR
+    int gopFrames;
+    // Video bitrate in kbps. Key frames are 4 times larger than the others.
+    int videoKbps;
+    // 48kHz stereo ADTS at about 128kbps
+    bool audio;
+    // An ID3 timed metadata every second
+    bool id3;
+    // Number of private streams carrying dummy data, a packet per frame each
+    int extraPidNum;
+    // Seed of the dummy payload
+    uint32_t seed;
+};
+
+// Append deterministic synthetic TS of "durationMsec" to "ts".
+// The stream has the PAT/PMT every 100 milliseconds, and PCR on the video PID.
+void GenerateTs(const TSGEN_PARAMS &params, int durationMsec, std::vector<uint8_t> &ts);
+
+#endif
@@ -7,36 +7,60 @@
 #else
 #include <errno.h>
 #include <signal.h>
-#include <string.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <condition_variable>
 #endif
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <initializer_list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
-#include <unordered_map>
 #include <utility>
 #include <vector>
+#include "aes.hpp"
+#include "mappedfile.hpp"
 #include "mp4fragmenter.hpp"
+#include "segmenter.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 
 namespace
 {
 constexpr uint32_t SEGMENT_COUNT_EMPTY = 0x1000000;
-constexpr size_t SEGMENTS_MAX = 100;
-// Maximum number of fragments per segment (38 is the configurable maximum)
-constexpr size_t MP4_FRAG_MAX_NUM = 20;
+#ifdef _WIN32
+// Every segment takes 2 pipe instances and every 31 segments take a worker thread, which do not scale to the Unix limit
+constexpr size_t SEGMENTS_MAX = 1000;
+#else
+constexpr size_t SEGMENTS_MAX = 10000;
+#endif
+// Maximum number of fragments per segment
+constexpr size_t MP4_FRAG_MAX_NUM = 400;
+// Revision of the listing/segment pipe format
+constexpr uint8_t PIPE_FORMAT_REVISION = 2;
+#ifdef _WIN32
+// Segments served by a worker thread, limited by MAXIMUM_WAIT_OBJECTS
+constexpr size_t SEGMENTS_PER_WORKER = 31;
+#else
+// Segments polled for connection every cycle (the listing and the recent segments), others are polled less frequently
+constexpr size_t HOT_SEGMENTS_NUM = 100;
+constexpr size_t COLD_SEGMENTS_POLL_INTERVAL = 10;
+#endif
+// Maximum time for a reader to wait for the conversion resumed by its access (-l)
+constexpr int LAZY_RESUME_WAIT_MSEC = 2000;
 
 using lock_recursive_mutex = std::lock_guard<std::recursive_mutex>;
 
@@ -81,6 +105,65 @@ private:
 #endif
 };
 
+class CHistogram
+{
+public:
+    CHistogram(std::initializer_list<double> bounds) : m_bounds(bounds), m_counts(bounds.size() + 1), m_sum(0) {}
+    void Observe(double value) {
+        std::lock_guard<std::mutex> lock(m_lock);
+        ++m_counts[std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin()];
+        m_sum += value;
+    }
+    // Write in OpenMetrics text format
+    void Write(FILE *fp, const char *name, const char *unit, const char *help, const char *segName) const {
+        std::lock_guard<std::mutex> lock(m_lock);
+        fprintf(fp, "# TYPE %s histogram\n", name);
+        if (unit[0]) {
+            fprintf(fp, "# UNIT %s %s\n", name, unit);
+        }
+        fprintf(fp, "# HELP %s %s\n", name, help);
+        uint64_t count = 0;
+        for (size_t i = 0; i < m_counts.size(); ++i) {
+            count += m_counts[i];
+            if (i < m_bounds.size()) {
+                // Avoid exponent for integers
+                fprintf(fp, m_bounds[i] == static_cast<int64_t>(m_bounds[i]) ? "%s_bucket{seg_name=\"%s\",le=\"%.0f\"} %llu\n" :
+                                                                                "%s_bucket{seg_name=\"%s\",le=\"%g\"} %llu\n",
+                        name, segName, m_bounds[i], static_cast<unsigned long long>(count));
+            }
+            else {
+                fprintf(fp, "%s_bucket{seg_name=\"%s\",le=\"+Inf\"} %llu\n", name, segName, static_cast<unsigned long long>(count));
+            }
+        }
+        fprintf(fp, "%s_sum{seg_name=\"%s\"} %.6f\n", name, segName, m_sum);
+        fprintf(fp, "%s_count{seg_name=\"%s\"} %llu\n", name, segName, static_cast<unsigned long long>(count));
+    }
+    CHistogram(const CHistogram &) = delete;
+    CHistogram &operator=(const CHistogram &) = delete;
+
+private:
+    std::vector<double> m_bounds;
+    std::vector<uint64_t> m_counts;
+    double m_sum;
+    mutable std::mutex m_lock;
+};
+
+struct METRICS_HISTOGRAMS
+{
+    METRICS_HISTOGRAMS()
+        : segmentDuration({0.5, 1, 2, 3, 4, 6, 8, 10, 15, 20, 30})
+        , fragmentSize({4096, 16384, 65536, 131072, 262144, 524288, 1048576, 2097152, 4194304, 8388608})
+        , publishLatency({0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1})
+        , throttleSleep({0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2})
+        , readers({0, 1, 2, 4, 8, 16, 32, 64}) {}
+    CHistogram segmentDuration;
+    CHistogram fragmentSize;
+    CHistogram publishLatency;
+    CHistogram throttleSleep;
+    // Sampled every second
+    CHistogram readers;
+};
+
 struct SEGMENT_PIPE_CONTEXT
 {
 #ifdef _WIN32
@@ -100,10 +183,34 @@ struct SEGMENT_CONTEXT
     SEGMENT_PIPE_CONTEXT pipes[2];
     std::vector<uint8_t> buf;
     std::vector<uint8_t> backBuf;
+    // If spillSize != 0, the segment has been moved to the spill store and buf is empty
+    const uint8_t *spillData;
+    size_t spillSize;
     uint32_t segCount;
     int segDurationMsec;
     int64_t segTimeMsec;
     std::vector<int> fragDurationsMsec;
+    // Version of the MP4 header this segment depends on
+    uint32_t headerVersion;
+    // Whether more MP4 fragments will be added to this segment
+    bool incomplete;
+    // Part pipe (1-based) to which the first fragment of this segment was published, 0 if none
+    size_t partSlot;
+    // For part pipes, index of the fragment in the segment
+    size_t partIndex;
+    // ID of the key this segment is encrypted with (-K)
+    uint8_t keyId[16];
+};
+
+// MP4 header boxes by version
+typedef std::map<uint32_t, std::vector<uint8_t>> MP4_HEADER_MAP;
+
+struct ENCRYPTION_KEY
+{
+    uint8_t keyId[16];
+    uint8_t key[16];
+    // Constant IV for MP4, MPEG-TS segments use their sequential numbers instead
+    uint8_t iv[16];
 };
 
 void SleepFor(std::chrono::milliseconds rel)
@@ -121,6 +228,11 @@ int64_t GetMsecTick()
     return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+int64_t GetUsecTick()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 uint32_t GetCurrentUnixTime()
 {
     return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
@@ -136,8 +248,28 @@ void ClosingRunner(const char *closingCmd, CManualResetEvent &stopEvent, std::at
     system(closingCmd);
 }
 
+// Wait until the main thread publishes the segments held while no pipe was accessed (-l), so that the first reader does
+// not get the stale listing
+void WaitForConversionResumed(const std::atomic_bool *conversionSuspended)
+{
+    for (int i = 0; conversionSuspended && *conversionSuspended && i < LAZY_RESUME_WAIT_MSEC / 10; ++i) {
+        SleepFor(std::chrono::milliseconds(10));
+    }
+}
+
+const uint8_t *GetSegmentData(const SEGMENT_CONTEXT &seg)
+{
+    return seg.spillSize ? seg.spillData : seg.buf.data();
+}
+
+size_t GetSegmentSize(const SEGMENT_CONTEXT &seg)
+{
+    return seg.spillSize ? seg.spillSize : seg.buf.size();
+}
+
 #ifdef _WIN32
-void Worker(SEGMENT_CONTEXT *segments, std::vector<HANDLE> events, std::recursive_mutex &bufLock, std::atomic_uint32_t &lastAccessTick)
+void Worker(SEGMENT_CONTEXT *segments, std::vector<HANDLE> events, std::recursive_mutex &bufLock, std::atomic_uint32_t &lastAccessTick,
+            const std::atomic_bool *conversionSuspended, CRuntimeStats *stats)
 {
     for (;;) {
         DWORD result = WaitForMultipleObjects(static_cast<DWORD>(events.size()), events.data(), FALSE, INFINITE);
@@ -158,10 +290,15 @@ void Worker(SEGMENT_CONTEXT *segments, std::vector<HANDLE> events, std::recursiv
                 // Swap and clear the back buffer.
                 seg.buf.swap(seg.backBuf);
                 std::vector<uint8_t>().swap(seg.backBuf);
+                seg.spillSize = 0;
             }
         }
         if (pipe.connected) {
             // Complete an asynchronous pipe write
+            DWORD written;
+            if (stats && GetOverlappedResult(pipe.h, &pipe.ol, &written, FALSE)) {
+                stats->Add(CRuntimeStats::BYTES_SERVED, written);
+            }
             FlushFileBuffers(pipe.h);
             DisconnectNamedPipe(pipe.h);
 
@@ -169,6 +306,7 @@ void Worker(SEGMENT_CONTEXT *segments, std::vector<HANDLE> events, std::recursiv
             pipe.connected = false;
         }
         else if (pipe.initialized) {
+            WaitForConversionResumed(conversionSuspended);
             {
                 lock_recursive_mutex lock(bufLock);
                 pipe.connected = true;
@@ -177,13 +315,24 @@ void Worker(SEGMENT_CONTEXT *segments, std::vector<HANDLE> events, std::recursiv
             OVERLAPPED olZero = {};
             pipe.ol = olZero;
             pipe.ol.hEvent = olEvent;
-            if (!WriteFile(pipe.h, seg.buf.data(),
-                           static_cast<DWORD>(seg.buf.size()), nullptr, &pipe.ol) &&
-                GetLastError() != ERROR_IO_PENDING) {
-                DisconnectNamedPipe(pipe.h);
+            if (stats) {
+                stats->Add(CRuntimeStats::READER_CONNECTS);
+            }
+            TRACE_SCOPE("Worker write");
+            if (!WriteFile(pipe.h, GetSegmentData(seg),
+                           static_cast<DWORD>(GetSegmentSize(seg)), nullptr, &pipe.ol)) {
+                if (GetLastError() == ERROR_IO_PENDING) {
+                    // Pipe buffer is full
+                    if (stats) {
+                        stats->Add(CRuntimeStats::PIPE_FULL_STALLS);
+                    }
+                }
+                else {
+                    DisconnectNamedPipe(pipe.h);
 
-                lock_recursive_mutex lock(bufLock);
-                pipe.connected = false;
+                    lock_recursive_mutex lock(bufLock);
+                    pipe.connected = false;
+                }
             }
         }
         if (!pipe.connected) {
@@ -217,14 +366,49 @@ void Worker(SEGMENT_CONTEXT *segments, std::vector<HANDLE> events, std::recursiv
     }
 }
 #else
-void Worker(std::vector<SEGMENT_CONTEXT> &segments, CManualResetEvent &stopEvent, std::recursive_mutex &bufLock, std::atomic_uint32_t &lastAccessTick)
+size_t GetSegmentHeaderSize(const uint8_t *data)
+{
+    // The signature field, the information packet and its additional units
+    return 188 + 188 * (1 + data[188 + 13]);
+}
+
+bool FollowIncompleteSegment(SEGMENT_CONTEXT &seg, std::recursive_mutex &bufLock, size_t &written)
+{
+    // Called when all of the segment has been written to the pipe.
+    // Returns true if the pipe should be kept open for the fragments added later.
+    lock_recursive_mutex lock(bufLock);
+
+    if (!seg.backBuf.empty()) {
+        // The back buffer holds the latest state, continue from the same position of the stream if it is the same segment
+        if (seg.spillSize != 0 || !std::equal(&seg.buf[188 + 4], &seg.buf[188 + 8], &seg.backBuf[188 + 4])) {
+            return false;
+        }
+        written = written - GetSegmentHeaderSize(seg.buf.data()) + GetSegmentHeaderSize(seg.backBuf.data());
+        seg.buf.swap(seg.backBuf);
+        std::vector<uint8_t>().swap(seg.backBuf);
+        return true;
+    }
+    return seg.incomplete;
+}
+
+void Worker(std::vector<SEGMENT_CONTEXT> &segments, CManualResetEvent &stopEvent, std::recursive_mutex &bufLock, std::atomic_uint32_t &lastAccessTick,
+            const std::atomic_bool *conversionSuspended, CRuntimeStats *stats, bool progressive)
 {
+    // Sequential number of the newest segment seen in the previous cycles
+    uint32_t newestSegCount = SEGMENT_COUNT_EMPTY;
+    size_t pollCycle = 0;
+    std::vector<pollfd> pfds;
+    TRACE_THREAD_NAME("Worker");
+
     for (;;) {
+        TRACE_DUMP_IF_REQUESTED();
         int64_t tick = GetMsecTick();
         bool connected = false;
+        ++pollCycle;
         for (auto it = segments.begin(); it != segments.end(); ++it) {
             SEGMENT_PIPE_CONTEXT &pipe = it->pipes[0];
             if (!pipe.connected) {
+                uint32_t segCount;
                 {
                     lock_recursive_mutex lock(bufLock);
 
@@ -233,22 +417,39 @@ void Worker(std::vector<SEGMENT_CONTEXT> &segments, CManualResetEvent &stopEvent
                         // Swap and clear the back buffer.
                         it->buf.swap(it->backBuf);
                         std::vector<uint8_t>().swap(it->backBuf);
+                        it->spillSize = 0;
                     }
+                    segCount = it->segCount;
+                }
+                if (segCount != SEGMENT_COUNT_EMPTY &&
+                    (newestSegCount == SEGMENT_COUNT_EMPTY || ((segCount - newestSegCount) & 0xffffff) < 0x800000)) {
+                    newestSegCount = segCount;
+                }
+                // Opening a FIFO costs a path lookup, so avoid trying every segment of a large ring in every cycle
+                size_t i = it - segments.begin();
+                if (i != 0 && segments.size() > HOT_SEGMENTS_NUM &&
+                    (segCount == SEGMENT_COUNT_EMPTY || ((newestSegCount - segCount) & 0xffffff) >= HOT_SEGMENTS_NUM) &&
+                    (i + pollCycle) % COLD_SEGMENTS_POLL_INTERVAL != 0) {
+                    continue;
                 }
                 // Start connecting
                 pipe.fd = open(it->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
                 if (pipe.fd >= 0) {
                     lastAccessTick = static_cast<uint32_t>(tick);
+                    WaitForConversionResumed(conversionSuspended);
                     pipe.written = 0;
+                    if (stats) {
+                        stats->Add(CRuntimeStats::READER_CONNECTS);
+                    }
                     {
                         lock_recursive_mutex lock(bufLock);
                         pipe.connected = true;
                     }
 #if defined(F_GETPIPE_SZ) && defined(F_SETPIPE_SZ)
                     int pipeBufSize = fcntl(pipe.fd, F_GETPIPE_SZ);
-                    if (pipeBufSize > 0 && pipeBufSize < static_cast<int>(it->buf.size() / 2)) {
+                    if (pipeBufSize > 0 && pipeBufSize < static_cast<int>(GetSegmentSize(*it) / 2)) {
                         // Buffer is too small, expand up to 5 times.
-                        fcntl(pipe.fd, F_SETPIPE_SZ, std::min(static_cast<int>(it->buf.size()), pipeBufSize * 5));
+                        fcntl(pipe.fd, F_SETPIPE_SZ, std::min(static_cast<int>(GetSegmentSize(*it)), pipeBufSize * 5));
                     }
 #endif
                 }
@@ -261,22 +462,40 @@ void Worker(std::vector<SEGMENT_CONTEXT> &segments, CManualResetEvent &stopEvent
 
         while (connected) {
             connected = false;
-            fd_set wfd;
-            FD_ZERO(&wfd);
-            int maxfd = -1;
+            pfds.clear();
             for (auto it = segments.begin(); it != segments.end(); ++it) {
                 SEGMENT_PIPE_CONTEXT &pipe = it->pipes[0];
                 if (pipe.connected) {
+                    TRACE_SCOPE("Worker write");
+                    const uint8_t *data = GetSegmentData(*it);
+                    size_t size = GetSegmentSize(*it);
                     ssize_t n = 0;
-                    while (pipe.written < it->buf.size() &&
-                           (n = write(pipe.fd, it->buf.data() + pipe.written, it->buf.size() - pipe.written)) > 0) {
+                    while (pipe.written < size &&
+                           (n = write(pipe.fd, data + pipe.written, size - pipe.written)) > 0) {
                         pipe.written += n;
+                        if (stats) {
+                            stats->Add(CRuntimeStats::BYTES_SERVED, n);
+                        }
                     }
-                    if (pipe.written < it->buf.size() && n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    if (pipe.written < size && n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        // Pipe buffer is full
+                        if (stats) {
+                            stats->Add(CRuntimeStats::PIPE_FULL_STALLS);
+                        }
                         connected = true;
-                        maxfd = std::max(maxfd, pipe.fd);
-                        if (maxfd < FD_SETSIZE) {
-                            FD_SET(pipe.fd, &wfd);
+                        pollfd pfd = {};
+                        pfd.fd = pipe.fd;
+                        pfd.events = POLLOUT;
+                        pfds.push_back(pfd);
+                    }
+                    else if (progressive && pipe.written >= size && FollowIncompleteSegment(*it, bufLock, pipe.written)) {
+                        // Keep the reader and write fragments added later
+                        if (pipe.written < GetSegmentSize(*it)) {
+                            connected = true;
+                            pollfd pfd = {};
+                            pfd.fd = pipe.fd;
+                            pfd.events = POLLOUT;
+                            pfds.push_back(pfd);
                         }
                     }
                     else {
@@ -288,21 +507,12 @@ void Worker(std::vector<SEGMENT_CONTEXT> &segments, CManualResetEvent &stopEvent
                 }
             }
             if (connected) {
-                if (maxfd < FD_SETSIZE) {
-                    // Wait for writable
-                    timeval tv = {};
-                    tv.tv_usec = static_cast<long>(std::max<int64_t>(tick - GetMsecTick(), 0) * 1000);
-                    if (tv.tv_usec <= 0 || tv.tv_usec >= 1000000 ||
-                        select(maxfd + 1, nullptr, &wfd, nullptr, &tv) < 0 ||
-                        stopEvent.WaitOne(std::chrono::milliseconds(0))) {
-                        break;
-                    }
-                }
-                else {
-                    // Sleep a little
-                    if (GetMsecTick() >= tick || stopEvent.WaitOne(std::chrono::milliseconds(1))) {
-                        break;
-                    }
+                // Wait for writable
+                int timeoutMsec = static_cast<int>(std::max<int64_t>(tick - GetMsecTick(), 0));
+                if (timeoutMsec <= 0 || timeoutMsec >= 1000 ||
+                    poll(pfds.data(), static_cast<nfds_t>(pfds.size()), timeoutMsec) < 0 ||
+                    stopEvent.WaitOne(std::chrono::milliseconds(0))) {
+                    break;
                 }
             }
         }
@@ -335,12 +545,58 @@ void CloseSegments(const std::vector<SEGMENT_CONTEXT> &segments)
     }
 }
 
-#ifndef _WIN32
+#ifdef _WIN32
+bool CreateSegmentPipe(SEGMENT_CONTEXT &seg, const char *destName, const char *pipeId, std::vector<std::unique_ptr<CManualResetEvent>> &events)
+{
+    sprintf(seg.path, "\\\\.\\pipe\\tsmemseg_%s%s", destName, pipeId);
+    // Create 2 pipes for simultaneous access
+    size_t createdCount = 0;
+    for (; createdCount < 2; ++createdCount) {
+        events.emplace_back(new CManualResetEvent(true));
+        seg.pipes[createdCount].h = CreateNamedPipeA(seg.path, PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED, 0, 2, 48128, 0, 0, nullptr);
+        if (seg.pipes[createdCount].h == INVALID_HANDLE_VALUE) {
+            break;
+        }
+    }
+    if (createdCount < 2) {
+        if (createdCount == 1) {
+            CloseHandle(seg.pipes[0].h);
+        }
+        return false;
+    }
+    return true;
+}
+#else
+bool CreateSegmentPipe(SEGMENT_CONTEXT &seg, const char *destName, const char *pipeId, const char *fifoDir)
+{
+    size_t dirLen = strlen(fifoDir);
+    if ((dirLen ? dirLen + (fifoDir[dirLen - 1] != '/' ? 1 : 0) : 5) + strlen(destName) + 14 + strlen(pipeId) >= sizeof(seg.path)) {
+        // path too long
+        return false;
+    }
+    sprintf(seg.path, "%s%stsmemseg_%s%s.fifo", dirLen ? fifoDir : "/tmp/",
+                                                dirLen && fifoDir[dirLen - 1] != '/' ? "/" : "",
+                                                destName, pipeId);
+    return mkfifo(seg.path, S_IRUSR + S_IWUSR + (dirLen ? S_IRGRP + S_IWGRP + S_IROTH + S_IWOTH : 0)) == 0;
+}
+
 const std::vector<SEGMENT_CONTEXT> *g_signalParam;
+const std::vector<SEGMENT_CONTEXT> *g_signalStatsParam;
+const std::vector<SEGMENT_CONTEXT> *g_signalPartParam;
+const std::vector<SEGMENT_CONTEXT> *g_signalTsParam;
 
 void SignalHandler(int signum)
 {
     // Unlink all fifo files.
+    if (g_signalStatsParam) {
+        CloseSegments(*g_signalStatsParam);
+    }
+    if (g_signalPartParam) {
+        CloseSegments(*g_signalPartParam);
+    }
+    if (g_signalTsParam) {
+        CloseSegments(*g_signalTsParam);
+    }
     CloseSegments(*g_signalParam);
 
     struct sigaction sigact = {};
@@ -348,7 +604,62 @@ void SignalHandler(int signum)
     sigaction(signum, &sigact, nullptr);
     raise(signum);
 }
+
+#ifdef TSMEMSEG_TRACE
+void TraceSignalHandler(int signum)
+{
+    static_cast<void>(signum);
+    TRACE_REQUEST_DUMP();
+}
 #endif
+#endif
+
+bool ParseHex16(const char *&s, uint8_t *dest)
+{
+    while (*s == ' ' || *s == '\t') {
+        ++s;
+    }
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s += 2;
+    }
+    for (int i = 0; i < 32; ++i, ++s) {
+        int c = *s;
+        int n = '0' <= c && c <= '9' ? c - '0' : 'A' <= c && c <= 'F' ? c - 'A' + 10 : 'a' <= c && c <= 'f' ? c - 'a' + 10 : -1;
+        if (n < 0) {
+            return false;
+        }
+        dest[i / 2] = static_cast<uint8_t>(i % 2 ? (dest[i / 2] << 4) | n : n);
+    }
+    return true;
+}
+
+// Read the key ID, the key and the IV, separated by spaces in hex, from the first line of the key file
+bool ReadKeyFile(const char *path, ENCRYPTION_KEY &key)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    char line[256];
+    bool ok = fgets(line, sizeof(line), fp) != nullptr;
+    fclose(fp);
+    const char *s = line;
+    return ok && ParseHex16(s, key.keyId) && ParseHex16(s, key.key) && ParseHex16(s, key.iv);
+}
+
+// Encrypt the MPEG-TS packets from "begin" with AES-128-CBC and PKCS#7 padding, as the method "AES-128" of HLS.
+// The IV is the sequential number of the segment, which is the default of the method.
+void EncryptSegment(std::vector<uint8_t> &buf, size_t begin, const CAes128 &aes, uint32_t segCount)
+{
+    size_t padding = 16 - (buf.size() - begin) % 16;
+    buf.insert(buf.end(), padding, static_cast<uint8_t>(padding));
+    uint8_t iv[16] = {};
+    iv[12] = static_cast<uint8_t>(segCount >> 24);
+    iv[13] = static_cast<uint8_t>(segCount >> 16);
+    iv[14] = static_cast<uint8_t>(segCount >> 8);
+    iv[15] = static_cast<uint8_t>(segCount);
+    aes.EncryptCbc(&buf[begin], (buf.size() - begin) / 16, iv);
+}
 
 void WriteUint32(uint8_t *buf, uint32_t n)
 {
@@ -358,40 +669,155 @@ void WriteUint32(uint8_t *buf, uint32_t n)
     buf[3] = static_cast<uint8_t>(n >> 24);
 }
 
-void AssignSegmentList(std::vector<uint8_t> &buf, const char *signature, const std::vector<SEGMENT_CONTEXT> &segments, size_t segIndex,
-                       bool endList, bool incomplete, bool isMp4, const std::vector<uint8_t> &mp4Header)
+// Listing of a ring of segments, whose units are kept between updates. Segments change only at the newest end of the
+// ring, so a cut rewrites the units of the newest segment and drops those of the oldest one instead of formatting all.
+class CSegmentList
 {
-    buf.assign(segments.size() * 16 + (signature ? 64 : 0), 0);
-    size_t ofs = 0;
-    if (signature) {
-        for (size_t i = 0; i < 64 && signature[i]; ++i) {
-            buf[i] = signature[i];
+public:
+    CSegmentList() : m_segIndex(1), m_fragUnitsBegin(0) {}
+    // Format all units. segments.front() is the listing itself and the oldest segment is at "segIndex".
+    void Reset(const std::vector<SEGMENT_CONTEXT> &segments, size_t segIndex, const std::vector<SEGMENT_CONTEXT> &parts) {
+        m_segIndex = segIndex;
+        m_segUnits.assign((segments.size() - 1) * 16, 0);
+        m_keyIds.assign((segments.size() - 1) * 16, 0);
+        m_fragUnits.clear();
+        m_fragUnitsBegin = 0;
+        m_fragUnitNums.clear();
+        for (size_t i = segIndex, j = 1; j < segments.size(); ++j) {
+            AppendNewest(segments, i, parts);
+            i = i % (segments.size() - 1) + 1;
         }
-        ofs = 64;
     }
-    WriteUint32(&buf[ofs], static_cast<uint32_t>(segments.size() - 1));
-    WriteUint32(&buf[ofs + 4], GetCurrentUnixTime());
-    buf[ofs + 8] = endList;
-    buf[ofs + 9] = incomplete;
-    buf[ofs + 10] = isMp4;
-    for (size_t i = segIndex, j = 1; j < segments.size(); ++j) {
-        WriteUint32(&buf[ofs + j * 16], static_cast<uint32_t>(i));
-        WriteUint32(&buf[ofs + j * 16 + 2], static_cast<uint32_t>(segments[i].fragDurationsMsec.size()));
-        WriteUint32(&buf[ofs + j * 16 + 4], segments[i].segCount);
-        WriteUint32(&buf[ofs + j * 16 + 8], segments[i].segDurationMsec);
-        WriteUint32(&buf[ofs + j * 16 + 12], static_cast<uint32_t>(segments[i].segTimeMsec / 10));
-        for (size_t k = 0; k < segments[i].fragDurationsMsec.size(); ++k) {
+    // Update the units of the newest segment at "index". If "added" is true, it has replaced the oldest one.
+    void SetNewest(const std::vector<SEGMENT_CONTEXT> &segments, size_t index, bool added, const std::vector<SEGMENT_CONTEXT> &parts) {
+        if (added) {
+            m_segIndex = index % (segments.size() - 1) + 1;
+            m_fragUnitsBegin += m_fragUnitNums.front() * 16;
+            m_fragUnitNums.pop_front();
+            if (m_fragUnitsBegin > m_fragUnits.size() / 2) {
+                m_fragUnits.erase(m_fragUnits.begin(), m_fragUnits.begin() + m_fragUnitsBegin);
+                m_fragUnitsBegin = 0;
+            }
+        }
+        else {
+            m_fragUnits.resize(m_fragUnits.size() - m_fragUnitNums.back() * 16);
+            m_fragUnitNums.pop_back();
+        }
+        AppendNewest(segments, index, parts);
+
+        if (!parts.empty()) {
+            // Parts of the recent segments may have been overwritten by those just published, which are at most as many
+            // as the fragments of the newest segment
+            size_t fragNum = 0;
+            size_t limit = parts.size() + m_fragUnitNums.back();
+            size_t pos = m_fragUnits.size();
+            for (auto it = m_fragUnitNums.rbegin(); it != m_fragUnitNums.rend() && fragNum < limit; ++it) {
+                if (*it != 0) {
+                    pos -= *it * 16;
+                    WriteFragUnits(&m_fragUnits[pos], segments[index], parts);
+                    fragNum += *it;
+                }
+                index = (index + segments.size() - 3) % (segments.size() - 1) + 1;
+            }
+        }
+    }
+    void Assign(std::vector<uint8_t> &buf, const char *signature, bool endList, bool incomplete, bool isMp4, bool withKeyIds,
+                const MP4_HEADER_MAP &mp4Headers, uint32_t mp4HeaderVersion) const {
+        size_t headerBytes = 0;
+        for (auto it = mp4Headers.begin(); it != mp4Headers.end(); ++it) {
+            headerBytes += 16 + it->second.size();
+        }
+        size_t ofs = signature ? 64 : 0;
+        buf.reserve(ofs + 16 + m_segUnits.size() + (m_fragUnits.size() - m_fragUnitsBegin) + (withKeyIds ? m_keyIds.size() : 0) + headerBytes);
+        buf.assign(ofs + 16, 0);
+        if (signature) {
+            for (size_t i = 0; i < 64 && signature[i]; ++i) {
+                buf[i] = signature[i];
+            }
+        }
+        WriteUint32(&buf[ofs], static_cast<uint32_t>(m_segUnits.size() / 16));
+        WriteUint32(&buf[ofs + 2], mp4HeaderVersion & 0xffff);
+        WriteUint32(&buf[ofs + 4], GetCurrentUnixTime());
+        buf[ofs + 8] = endList;
+        buf[ofs + 9] = incomplete;
+        buf[ofs + 10] = isMp4;
+        buf[ofs + 11] = PIPE_FORMAT_REVISION;
+        // Units are kept in the ring order, listed from the oldest
+        size_t oldestPos = (m_segIndex - 1) * 16;
+        buf.insert(buf.end(), m_segUnits.begin() + oldestPos, m_segUnits.end());
+        buf.insert(buf.end(), m_segUnits.begin(), m_segUnits.begin() + oldestPos);
+        buf.insert(buf.end(), m_fragUnits.begin() + m_fragUnitsBegin, m_fragUnits.end());
+        if (withKeyIds) {
+            // In the same order as the segment units
+            buf.insert(buf.end(), m_keyIds.begin() + oldestPos, m_keyIds.end());
+            buf.insert(buf.end(), m_keyIds.begin(), m_keyIds.begin() + oldestPos);
+        }
+        auto latestHeader = mp4Headers.find(mp4HeaderVersion);
+        if (latestHeader != mp4Headers.end()) {
+            buf.insert(buf.end(), latestHeader->second.begin(), latestHeader->second.end());
+        }
+        // Older header boxes still referenced by the listed segments, each preceded by a 16 bytes unit
+        for (auto it = mp4Headers.begin(); it != mp4Headers.end() && it->first != mp4HeaderVersion; ++it) {
             buf.insert(buf.end(), 16, 0);
-            WriteUint32(&buf[buf.size() - 16], segments[i].fragDurationsMsec[k]);
+            WriteUint32(&buf[buf.size() - 16], static_cast<uint32_t>(it->second.size()));
+            WriteUint32(&buf[buf.size() - 12], it->first & 0xffff);
+            buf.insert(buf.end(), it->second.begin(), it->second.end());
+        }
+        WriteUint32(&buf[ofs + 12], static_cast<uint32_t>(buf.size() - m_segUnits.size() - 16 - ofs));
+    }
+
+private:
+    void AppendNewest(const std::vector<SEGMENT_CONTEXT> &segments, size_t index, const std::vector<SEGMENT_CONTEXT> &parts) {
+        const SEGMENT_CONTEXT &seg = segments[index];
+        uint8_t *unit = &m_segUnits[(index - 1) * 16];
+        WriteUint32(unit, static_cast<uint32_t>(index));
+        WriteUint32(unit + 2, static_cast<uint32_t>(seg.fragDurationsMsec.size()));
+        WriteUint32(unit + 4, seg.segCount);
+        WriteUint32(unit + 8, seg.segDurationMsec);
+        WriteUint32(unit + 12, static_cast<uint32_t>(seg.segTimeMsec / 10));
+        std::copy(seg.keyId, seg.keyId + 16, &m_keyIds[(index - 1) * 16]);
+        m_fragUnits.resize(m_fragUnits.size() + seg.fragDurationsMsec.size() * 16);
+        if (!seg.fragDurationsMsec.empty()) {
+            WriteFragUnits(&m_fragUnits[m_fragUnits.size() - seg.fragDurationsMsec.size() * 16], seg, parts);
+        }
+        m_fragUnitNums.push_back(seg.fragDurationsMsec.size());
+    }
+    static void WriteFragUnits(uint8_t *dest, const SEGMENT_CONTEXT &seg, const std::vector<SEGMENT_CONTEXT> &parts) {
+        for (size_t k = 0; k < seg.fragDurationsMsec.size(); ++k, dest += 16) {
+            std::fill(dest, dest + 16, static_cast<uint8_t>(0));
+            WriteUint32(dest, seg.fragDurationsMsec[k]);
+            WriteUint32(dest + 4, seg.headerVersion & 0xffff);
+            if (seg.partSlot != 0) {
+                // Parts are published to the ring of part pipes in order, unless overwritten by newer ones
+                size_t slot = (seg.partSlot - 1 + k) % parts.size();
+                if (parts[slot].segCount == seg.segCount && parts[slot].partIndex == k) {
+                    WriteUint32(dest + 6, static_cast<uint32_t>(slot + 1));
+                }
+            }
         }
-        i = i % (segments.size() - 1) + 1;
     }
-    buf.insert(buf.end(), mp4Header.begin(), mp4Header.end());
-    WriteUint32(&buf[ofs + 12], static_cast<uint32_t>(buf.size() - segments.size() * 16 - ofs));
+
+    size_t m_segIndex;
+    // Segment units and key IDs in the ring order
+    std::vector<uint8_t> m_segUnits;
+    std::vector<uint8_t> m_keyIds;
+    // Fragment units from "m_fragUnitsBegin" in the listing order, and the number of them for each segment listed
+    std::vector<uint8_t> m_fragUnits;
+    size_t m_fragUnitsBegin;
+    std::deque<size_t> m_fragUnitNums;
+};
+
+size_t GetSegmentHeaderUnitNum(bool isMp4, size_t fragNum)
+{
+    // Fragment sizes are stored from the 32nd byte, continuing over additional 188 bytes units if needed
+    return isMp4 ? (32 + 4 * std::max<size_t>(std::min(fragNum, MP4_FRAG_MAX_NUM), 1) + 187) / 188 : 1;
 }
 
-void WriteSegmentHeader(std::vector<uint8_t> &buf, const char *signature, uint32_t segCount, bool isMp4, const std::vector<size_t> &fragSizes)
+void WriteSegmentHeader(std::vector<uint8_t> &buf, const char *signature, uint32_t segCount, bool isMp4, uint32_t headerVersion,
+                        bool incomplete, const std::vector<size_t> &fragSizes)
 {
+    // "buf" must begin with the space returned by GetSegmentHeaderUnitNum()
+    size_t unitNum = GetSegmentHeaderUnitNum(isMp4, fragSizes.size());
     size_t ofs = 0;
     if (signature) {
         // NULL TS header
@@ -410,10 +836,14 @@ void WriteSegmentHeader(std::vector<uint8_t> &buf, const char *signature, uint32
     buf[ofs + 2] = 0xff;
     buf[ofs + 3] = 0x10;
     WriteUint32(&buf[ofs + 4], segCount);
-    WriteUint32(&buf[ofs + 8], static_cast<uint32_t>((buf.size() - 188 - ofs) / (isMp4 ? 1 : 188)));
+    WriteUint32(&buf[ofs + 8], static_cast<uint32_t>((buf.size() - 188 * unitNum - ofs) / (isMp4 ? 1 : 188)));
     buf[ofs + 12] = isMp4;
+    buf[ofs + 13] = static_cast<uint8_t>(unitNum - 1);
+    buf[ofs + 14] = static_cast<uint8_t>(headerVersion);
+    buf[ofs + 15] = static_cast<uint8_t>(headerVersion >> 8);
+    buf[ofs + 16] = incomplete;
     if (isMp4) {
-        size_t remainSize = buf.size() - 188 - ofs;
+        size_t remainSize = buf.size() - 188 * unitNum - ofs;
         size_t i = 0;
         for (; i + 1 < std::min(fragSizes.size(), MP4_FRAG_MAX_NUM) && remainSize >= fragSizes[i]; ++i) {
             WriteUint32(&buf[ofs + i * 4 + 32], static_cast<uint32_t>(fragSizes[i]));
@@ -423,281 +853,466 @@ void WriteSegmentHeader(std::vector<uint8_t> &buf, const char *signature, uint32
     }
 }
 
-std::vector<uint8_t> &SelectWritableSegmentBuffer(SEGMENT_CONTEXT &seg)
+bool WriteMp4Fragments(FILE *fp, const uint8_t *fragments, size_t size, uint32_t &sequenceNumber)
 {
-    return !seg.backBuf.empty() || seg.pipes[0].connected || seg.pipes[1].connected ? seg.backBuf : seg.buf;
+    // Renumber the sequence_number of mfhd boxes while writing
+    size_t written = 0;
+    for (size_t i = 0; i + 8 <= size;) {
+        size_t boxSize = (fragments[i] << 24) | (fragments[i + 1] << 16) | (fragments[i + 2] << 8) | fragments[i + 3];
+        if (boxSize < 8 || i + boxSize > size) {
+            break;
+        }
+        static const char MOOF_MFHD[] = "moof____mfhd";
+        if (boxSize >= 24 && std::equal(MOOF_MFHD, MOOF_MFHD + 4, &fragments[i + 4]) &&
+            std::equal(MOOF_MFHD + 8, MOOF_MFHD + 12, &fragments[i + 12])) {
+            uint8_t seq[4];
+            ++sequenceNumber;
+            seq[0] = static_cast<uint8_t>(sequenceNumber >> 24);
+            seq[1] = static_cast<uint8_t>(sequenceNumber >> 16);
+            seq[2] = static_cast<uint8_t>(sequenceNumber >> 8);
+            seq[3] = static_cast<uint8_t>(sequenceNumber);
+            if (fwrite(fragments + written, 1, i + 20 - written, fp) != i + 20 - written ||
+                fwrite(seq, 1, 4, fp) != 4) {
+                return false;
+            }
+            written = i + 24;
+        }
+        i += boxSize;
+    }
+    return fwrite(fragments + written, 1, size - written, fp) == size - written;
 }
 
-void ProcessSegmentation(FILE *fp, bool enableFragmentation, uint32_t targetDurationMsec, uint32_t nextTargetDurationMsec,
-                         uint32_t targetFragDurationMsec, size_t segMaxBytes, size_t fragMaxBytes, unsigned int &syncError,
-                         const std::function<bool (int64_t)> &onRead,
-                         const std::function<bool (bool, bool, int64_t, const PMT &, std::vector<uint8_t> &)> &onSegmentOrFragment)
+bool WriteMp4FragmentsWithHeader(FILE *fp, const CMp4Fragmenter &mp4frag, bool &wroteHeader, uint32_t &headerVersion, uint32_t &sequenceNumber)
 {
-    // PID of the packet to determine segmentation (AVC_VIDEO or H_265_VIDEO or audio stream)
-    int keyPid = 0;
-    // AVC-NAL's parsing state
-    int nalState = 0;
-
-    struct UNIT_START_POSITION
-    {
-        size_t lastPos;
-        // The last unit-start immediately before "keyPid" unit-start
-        size_t beforeKeyStart;
-        // The last unit-start immediately before "keyPid" unit-start marked for fragmentation
-        size_t beforeMarkedKeyStart;
-    };
-    // Map of PID and unit-start position
-    std::unordered_map<int, UNIT_START_POSITION> unitStartMap;
-    // Packets accumulating for next segmentation
-    std::vector<uint8_t> packets;
-    std::vector<uint8_t> backPackets;
-    std::vector<uint8_t> workPackets;
-
-    size_t segBytes = 0;
-    int64_t pts = -1;
-    int64_t lastSegPts = -1;
-    int64_t lastFragPts = -1;
-    // PTS marking for fragmentation
-    int64_t markedFragPts = -1;
-    bool firstAudioPacketArrived = false;
-    bool isFirstKey = true;
-    PAT pat = {};
-    int countForOnRead = 0;
-    uint8_t buf[188];
-    size_t bufCount = 0;
-    size_t nRead;
-
-    while ((nRead = fread(buf + bufCount, 1, sizeof(buf) - bufCount, fp)) != 0) {
-        bufCount += nRead;
-        if (bufCount < sizeof(buf)) {
-            continue;
+    // Write the header first, and again before fragments depending on a new header version
+    const std::vector<uint32_t> &versions = mp4frag.GetFragmentHeaderVersions();
+    const std::vector<uint8_t> &header = mp4frag.GetHeader();
+    if (!wroteHeader && !header.empty()) {
+        wroteHeader = true;
+        headerVersion = versions.empty() ? mp4frag.GetHeaderVersion() : versions.front();
+        if (fwrite(header.data(), 1, header.size(), fp) != header.size()) {
+            return false;
         }
-        bufCount = 0;
-
-        if (onRead && ++countForOnRead == 16) {
-            countForOnRead = 0;
-            int64_t ptsDiff = (0x200000000 + pts - lastSegPts) & 0x1ffffffff;
-            if (ptsDiff >= 0x100000000) {
-                // PTS went back.
-                ptsDiff = 0;
-            }
-            if (onRead(ptsDiff)) {
-                break;
+    }
+    size_t written = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < versions.size(); ++i) {
+        if (versions[i] != headerVersion) {
+            // Only the latest header is available
+            headerVersion = versions[i];
+            if (!WriteMp4Fragments(fp, mp4frag.GetFragments().data() + written, pos - written, sequenceNumber) ||
+                fwrite(header.data(), 1, header.size(), fp) != header.size()) {
+                return false;
             }
+            written = pos;
         }
+        pos += mp4frag.GetFragmentSizes()[i];
+    }
+    return WriteMp4Fragments(fp, mp4frag.GetFragments().data() + written, mp4frag.GetFragments().size() - written, sequenceNumber);
+}
 
-        if (extract_ts_header_sync(buf) != 0x47) {
-            // Resynchronization is not implemented.
-            ++syncError;
-            continue;
-        }
+uint32_t ReadUint32(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | (static_cast<uint32_t>(buf[3]) << 24);
+}
 
-        {
-            const uint8_t *packet = buf;
-            int unitStart = extract_ts_header_unit_start(packet);
-            int pid = extract_ts_header_pid(packet);
-            int counter = extract_ts_header_counter(packet);
-            if (unitStart) {
-                UNIT_START_POSITION unitStartPos = {SIZE_MAX, SIZE_MAX, SIZE_MAX};
-                unitStartMap.emplace(pid, unitStartPos).first->second.lastPos = packets.size();
-            }
-            int payloadSize = get_ts_payload_size(packet);
-            const uint8_t *payload = packet + 188 - payloadSize;
-
-            bool isKey = false;
-            if (pid == 0) {
-                extract_pat(&pat, payload, payloadSize, unitStart, counter);
-            }
-            else if (pid == pat.first_pmt.pmt_pid) {
-                extract_pmt(&pat.first_pmt, payload, payloadSize, unitStart, counter);
-            }
-            else if (pid == pat.first_pmt.first_video_pid) {
-                if (unitStart) {
-                    keyPid = pid;
-                }
-            }
-            else if (pid == pat.first_pmt.first_adts_audio_pid) {
-                if (unitStart && pat.first_pmt.first_video_pid == 0) {
-                    keyPid = pid;
-                }
-                firstAudioPacketArrived = true;
-            }
-
-            if (keyPid != 0 && pid == keyPid &&
-                (pid == pat.first_pmt.first_adts_audio_pid ||
-                 (pid == pat.first_pmt.first_video_pid &&
-                  (pat.first_pmt.first_video_stream_type == AVC_VIDEO ||
-                   pat.first_pmt.first_video_stream_type == H_265_VIDEO)))) {
-                bool h265 = pat.first_pmt.first_video_stream_type == H_265_VIDEO;
-                if (unitStart) {
-                    bool markForFrag = false;
-                    int64_t ptsDiff = (0x200000000 + pts - lastFragPts) & 0x1ffffffff;
-                    // Defer fragmentation until the arrival of first audio packet.
-                    if ((pat.first_pmt.first_adts_audio_pid == 0 || firstAudioPacketArrived) &&
-                        markedFragPts < 0 && lastFragPts >= 0 &&
-                        (ptsDiff < 0x100000000 ? ptsDiff : 0) / 90 >= targetFragDurationMsec)
-                    {
-                        markForFrag = true;
-                        markedFragPts = pts;
-                    }
+void WriteUint64(uint8_t *buf, uint64_t n)
+{
+    WriteUint32(buf, static_cast<uint32_t>(n));
+    WriteUint32(buf + 4, static_cast<uint32_t>(n >> 32));
+}
 
-                    for (auto it = unitStartMap.begin(); it != unitStartMap.end(); ++it) {
-                        it->second.beforeKeyStart = it->second.lastPos;
-                        if (markForFrag) {
-                            it->second.beforeMarkedKeyStart = it->second.beforeKeyStart;
-                        }
-                    }
-                    if (payloadSize >= 9 && payload[0] == 0 && payload[1] == 0 && payload[2] == 1) {
-                        int ptsDtsFlags = payload[7] >> 6;
-                        int pesHeaderLength = payload[8];
-                        if (ptsDtsFlags >= 2 && payloadSize >= 14) {
-                            pts = get_pes_timestamp(payload + 9);
-                            if (lastSegPts < 0) {
-                                lastSegPts = pts;
-                                lastFragPts = pts;
-                            }
-                        }
-                        if (pid == pat.first_pmt.first_video_pid) {
-                            nalState = 0;
-                            if (9 + pesHeaderLength < payloadSize) {
-                                if (contains_nal_idr_or_cra(&nalState, payload + 9 + pesHeaderLength, payloadSize - (9 + pesHeaderLength), h265)) {
-                                    isKey = !isFirstKey;
-                                    isFirstKey = false;
-                                }
-                            }
-                        }
-                        else {
-                            // Always treat as key.
-                            isKey = !isFirstKey;
-                            isFirstKey = false;
-                        }
-                    }
-                }
-                else if (pid == pat.first_pmt.first_video_pid) {
-                    if (contains_nal_idr_or_cra(&nalState, payload, payloadSize, h265)) {
-                        isKey = !isFirstKey;
-                        isFirstKey = false;
-                    }
-                }
-            }
+uint64_t ReadUint64(const uint8_t *buf)
+{
+    return ReadUint32(buf) | (static_cast<uint64_t>(ReadUint32(buf + 4)) << 32);
+}
 
-            bool forceSegment = (segMaxBytes != 0 && packets.size() + segBytes + 188 > segMaxBytes) ||
-                                packets.size() + 188 > fragMaxBytes;
-            // Avoid making the last fragment too small.
-            int64_t markedPtsDiff = (0x200000000 + pts - markedFragPts) & 0x1ffffffff;
-            bool createFragment = enableFragmentation && markedFragPts >= 0 &&
-                                  (markedPtsDiff < 0x100000000 ? markedPtsDiff : 0) / 90 >= targetFragDurationMsec / 4;
-            if (isKey || forceSegment || createFragment) {
-                int64_t ptsDiff = (0x200000000 + pts - lastSegPts) & 0x1ffffffff;
-                if (ptsDiff >= 0x100000000) {
-                    // PTS went back, rare case.
-                    ptsDiff = 0;
-                }
-                bool isSegmentKey = isKey && ptsDiff >= targetDurationMsec * 90;
-                if (isSegmentKey || forceSegment || createFragment) {
-                    workPackets.clear();
-                    backPackets.clear();
-
-                    if (isKey || !forceSegment) {
-                        size_t keyUnitStartPos = isKey ? unitStartMap[keyPid].beforeKeyStart :
-                            unitStartMap[keyPid].beforeMarkedKeyStart;
-                        // Bring PAT and PMT to the front
-                        int bringState = 0;
-                        for (size_t i = 0; i < packets.size() && i < keyUnitStartPos && bringState < 2; i += 188) {
-                            int p = extract_ts_header_pid(&packets[i]);
-                            if (p == 0 || p == pat.first_pmt.pmt_pid) {
-                                bringState = p == 0 ? 1 : bringState == 1 ? 2 : bringState;
-                                workPackets.insert(workPackets.end(), packets.begin() + i, packets.begin() + i + 188);
-                            }
-                        }
-                        bringState = 0;
-                        for (size_t i = 0; i < packets.size(); i += 188) {
-                            if (i < keyUnitStartPos) {
-                                int p = extract_ts_header_pid(&packets[i]);
-                                if ((p == 0 || p == pat.first_pmt.pmt_pid) && bringState < 2) {
-                                    bringState = p == 0 ? 1 : bringState == 1 ? 2 : bringState;
-                                    // Already inserted
-                                }
-                                else {
-                                    auto it = unitStartMap.find(p);
-                                    if (it == unitStartMap.end() ||
-                                        i < std::min(it->second.lastPos, isKey ? it->second.beforeKeyStart : it->second.beforeMarkedKeyStart)) {
-                                        workPackets.insert(workPackets.end(), packets.begin() + i, packets.begin() + i + 188);
-                                    }
-                                    else {
-                                        backPackets.insert(backPackets.end(), packets.begin() + i, packets.begin() + i + 188);
-                                    }
-                                }
-                            }
-                            else {
-                                backPackets.insert(backPackets.end(), packets.begin() + i, packets.begin() + i + 188);
-                            }
-                        }
-                    }
-                    else {
-                        // Packets have been accumulated over the limit, simply segment everything.
-                        workPackets.assign(packets.begin(), packets.end());
-                    }
-                    packets.swap(backPackets);
+// Record of the segment index file, appended every time a segment is completed
+struct SEGMENT_INDEX_RECORD
+{
+    uint32_t segCount;
+    int segDurationMsec;
+    int64_t segTimeMsec;
+    // Input file offset where the next segment begins (-1 if the input is not a file)
+    int64_t inputPos;
+    // Input file offset and PTS of the key unit-start where the segment was cut (pts is -1 if the cut was forced)
+    int64_t keyInputPos;
+    int64_t pts;
+    // Fragmenter state at the end of the segment
+    uint32_t fragCount;
+    int64_t decodeTimeEnd;
+    // Remainder of the durations in 90kHz units not yet added to the playback position
+    int durationMsecResidual;
+};
 
-                    if (!isSegmentKey && !forceSegment) {
-                        // fragment
-                        lastFragPts = markedFragPts;
-                        segBytes += workPackets.size();
-                    }
-                    else {
-                        // segment
-                        lastFragPts = pts;
-                        lastSegPts = pts;
-                        targetDurationMsec = nextTargetDurationMsec;
-                        segBytes = 0;
-                    }
-                    markedFragPts = -1;
+const char SEGMENT_INDEX_SIGNATURE[] = "tsmsidx2";
+constexpr size_t SEGMENT_INDEX_RECORD_SIZE = 56;
 
-                    if (onSegmentOrFragment(isSegmentKey, forceSegment, ptsDiff, pat.first_pmt, workPackets)) {
-                        return;
-                    }
-                    unitStartMap.clear();
-                }
-            }
-            packets.insert(packets.end(), packet, packet + 188);
+FILE *OpenSegmentIndex(const char *path, SEGMENT_INDEX_RECORD &lastRecord, bool &hasLastRecord)
+{
+    std::vector<uint8_t> buf;
+    FILE *fp = fopen(path, "rb");
+    if (fp) {
+        uint8_t readBuf[4096];
+        size_t n;
+        while ((n = fread(readBuf, 1, sizeof(readBuf), fp)) != 0) {
+            buf.insert(buf.end(), readBuf, readBuf + n);
         }
+        fclose(fp);
     }
-}
+
+    size_t validSize = 0;
+    hasLastRecord = false;
+    if (buf.size() >= 8 && std::equal(SEGMENT_INDEX_SIGNATURE, SEGMENT_INDEX_SIGNATURE + 8, buf.begin())) {
+        validSize = 8 + (buf.size() - 8) / SEGMENT_INDEX_RECORD_SIZE * SEGMENT_INDEX_RECORD_SIZE;
+        if (validSize > 8) {
+            const uint8_t *rec = &buf[validSize - SEGMENT_INDEX_RECORD_SIZE];
+            lastRecord.segCount = ReadUint32(rec);
+            lastRecord.segDurationMsec = static_cast<int>(ReadUint32(rec + 4));
+            lastRecord.segTimeMsec = static_cast<int64_t>(ReadUint64(rec + 8));
+            lastRecord.inputPos = static_cast<int64_t>(ReadUint64(rec + 16));
+            lastRecord.keyInputPos = static_cast<int64_t>(ReadUint64(rec + 24));
+            lastRecord.pts = static_cast<int64_t>(ReadUint64(rec + 32));
+            lastRecord.fragCount = ReadUint32(rec + 40);
+            lastRecord.decodeTimeEnd = static_cast<int64_t>(ReadUint64(rec + 44));
+            lastRecord.durationMsecResidual = static_cast<int>(ReadUint32(rec + 52));
+            hasLastRecord = true;
+        }
+    }
+    else if (!buf.empty()) {
+        fprintf(stderr, "Warning: index file is broken. Recreating.\n");
+    }
+
+    if (validSize != 0 && validSize == buf.size()) {
+        return fopen(path, "ab");
+    }
+    // Drop the trailing partial record left by an interrupted write
+    fp = fopen(path, "wb");
+    if (fp) {
+        if (validSize == 0) {
+            buf.assign(SEGMENT_INDEX_SIGNATURE, SEGMENT_INDEX_SIGNATURE + 8);
+            validSize = 8;
+        }
+        if (fwrite(buf.data(), 1, validSize, fp) != validSize || fflush(fp) != 0) {
+            fclose(fp);
+            fp = nullptr;
+        }
+    }
+    return fp;
 }
 
-int main(int argc, char **argv)
+bool AppendSegmentIndex(FILE *fp, const SEGMENT_INDEX_RECORD &record)
 {
-    bool isMp4 = false;
-    uint32_t targetDurationMsec = 1000;
-    uint32_t nextTargetDurationMsec = 2000;
-    uint32_t targetFragDurationMsec = 500;
-    uint32_t accessTimeoutMsec = 10000;
-    const char *closingCmd = "";
-    int readRatePerMille = -1;
-    int nextReadRatePerMille = 0;
-    size_t segNum = 8;
-    size_t segMaxBytes = 4096 * 1024;
-#ifndef _WIN32
-    const char *fifoDir = "";
-#endif
-    const char *destName = "";
-    CMp4Fragmenter mp4frag;
+    uint8_t rec[SEGMENT_INDEX_RECORD_SIZE] = {};
+    WriteUint32(rec, record.segCount);
+    WriteUint32(rec + 4, static_cast<uint32_t>(record.segDurationMsec));
+    WriteUint64(rec + 8, static_cast<uint64_t>(record.segTimeMsec));
+    WriteUint64(rec + 16, static_cast<uint64_t>(record.inputPos));
+    WriteUint64(rec + 24, static_cast<uint64_t>(record.keyInputPos));
+    WriteUint64(rec + 32, static_cast<uint64_t>(record.pts));
+    WriteUint32(rec + 40, record.fragCount);
+    WriteUint64(rec + 44, static_cast<uint64_t>(record.decodeTimeEnd));
+    WriteUint32(rec + 52, static_cast<uint32_t>(record.durationMsecResidual));
+    // Flush every record so that a killed process leaves at most one partial record
+    return fwrite(rec, 1, sizeof(rec), fp) == sizeof(rec) && fflush(fp) == 0;
+}
 
-    for (int i = 1; i < argc; ++i) {
-        char c = '\0';
-        if (argv[i][0] == '-' && argv[i][1] && !argv[i][2]) {
-            c = argv[i][1];
+// Check that the input has the key unit-start recorded in "record", and prepare "prefixPackets" to be read before the
+// key: PSI, followed by the packets between the recorded offsets that belong to the next segment (PES packets of the
+// streams other than the key stream that started before the key)
+bool PrepareResumeFromIndex(const uint8_t *data, size_t size, const SEGMENT_INDEX_RECORD &record, std::vector<uint8_t> &prefixPackets)
+{
+    PMT pmt;
+    if (record.inputPos < 0 || record.keyInputPos < record.inputPos || static_cast<uint64_t>(record.keyInputPos) + 188 > size ||
+        !ScanFirstPmt(data, size / 188 * 188, prefixPackets, pmt)) {
+        prefixPackets.clear();
+        return false;
+    }
+    int keyPid = pmt.first_video_pid != 0 ? pmt.first_video_pid : pmt.first_audio_pid;
+    const uint8_t *packet = data + record.keyInputPos;
+    bool matched = extract_ts_header_sync(packet) == 0x47;
+    if (matched && record.pts >= 0) {
+        int payloadSize = get_ts_payload_size(packet);
+        const uint8_t *payload = packet + 188 - payloadSize;
+        matched = extract_ts_header_unit_start(packet) && extract_ts_header_pid(packet) == keyPid &&
+                  payloadSize >= 14 && payload[0] == 0 && payload[1] == 0 && payload[2] == 1 && (payload[7] >> 6) >= 2 &&
+                  get_pes_timestamp(payload + 9) == record.pts;
+    }
+    if (!matched) {
+        prefixPackets.clear();
+        return false;
+    }
+    // Like the segmenter, the packets from the last unit-start before the key are moved to the next segment
+    std::map<int, size_t> lastUnitStartMap;
+    size_t beginPos = static_cast<size_t>(record.inputPos);
+    size_t endPos = static_cast<size_t>(record.keyInputPos);
+    for (size_t pos = beginPos; pos < endPos; pos += 188) {
+        packet = data + pos;
+        if (extract_ts_header_sync(packet) == 0x47 && extract_ts_header_unit_start(packet)) {
+            lastUnitStartMap[extract_ts_header_pid(packet)] = pos;
         }
-        if (c == 'h') {
-            fprintf(stderr, "Usage: tsmemseg [-4][-i inittime][-t time][-p ptime][-a acc_timeout][-c cmd][-r readrate][-f fill_readrate][-s seg_num][-m max_kbytes][-g dir] seg_name\n");
-            return 2;
+    }
+    for (size_t pos = beginPos; pos < endPos; pos += 188) {
+        packet = data + pos;
+        int pid = extract_ts_header_pid(packet);
+        auto it = lastUnitStartMap.find(pid);
+        if (extract_ts_header_sync(packet) == 0x47 && pid != 0 && pid != pmt.pmt_pid && pid != keyPid &&
+            it != lastUnitStartMap.end() && pos >= it->second) {
+            prefixPackets.insert(prefixPackets.end(), packet, packet + 188);
         }
-        bool invalid = false;
-        if (i < argc - 1) {
-            if (c == '4') {
+    }
+    return true;
+}
+
+void AssignStats(std::vector<uint8_t> &buf, const char *signature, const CRuntimeStats &stats, int64_t uptimeMsec)
+{
+    buf.assign(16 + CRuntimeStats::COUNTER_NUM * 8 + (signature ? 64 : 0), 0);
+    size_t ofs = 0;
+    if (signature) {
+        for (size_t i = 0; i < 64 && signature[i]; ++i) {
+            buf[i] = signature[i];
+        }
+        ofs = 64;
+    }
+    WriteUint32(&buf[ofs], CRuntimeStats::COUNTER_NUM);
+    WriteUint32(&buf[ofs + 4], GetCurrentUnixTime());
+    WriteUint64(&buf[ofs + 8], static_cast<uint64_t>(uptimeMsec));
+    for (int i = 0; i < CRuntimeStats::COUNTER_NUM; ++i) {
+        WriteUint64(&buf[ofs + 16 + i * 8], stats.Get(i));
+    }
+}
+
+struct FRAGMENTATION_JOB
+{
+    struct PIECE
+    {
+        std::vector<uint8_t> packets;
+        PMT pmt;
+        bool maybeNotEndAtUnitStart;
+        bool fragmentContinues;
+    };
+    // Packets between key packets
+    std::vector<PIECE> pieces;
+    CMp4Fragmenter mp4frag;
+    // 0: queued, 1: running, 2: done
+    int state;
+};
+
+// Packets before a cut, kept unconverted while no pipe is accessed
+struct HELD_PIECE
+{
+    bool isKey;
+    bool forceSegment;
+    bool isChunk;
+    int64_t ptsDiff;
+    PMT pmt;
+    std::vector<uint8_t> packets;
+    CUT_POSITION cutPos;
+};
+
+struct FRAGMENTATION_QUEUE
+{
+    std::deque<std::unique_ptr<FRAGMENTATION_JOB>> jobs;
+    std::mutex lock;
+    std::condition_variable cond;
+    bool closing;
+};
+
+void FragmentationWorker(FRAGMENTATION_QUEUE &queue)
+{
+    std::unique_lock<std::mutex> lock(queue.lock);
+    for (;;) {
+        auto it = std::find_if(queue.jobs.begin(), queue.jobs.end(),
+                               [](const std::unique_ptr<FRAGMENTATION_JOB> &a) { return a->state == 0; });
+        if (it == queue.jobs.end()) {
+            if (queue.closing) {
+                break;
+            }
+            queue.cond.wait(lock);
+            continue;
+        }
+        FRAGMENTATION_JOB &job = **it;
+        job.state = 1;
+        lock.unlock();
+        for (auto jt = job.pieces.begin(); jt != job.pieces.end(); ++jt) {
+            job.mp4frag.AddPackets(jt->packets, jt->pmt, jt->maybeNotEndAtUnitStart, jt->fragmentContinues);
+        }
+        std::vector<FRAGMENTATION_JOB::PIECE>().swap(job.pieces);
+        lock.lock();
+        job.state = 2;
+        queue.cond.notify_all();
+    }
+}
+
+std::vector<uint8_t> &SelectWritableSegmentBuffer(SEGMENT_CONTEXT &seg)
+{
+    if (!seg.backBuf.empty() || seg.pipes[0].connected || seg.pipes[1].connected) {
+        return seg.backBuf;
+    }
+    seg.spillSize = 0;
+    return seg.buf;
+}
+
+void StatsRunner(SEGMENT_CONTEXT &statsSeg, const char *signature, CManualResetEvent &stopEvent, std::recursive_mutex &bufLock,
+                 const CRuntimeStats &stats, int64_t baseTick)
+{
+    do {
+        lock_recursive_mutex lock(bufLock);
+        AssignStats(SelectWritableSegmentBuffer(statsSeg), signature, stats, GetMsecTick() - baseTick);
+    }
+    while (!stopEvent.WaitOne(std::chrono::milliseconds(1000)));
+}
+
+bool WriteMetricsFile(const char *path, const char *segName, const CRuntimeStats &stats, const METRICS_HISTOGRAMS &hists, int64_t uptimeMsec)
+{
+    static const struct
+    {
+        int index;
+        const char *name;
+        const char *help;
+    } COUNTERS[] = {
+        {CRuntimeStats::INPUT_BYTES, "tsmemseg_input_bytes", "Bytes read from the input."},
+        {CRuntimeStats::INPUT_PACKETS, "tsmemseg_input_packets", "TS packets read from the input."},
+        {CRuntimeStats::SYNC_ERRORS, "tsmemseg_sync_errors", "TS packets without sync byte."},
+        {CRuntimeStats::CC_ERRORS, "tsmemseg_cc_errors", "Continuity counter errors."},
+        {CRuntimeStats::FORCED_SEGMENTATIONS, "tsmemseg_forced_segmentations", "Cuts on a non-key packet."},
+        {CRuntimeStats::FRAGMENTER_WARNINGS, "tsmemseg_fragmenter_warnings", "Warnings of MP4 conversion."},
+        {CRuntimeStats::SEGMENTS, "tsmemseg_segments", "Segments completed."},
+        {CRuntimeStats::FRAGMENTS, "tsmemseg_fragments", "Fragments published."},
+        {CRuntimeStats::READER_CONNECTS, "tsmemseg_reader_connects", "Connections from readers."},
+        {CRuntimeStats::BYTES_SERVED, "tsmemseg_served_bytes", "Bytes written to readers."},
+        {CRuntimeStats::PIPE_FULL_STALLS, "tsmemseg_pipe_full_stalls", "Writes blocked by a full pipe."},
+    };
+
+    std::vector<char> tmpPath(path, path + strlen(path));
+    static const char TMP_SUFFIX[] = ".tmp";
+    tmpPath.insert(tmpPath.end(), TMP_SUFFIX, TMP_SUFFIX + sizeof(TMP_SUFFIX));
+    FILE *fp = fopen(tmpPath.data(), "wb");
+    if (!fp) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(COUNTERS) / sizeof(COUNTERS[0]); ++i) {
+        fprintf(fp, "# TYPE %s counter\n# HELP %s %s\n%s_total{seg_name=\"%s\"} %llu\n", COUNTERS[i].name, COUNTERS[i].name, COUNTERS[i].help,
+                COUNTERS[i].name, segName, static_cast<unsigned long long>(stats.Get(COUNTERS[i].index)));
+    }
+    fprintf(fp, "# TYPE tsmemseg_uptime_seconds gauge\n# UNIT tsmemseg_uptime_seconds seconds\n"
+                "# HELP tsmemseg_uptime_seconds Elapsed time since the start.\ntsmemseg_uptime_seconds{seg_name=\"%s\"} %.3f\n",
+            segName, uptimeMsec / 1000.0);
+    hists.segmentDuration.Write(fp, "tsmemseg_segment_duration_seconds", "seconds", "Durations of completed segments.", segName);
+    hists.fragmentSize.Write(fp, "tsmemseg_fragment_size_bytes", "bytes", "Sizes of published fragments (segments for MPEG-TS).", segName);
+    hists.publishLatency.Write(fp, "tsmemseg_publish_latency_seconds", "seconds", "Time from reading the packet that triggered the cut to updating the listing.", segName);
+    hists.throttleSleep.Write(fp, "tsmemseg_read_throttle_seconds", "seconds", "Sleep time for limiting the read rate.", segName);
+    hists.readers.Write(fp, "tsmemseg_readers", "", "Connected readers sampled every second.", segName);
+    fprintf(fp, "# EOF\n");
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    // Replace atomically
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmpPath.data(), path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmpPath.data(), path) == 0;
+#endif
+    return ok;
+}
+
+void MetricsRunner(const char *metricsPath, const char *segName, const std::vector<SEGMENT_CONTEXT> &segments, CManualResetEvent &stopEvent,
+                   std::recursive_mutex &bufLock, const CRuntimeStats &stats, METRICS_HISTOGRAMS &hists, int64_t baseTick)
+{
+    bool warned = false;
+    for (int count = 1;; ++count) {
+        bool stopped = stopEvent.WaitOne(std::chrono::milliseconds(1000));
+        if (!stopped) {
+            int readers = 0;
+            {
+                lock_recursive_mutex lock(bufLock);
+                for (auto it = segments.begin(); it != segments.end(); ++it) {
+                    readers += it->pipes[0].connected + it->pipes[1].connected;
+                }
+            }
+            hists.readers.Observe(readers);
+        }
+        // Write every 5 seconds and at the end
+        if ((stopped || count % 5 == 0) &&
+            !WriteMetricsFile(metricsPath, segName, stats, hists, GetMsecTick() - baseTick) && !warned) {
+            fprintf(stderr, "Warning: failed to write metrics file.\n");
+            warned = true;
+        }
+        if (stopped) {
+            break;
+        }
+    }
+}
+
+void SpillAgedSegments(std::vector<SEGMENT_CONTEXT> &segments, uint8_t *spillStore, size_t slotBytes, uint32_t segCount, size_t memSegNum)
+{
+    // Move segments older than the most recent "memSegNum" to the slot of the same index.
+    // Segments being read are left as they are and retried next time.
+    for (size_t i = 1; i < segments.size(); ++i) {
+        SEGMENT_CONTEXT &seg = segments[i];
+        if (seg.segCount != SEGMENT_COUNT_EMPTY && seg.spillSize == 0 &&
+            ((segCount - seg.segCount) & 0xffffff) >= memSegNum &&
+            seg.backBuf.empty() && !seg.pipes[0].connected && !seg.pipes[1].connected &&
+            seg.buf.size() <= slotBytes) {
+            uint8_t *slot = spillStore + (i - 1) * slotBytes;
+            std::copy(seg.buf.begin(), seg.buf.end(), slot);
+            seg.spillData = slot;
+            seg.spillSize = seg.buf.size();
+            std::vector<uint8_t>().swap(seg.buf);
+        }
+    }
+}
+}
+
+int main(int argc, char **argv)
+{
+    bool isMp4 = false;
+    uint32_t targetDurationMsec = 1000;
+    uint32_t nextTargetDurationMsec = 2000;
+    uint32_t targetFragDurationMsec = 500;
+    uint32_t chunkFrames = 0;
+    uint32_t accessTimeoutMsec = 10000;
+    const char *closingCmd = "";
+    int readRatePerMille = -1;
+    int nextReadRatePerMille = 0;
+    size_t segNum = 8;
+    size_t segMaxBytes = 4096 * 1024;
+    const char *inputPath = "";
+    int64_t startOffsetMsec = 0;
+    size_t fragThreadNum = 1;
+    const char *indexPath = "";
+    const char *spillPath = "";
+    bool statsEnabled = false;
+    size_t partNum = 0;
+    bool dualOutput = false;
+    uint32_t lazyTimeoutMsec = 0;
+    bool filterPids = false;
+    const char *keyPath = "";
+    const char *metricsPath = "";
+    size_t memSegNum = 4;
+#ifndef _WIN32
+    const char *fifoDir = "";
+    bool progressive = false;
+#endif
+    const char *destName = "";
+    CMp4Fragmenter mp4frag;
+
+    for (int i = 1; i < argc; ++i) {
+        char c = '\0';
+        if (argv[i][0] == '-' && argv[i][1] && !argv[i][2]) {
+            c = argv[i][1];
+        }
+        if (c == 'h') {
+            fprintf(stderr, "Usage: tsmemseg [-4][-n][-i inittime][-t time][-p ptime][-u chunk_frames][-a acc_timeout][-c cmd][-r readrate][-f fill_readrate][-s seg_num][-m max_kbytes][-g dir][-I input][-O offset][-j threads][-x index_file][-b spill_file][-k mem_seg_num][-w][-q part_num][-d][-l lazy_timeout][-F][-K key_file][-e][-o metrics_file] seg_name\n");
+            return 2;
+        }
+        bool invalid = false;
+        if (i < argc - 1) {
+            if (c == '4') {
                 isMp4 = true;
             }
+            else if (c == 'n') {
+                mp4frag.SetInbandParameterSets(true);
+            }
             else if (c == 'i' || c == 't' || c == 'p') {
                 double sec = strtod(argv[++i], nullptr);
                 invalid = !(0 <= sec && sec <= 60);
@@ -706,6 +1321,10 @@ int main(int argc, char **argv)
                     msec = static_cast<uint32_t>(sec * 1000);
                 }
             }
+            else if (c == 'u') {
+                chunkFrames = static_cast<uint32_t>(strtol(argv[++i], nullptr, 10));
+                invalid = chunkFrames > 60;
+            }
             else if (c == 'a') {
                 double sec = strtod(argv[++i], nullptr);
                 invalid = !(0 <= sec && sec <= 600);
@@ -739,6 +1358,61 @@ int main(int argc, char **argv)
                 fifoDir = argv[i];
 #endif
             }
+            else if (c == 'j') {
+                fragThreadNum = static_cast<size_t>(strtol(argv[++i], nullptr, 10));
+                invalid = fragThreadNum < 1 || 256 < fragThreadNum;
+            }
+            else if (c == 'e') {
+                statsEnabled = true;
+            }
+            else if (c == 'd') {
+                dualOutput = true;
+            }
+            else if (c == 'F') {
+                filterPids = true;
+            }
+            else if (c == 'K') {
+                keyPath = argv[++i];
+            }
+            else if (c == 'l') {
+                double sec = strtod(argv[++i], nullptr);
+                invalid = !(0 <= sec && sec <= 600);
+                if (!invalid) {
+                    lazyTimeoutMsec = static_cast<uint32_t>(sec * 1000);
+                }
+            }
+            else if (c == 'q') {
+                partNum = static_cast<size_t>(strtol(argv[++i], nullptr, 10));
+                invalid = partNum > 99;
+            }
+            else if (c == 'w') {
+#ifndef _WIN32
+                progressive = true;
+#endif
+            }
+            else if (c == 'o') {
+                metricsPath = argv[++i];
+            }
+            else if (c == 'b') {
+                spillPath = argv[++i];
+            }
+            else if (c == 'k') {
+                memSegNum = static_cast<size_t>(strtol(argv[++i], nullptr, 10));
+                invalid = memSegNum < 1 || SEGMENTS_MAX <= memSegNum;
+            }
+            else if (c == 'x') {
+                indexPath = argv[++i];
+            }
+            else if (c == 'I') {
+                inputPath = argv[++i];
+            }
+            else if (c == 'O') {
+                double sec = strtod(argv[++i], nullptr);
+                invalid = !(0 <= sec && sec <= 86400 * 7);
+                if (!invalid) {
+                    startOffsetMsec = static_cast<int64_t>(sec * 1000);
+                }
+            }
         }
         else {
             destName = argv[i];
@@ -762,22 +1436,148 @@ int main(int argc, char **argv)
         fprintf(stderr, "Error: not enough arguments.\n");
         return 1;
     }
+    if (lazyTimeoutMsec != 0 && !isMp4) {
+        // MPEG-TS segments have no conversion to suspend
+        fprintf(stderr, "Error: -l requires -4.\n");
+        return 1;
+    }
     if (readRatePerMille < 0) {
         readRatePerMille = nextReadRatePerMille * 3 / 2;
     }
 
-#if 0
-    // for testing
-    FILE *fp = fopen("test.m2t", "rb");
-#else
+    // Segment index to resume from (pipe mode only)
+    std::unique_ptr<FILE, decltype(&fclose)> indexFile(nullptr, fclose);
+    SEGMENT_INDEX_RECORD lastIndexRecord = {};
+    bool hasLastIndexRecord = false;
+    if (indexPath[0] && destName[0] != '-') {
+        indexFile.reset(OpenSegmentIndex(indexPath, lastIndexRecord, hasLastIndexRecord));
+        if (!indexFile) {
+            fprintf(stderr, "Error: cannot open index file.\n");
+            return 1;
+        }
+    }
+
+    // Key to encrypt segments (pipe mode only)
+    bool encrypted = keyPath[0] && destName[0] != '-';
+    ENCRYPTION_KEY encryptionKey = {};
+    CAes128 segmentAes;
+    bool keyFileWarned = false;
+    if (encrypted) {
+        if (!ReadKeyFile(keyPath, encryptionKey)) {
+            fprintf(stderr, "Error: cannot read key file.\n");
+            return 1;
+        }
+        segmentAes.SetKey(encryptionKey.key);
+        if (isMp4) {
+            mp4frag.SetEncryptionKey(encryptionKey.keyId, encryptionKey.key, encryptionKey.iv);
+        }
+    }
+
     FILE *fp = stdin;
+    CMappedFile inputFile;
+    // PSI packets to be read before the mapped stream when seeking
+    std::vector<uint8_t> inputPrefix;
+    size_t inputPrefixPos = 0;
+    size_t inputPos = 0;
+    // File offset where reading starts
+    size_t inputStartPos = 0;
+    if (inputPath[0]) {
+        if (!inputFile.Open(inputPath)) {
+            fprintf(stderr, "Error: cannot open input file.\n");
+            return 1;
+        }
+        if (startOffsetMsec > 0) {
+            std::vector<KEY_FRAME_INDEX> index;
+            if (ScanKeyFrames(inputFile.Data(), inputFile.Size(), std::max(std::thread::hardware_concurrency(), 1U), index, inputPrefix) &&
+                !index.empty()) {
+                // Seek to the last key at or before the offset, summing up the PTS differences between adjacent keys
+                auto it = index.begin();
+                int64_t elapsedPts = 0;
+                for (auto jt = it + 1; jt != index.end(); ++jt) {
+                    int64_t ptsDiff = (0x200000000 + jt->pts - (jt - 1)->pts) & 0x1ffffffff;
+                    // Ignore the difference if PTS went back
+                    elapsedPts += ptsDiff < 0x100000000 ? ptsDiff : 0;
+                    if (elapsedPts / 90 > startOffsetMsec) {
+                        break;
+                    }
+                    it = jt;
+                }
+                inputPos = it->pos;
+            }
+            else {
+                fprintf(stderr, "Warning: no key packet found. Reading from the beginning.\n");
+                inputPrefix.clear();
+            }
+        }
+        else if (hasLastIndexRecord && lastIndexRecord.inputPos > 0) {
+            // Continue from the key packet where the previous process completed the last segment
+            if (PrepareResumeFromIndex(inputFile.Data(), inputFile.Size(), lastIndexRecord, inputPrefix)) {
+                inputPos = static_cast<size_t>(lastIndexRecord.keyInputPos);
+            }
+            else {
+                fprintf(stderr, "Warning: index file does not match the input. Reading from the beginning.\n");
+            }
+        }
+        inputStartPos = inputPos;
+    }
 #ifdef _WIN32
-    if (_setmode(_fileno(fp), _O_BINARY) < 0) {
+    else if (_setmode(_fileno(fp), _O_BINARY) < 0) {
         fprintf(stderr, "Error: _setmode.\n");
         return 1;
     }
 #endif
+#ifdef TSMEMSEG_TRACE
+    {
+#ifdef _WIN32
+        std::string tracePath = "tsmemseg_";
+#else
+        // Next to the FIFOs
+        size_t dirLen = strlen(fifoDir);
+        std::string tracePath = dirLen ? fifoDir : "/tmp/";
+        tracePath += dirLen && fifoDir[dirLen - 1] != '/' ? "/tsmemseg_" : "tsmemseg_";
 #endif
+        tracePath += destName[0] == '-' ? "stdout" : destName;
+        tracePath += "-trace.json";
+#ifndef _WIN32
+        // Dump the trace on SIGUSR1
+        struct sigaction sigact = {};
+        sigact.sa_handler = TraceSignalHandler;
+        sigaction(SIGUSR1, &sigact, nullptr);
+#endif
+        TRACE_INIT(tracePath.c_str());
+        TRACE_THREAD_NAME("main");
+    }
+#endif
+    // When the last packets were read, from which the latency of a cut triggered by them is measured (only if reported)
+    bool measuresLatency = destName[0] != '-' && (statsEnabled || metricsPath[0]);
+    int64_t readTick = 0;
+    auto readInput = [&](uint8_t *buf, size_t len) -> size_t {
+        if (!inputFile.Data()) {
+            // Record only blocking reads
+            TRACE_SCOPE_MIN("read", 1000);
+            // Packet by packet, not to wait for more packets from a live input
+            size_t n = fread(buf, 1, std::min<size_t>(len, 188), fp);
+            if (measuresLatency) {
+                readTick = GetUsecTick();
+            }
+            return n;
+        }
+        if (measuresLatency) {
+            readTick = GetUsecTick();
+        }
+        size_t n;
+        if (inputPrefixPos < inputPrefix.size()) {
+            n = std::min(len, inputPrefix.size() - inputPrefixPos);
+            std::copy(inputPrefix.begin() + inputPrefixPos, inputPrefix.begin() + inputPrefixPos + n, buf);
+            inputPrefixPos += n;
+        }
+        else {
+            n = std::min(len, inputFile.Size() - inputPos);
+            std::copy(inputFile.Data() + inputPos, inputFile.Data() + inputPos + n, buf);
+            inputPos += n;
+        }
+        return n;
+    };
 
     if (destName[0] == '-') {
         FILE *wfp = stdout;
@@ -789,25 +1589,95 @@ int main(int argc, char **argv)
 #endif
         unsigned int syncError = 0;
         unsigned int forcedSegmentationError = 0;
+        CUT_POSITION cutPos;
         bool wroteHeader = false;
+        uint32_t wroteHeaderVersion = 0;
+        uint32_t fragSequence = 0;
+
+        // Ranges between key packets are fragmented in parallel if specified
+        FRAGMENTATION_QUEUE fragQueue;
+        fragQueue.closing = false;
+        std::unique_ptr<FRAGMENTATION_JOB> fragJob;
+        std::vector<std::thread> fragThreads;
+        bool atKeyPacket = false;
+        while (isMp4 && fragThreads.size() < fragThreadNum && fragThreadNum > 1) {
+            fragThreads.emplace_back(FragmentationWorker, std::ref(fragQueue));
+        }
+
+        // Write done jobs in order, waiting until the number of queued jobs is not more than "maxQueued"
+        auto writeDoneJobs = [&](size_t maxQueued) -> bool {
+            std::unique_lock<std::mutex> lock(fragQueue.lock);
+            for (;;) {
+                if (!fragQueue.jobs.empty() && fragQueue.jobs.front()->state == 2) {
+                    std::unique_ptr<FRAGMENTATION_JOB> job = std::move(fragQueue.jobs.front());
+                    fragQueue.jobs.pop_front();
+                    lock.unlock();
+                    if (!WriteMp4FragmentsWithHeader(wfp, job->mp4frag, wroteHeader, wroteHeaderVersion, fragSequence)) {
+                        return false;
+                    }
+                    fflush(wfp);
+                    job->mp4frag.ClearFragments();
+                    // Subsequent jobs start from the latest timeline
+                    mp4frag = job->mp4frag;
+                    lock.lock();
+                }
+                else if (fragQueue.jobs.size() > maxQueued) {
+                    fragQueue.cond.wait(lock);
+                }
+                else {
+                    break;
+                }
+            }
+            return true;
+        };
+        auto queueJob = [&]() {
+            if (fragJob) {
+                std::lock_guard<std::mutex> lock(fragQueue.lock);
+                fragQueue.jobs.push_back(std::move(fragJob));
+                fragQueue.cond.notify_all();
+            }
+        };
 
-        ProcessSegmentation(fp, isMp4, targetDurationMsec, nextTargetDurationMsec, targetFragDurationMsec, 0, segMaxBytes, syncError, nullptr,
-            [&, wfp, isMp4](bool isKey, bool forceSegment, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets) -> bool
+        ProcessSegmentation(readInput, isMp4, filterPids, targetDurationMsec, nextTargetDurationMsec, targetFragDurationMsec, chunkFrames, 0, segMaxBytes, syncError, cutPos, nullptr, nullptr,
+            [&, wfp, isMp4](bool isKey, bool forceSegment, bool isChunk, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets) -> bool
         {
             static_cast<void>(ptsDiff);
+            TRACE_SCOPE("output");
 
             if (!isKey && forceSegment) {
                 ++forcedSegmentationError;
             }
             if (isMp4) {
-                mp4frag.AddPackets(packets, pmt, !isKey && forceSegment);
-                if (!wroteHeader && !mp4frag.GetHeader().empty()) {
-                    wroteHeader = true;
-                    if (fwrite(mp4frag.GetHeader().data(), 1, mp4frag.GetHeader().size(), wfp) != mp4frag.GetHeader().size()) {
+                // E-AC-3 frames of fewer than 6 blocks may be carried into the next fragment, which a job would lose at its start
+                bool parallel = !fragThreads.empty() && wroteHeader && pmt.first_audio_stream_type != EAC3_AUDIO;
+                if (parallel && (atKeyPacket || fragJob)) {
+                    if (!fragJob) {
+                        fragJob.reset(new FRAGMENTATION_JOB);
+                        fragJob->mp4frag = mp4frag;
+                        fragJob->mp4frag.ResetContinuity();
+                        fragJob->state = 0;
+                    }
+                    fragJob->pieces.emplace_back();
+                    fragJob->pieces.back().packets.swap(packets);
+                    fragJob->pieces.back().pmt = pmt;
+                    fragJob->pieces.back().maybeNotEndAtUnitStart = !isKey && forceSegment;
+                    fragJob->pieces.back().fragmentContinues = isChunk;
+                    if (isKey) {
+                        // The next packet is a key
+                        queueJob();
+                    }
+                    return !writeDoneJobs(fragThreads.size() * 2);
+                }
+                if (!fragThreads.empty()) {
+                    // Continue from the end of the jobs
+                    queueJob();
+                    if (!writeDoneJobs(0)) {
                         return true;
                     }
                 }
-                if (fwrite(mp4frag.GetFragments().data(), 1, mp4frag.GetFragments().size(), wfp) != mp4frag.GetFragments().size()) {
+                atKeyPacket = isKey;
+                mp4frag.AddPackets(packets, pmt, !isKey && forceSegment, isChunk);
+                if (!WriteMp4FragmentsWithHeader(wfp, mp4frag, wroteHeader, wroteHeaderVersion, fragSequence)) {
                     return true;
                 }
                 mp4frag.ClearFragments();
@@ -821,12 +1691,27 @@ int main(int argc, char **argv)
             return false;
         });
 
+        if (!fragThreads.empty()) {
+            queueJob();
+            writeDoneJobs(0);
+            {
+                std::lock_guard<std::mutex> lock(fragQueue.lock);
+                fragQueue.closing = true;
+                fragQueue.cond.notify_all();
+            }
+            while (!fragThreads.empty()) {
+                fragThreads.back().join();
+                fragThreads.pop_back();
+            }
+        }
+
         if (syncError) {
             fprintf(stderr, "Warning: %u sync error happened.\n", syncError);
         }
         if (forcedSegmentationError) {
             fprintf(stderr, "Warning: %u forced segmentation happened.\n", forcedSegmentationError);
         }
+        TRACE_DUMP();
         return 0;
     }
 
@@ -841,42 +1726,23 @@ int main(int argc, char **argv)
     const char *signature = destName;
 #endif
 
+    // Pipes are numbered with at least 2 digits
+    int pipeNumberWidth = segNum < 100 ? 2 : segNum < 1000 ? 3 : 4;
     while (segments.size() < 1 + segNum) {
         SEGMENT_CONTEXT seg = {};
+        char pipeId[16];
+        sprintf(pipeId, "%0*d", pipeNumberWidth, static_cast<int>(segments.size()));
 #ifdef _WIN32
-        sprintf(seg.path, "\\\\.\\pipe\\tsmemseg_%s%02d", destName, static_cast<int>(segments.size()));
-        // Create 2 pipes for simultaneous access
-        size_t createdCount = 0;
-        for (; createdCount < 2; ++createdCount) {
-            events.emplace_back(new CManualResetEvent(true));
-            seg.pipes[createdCount].h = CreateNamedPipeA(seg.path, PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED, 0, 2, 48128, 0, 0, nullptr);
-            if (seg.pipes[createdCount].h == INVALID_HANDLE_VALUE) {
-                break;
-            }
-        }
-        if (createdCount < 2) {
-            if (createdCount == 1) {
-                CloseHandle(seg.pipes[0].h);
-            }
-            break;
-        }
+        if (!CreateSegmentPipe(seg, destName, pipeId, events)) {
 #else
-        size_t dirLen = strlen(fifoDir);
-        if ((dirLen ? dirLen + (fifoDir[dirLen - 1] != '/' ? 1 : 0) : 5) + strlen(destName) + 16 >= sizeof(seg.path)) {
-            // path too long
-            break;
-        }
-        sprintf(seg.path, "%s%stsmemseg_%s%02d.fifo", dirLen ? fifoDir : "/tmp/",
-                                                      dirLen && fifoDir[dirLen - 1] != '/' ? "/" : "",
-                                                      destName, static_cast<int>(segments.size()));
-        if (mkfifo(seg.path, S_IRUSR + S_IWUSR + (dirLen ? S_IRGRP + S_IWGRP + S_IROTH + S_IWOTH : 0)) != 0) {
+        if (!CreateSegmentPipe(seg, destName, pipeId, fifoDir)) {
+#endif
             break;
         }
-#endif
         seg.segCount = SEGMENT_COUNT_EMPTY;
         if (!segments.empty()) {
-            seg.buf.assign(signature ? 376 : 188, 0);
-            WriteSegmentHeader(seg.buf, signature, seg.segCount, isMp4, mp4frag.GetFragmentSizes());
+            seg.buf.assign((signature ? 188 : 0) + 188 * GetSegmentHeaderUnitNum(isMp4, mp4frag.GetFragmentSizes().size()), 0);
+            WriteSegmentHeader(seg.buf, signature, seg.segCount, isMp4, 0, false, mp4frag.GetFragmentSizes());
         }
         segments.push_back(std::move(seg));
     }
@@ -885,12 +1751,115 @@ int main(int argc, char **argv)
         fprintf(stderr, "Error: pipe/fifo creation failed.\n");
         return 1;
     }
-    AssignSegmentList(segments.front().buf, signature, segments, 1, false, false, isMp4, mp4frag.GetHeader());
+    // Pipes of the most recent MP4 fragments (parts), each of which can be read individually
+    std::vector<SEGMENT_CONTEXT> partSegments;
+#ifdef _WIN32
+    std::vector<std::unique_ptr<CManualResetEvent>> partEvents;
+#endif
+    while (isMp4 && partSegments.size() < partNum) {
+        SEGMENT_CONTEXT seg = {};
+        char pipeId[16];
+        sprintf(pipeId, "-part%02d", static_cast<int>(partSegments.size() + 1));
+#ifdef _WIN32
+        if (!CreateSegmentPipe(seg, destName, pipeId, partEvents)) {
+#else
+        if (!CreateSegmentPipe(seg, destName, pipeId, fifoDir)) {
+#endif
+            CloseSegments(partSegments);
+            CloseSegments(segments);
+            fprintf(stderr, "Error: pipe/fifo creation failed.\n");
+            return 1;
+        }
+        seg.segCount = SEGMENT_COUNT_EMPTY;
+        seg.buf.assign((signature ? 188 : 0) + 188 * GetSegmentHeaderUnitNum(isMp4, 0), 0);
+        WriteSegmentHeader(seg.buf, signature, seg.segCount, isMp4, 0, false, std::vector<size_t>());
+        partSegments.push_back(std::move(seg));
+    }
+    // Header boxes of the versions referenced by the listed segments, and the latest one
+    MP4_HEADER_MAP mp4Headers;
+    CSegmentList segList;
+    segList.Reset(segments, 1, partSegments);
+    segList.Assign(segments.front().buf, signature, false, false, isMp4, encrypted, mp4Headers, mp4frag.GetHeaderVersion());
+
+    // Listing and segments of MPEG-TS published along with MP4 ones
+    std::vector<SEGMENT_CONTEXT> tsSegments;
+    CSegmentList tsSegList;
+#ifdef _WIN32
+    std::vector<std::unique_ptr<CManualResetEvent>> tsEvents;
+#endif
+    while (isMp4 && dualOutput && tsSegments.size() < 1 + segNum) {
+        SEGMENT_CONTEXT seg = {};
+        char pipeId[16];
+        sprintf(pipeId, "-ts%0*d", pipeNumberWidth, static_cast<int>(tsSegments.size()));
+#ifdef _WIN32
+        if (!CreateSegmentPipe(seg, destName, pipeId, tsEvents)) {
+#else
+        if (!CreateSegmentPipe(seg, destName, pipeId, fifoDir)) {
+#endif
+            CloseSegments(tsSegments);
+            CloseSegments(partSegments);
+            CloseSegments(segments);
+            fprintf(stderr, "Error: pipe/fifo creation failed.\n");
+            return 1;
+        }
+        seg.segCount = SEGMENT_COUNT_EMPTY;
+        if (!tsSegments.empty()) {
+            seg.buf.assign((signature ? 188 : 0) + 188 * GetSegmentHeaderUnitNum(false, 0), 0);
+            WriteSegmentHeader(seg.buf, signature, seg.segCount, false, 0, false, std::vector<size_t>());
+        }
+        tsSegments.push_back(std::move(seg));
+    }
+    if (!tsSegments.empty()) {
+        // MPEG-TS segments are not published to part pipes
+        tsSegList.Reset(tsSegments, 1, std::vector<SEGMENT_CONTEXT>());
+        tsSegList.Assign(tsSegments.front().buf, signature, false, false, false, encrypted, MP4_HEADER_MAP(), 0);
+    }
+
+    // Store for aged segments, which has a slot for each segment (followed by those for MPEG-TS segments with -d)
+    CMappedFile spillFile;
+    // Margin for fragment boxes and the header
+    size_t spillSlotBytes = segMaxBytes + 64 * 1024;
+    size_t spillSlotNum = tsSegments.empty() ? segNum : segNum * 2;
+    if (spillPath[0] && memSegNum < segNum) {
+        if (spillSlotNum > SIZE_MAX / spillSlotBytes || !spillFile.Create(spillPath, spillSlotNum * spillSlotBytes)) {
+            CloseSegments(tsSegments);
+            CloseSegments(partSegments);
+            CloseSegments(segments);
+            fprintf(stderr, "Error: cannot create spill file.\n");
+            return 1;
+        }
+    }
+
+    // Pipe to expose runtime statistics, which is not counted as an access
+    std::vector<SEGMENT_CONTEXT> statsSegments;
+    CRuntimeStats stats;
+    METRICS_HISTOGRAMS hists;
+#ifdef _WIN32
+    std::vector<std::unique_ptr<CManualResetEvent>> statsEvents;
+#endif
+    if (statsEnabled) {
+        SEGMENT_CONTEXT seg = {};
+#ifdef _WIN32
+        if (!CreateSegmentPipe(seg, destName, "-stats", statsEvents)) {
+#else
+        if (!CreateSegmentPipe(seg, destName, "-stats", fifoDir)) {
+#endif
+            CloseSegments(tsSegments);
+            CloseSegments(partSegments);
+            CloseSegments(segments);
+            fprintf(stderr, "Error: pipe/fifo creation failed.\n");
+            return 1;
+        }
+        statsSegments.push_back(std::move(seg));
+    }
 
 #ifndef _WIN32
     struct sigaction sigact = {};
     sigact.sa_handler = SignalHandler;
     g_signalParam = &segments;
+    g_signalStatsParam = &statsSegments;
+    g_signalPartParam = &partSegments;
+    g_signalTsParam = &tsSegments;
     sigaction(SIGHUP, &sigact, nullptr);
     sigaction(SIGINT, &sigact, nullptr);
     sigaction(SIGTERM, &sigact, nullptr);
@@ -899,29 +1868,75 @@ int main(int argc, char **argv)
 #endif
 
     int64_t baseTick = GetMsecTick();
+    // "baseTick" is rebased when the read rate changes
+    const int64_t startTick = baseTick;
     std::recursive_mutex bufLock;
     std::thread closingRunnerThread;
     std::vector<std::thread> threads;
     std::atomic_uint32_t lastAccessTick(static_cast<uint32_t>(baseTick));
+    std::atomic_uint32_t statsAccessTick(static_cast<uint32_t>(baseTick));
+    // Whether pieces are held unconverted (-l)
+    std::atomic_bool conversionSuspended(false);
 
     if (closingCmd[0]) {
         closingRunnerThread = std::thread(ClosingRunner, closingCmd, std::ref(stopEvent), std::ref(lastAccessTick), accessTimeoutMsec);
     }
 
 #ifdef _WIN32
-    // Create a thread for every 20 segments
-    for (size_t i = 0; i < segments.size(); i += 20) {
+    // Create a thread for every SEGMENTS_PER_WORKER segments
+    for (size_t i = 0; i < segments.size(); i += SEGMENTS_PER_WORKER) {
         std::vector<HANDLE> eventsForThread;
         eventsForThread.push_back(stopEvent.Handle());
-        for (size_t j = i * 2; j < (i + 20) * 2 && j < events.size(); ++j) {
+        for (size_t j = i * 2; j < (i + SEGMENTS_PER_WORKER) * 2 && j < events.size(); ++j) {
             eventsForThread.push_back(events[j]->Handle());
         }
-        threads.emplace_back(Worker, segments.data() + i, std::move(eventsForThread), std::ref(bufLock), std::ref(lastAccessTick));
+        threads.emplace_back(Worker, segments.data() + i, std::move(eventsForThread), std::ref(bufLock), std::ref(lastAccessTick), &conversionSuspended, &stats);
+    }
+    if (!statsSegments.empty()) {
+        std::vector<HANDLE> eventsForThread;
+        eventsForThread.push_back(stopEvent.Handle());
+        for (auto it = statsEvents.begin(); it != statsEvents.end(); ++it) {
+            eventsForThread.push_back((*it)->Handle());
+        }
+        threads.emplace_back(Worker, statsSegments.data(), std::move(eventsForThread), std::ref(bufLock), std::ref(statsAccessTick), nullptr, nullptr);
+    }
+    for (size_t i = 0; i < partSegments.size(); i += SEGMENTS_PER_WORKER) {
+        std::vector<HANDLE> eventsForThread;
+        eventsForThread.push_back(stopEvent.Handle());
+        for (size_t j = i * 2; j < (i + SEGMENTS_PER_WORKER) * 2 && j < partEvents.size(); ++j) {
+            eventsForThread.push_back(partEvents[j]->Handle());
+        }
+        threads.emplace_back(Worker, partSegments.data() + i, std::move(eventsForThread), std::ref(bufLock), std::ref(lastAccessTick), &conversionSuspended, &stats);
+    }
+    for (size_t i = 0; i < tsSegments.size(); i += SEGMENTS_PER_WORKER) {
+        std::vector<HANDLE> eventsForThread;
+        eventsForThread.push_back(stopEvent.Handle());
+        for (size_t j = i * 2; j < (i + SEGMENTS_PER_WORKER) * 2 && j < tsEvents.size(); ++j) {
+            eventsForThread.push_back(tsEvents[j]->Handle());
+        }
+        threads.emplace_back(Worker, tsSegments.data() + i, std::move(eventsForThread), std::ref(bufLock), std::ref(lastAccessTick), &conversionSuspended, &stats);
     }
 #else
     // Use one thread
-    threads.emplace_back(Worker, std::ref(segments), std::ref(stopEvent), std::ref(bufLock), std::ref(lastAccessTick));
+    threads.emplace_back(Worker, std::ref(segments), std::ref(stopEvent), std::ref(bufLock), std::ref(lastAccessTick), &conversionSuspended, &stats, progressive);
+    if (!statsSegments.empty()) {
+        threads.emplace_back(Worker, std::ref(statsSegments), std::ref(stopEvent), std::ref(bufLock), std::ref(statsAccessTick), nullptr, nullptr, false);
+    }
+    if (!partSegments.empty()) {
+        threads.emplace_back(Worker, std::ref(partSegments), std::ref(stopEvent), std::ref(bufLock), std::ref(lastAccessTick), &conversionSuspended, &stats, false);
+    }
+    if (!tsSegments.empty()) {
+        threads.emplace_back(Worker, std::ref(tsSegments), std::ref(stopEvent), std::ref(bufLock), std::ref(lastAccessTick), &conversionSuspended, &stats, false);
+    }
 #endif
+    if (!statsSegments.empty()) {
+        threads.emplace_back(StatsRunner, std::ref(statsSegments.front()), signature, std::ref(stopEvent), std::ref(bufLock),
+                             std::cref(stats), startTick);
+    }
+    if (metricsPath[0]) {
+        threads.emplace_back(MetricsRunner, metricsPath, destName, std::cref(segments), std::ref(stopEvent), std::ref(bufLock),
+                             std::cref(stats), std::ref(hists), startTick);
+    }
 
     // Index of the next segment to be overwritten (between 1 and "segNum")
     size_t segIndex = 1;
@@ -929,21 +1944,327 @@ int main(int argc, char **argv)
     uint32_t segCount = 0;
     // The last segment is incomplete
     bool segIncomplete = false;
+    // Number of fragments of the last segment published to part pipes, and the part pipe to be overwritten next
+    size_t partPublishedNum = 0;
+    size_t partRingIndex = 0;
+    // MPEG-TS packets of the last segment not yet published to "tsSegments"
+    std::vector<uint8_t> tsSegPackets;
 
     unsigned int syncError = 0;
     unsigned int forcedSegmentationError = 0;
     int64_t entireDurationMsec = 0;
     int64_t entireDurationFromBaseMsec = 0;
     int64_t durationMsecResidual = 0;
+    // Part of "ptsDiff" already published as segments closed by a header change
+    int64_t splitPtsDiff = 0;
+    CUT_POSITION cutPos;
+    // Pieces not converted yet and the number of segments completed in them (-l)
+    std::deque<HELD_PIECE> heldPieces;
+    size_t heldSegNum = 0;
+    bool heldPiecesDropped = false;
+    bool publishingHeldPieces = false;
+
+    if (hasLastIndexRecord) {
+        // Continue numbering and timelines
+        segCount = lastIndexRecord.segCount;
+        targetDurationMsec = nextTargetDurationMsec;
+        entireDurationMsec = lastIndexRecord.segTimeMsec + lastIndexRecord.segDurationMsec;
+        durationMsecResidual = lastIndexRecord.durationMsecResidual;
+        mp4frag.ResumeTimeline(lastIndexRecord.fragCount, lastIndexRecord.decodeTimeEnd);
+    }
+
+    // Publish the packets before each cut
+    auto publish = [&, isMp4, segNum](bool isKey, bool forceSegment, bool isChunk, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets) -> bool
+    {
+        TRACE_SCOPE("publish");
+        // Pieces held while no pipe was accessed are measured from their release
+        int64_t cutTick = publishingHeldPieces ? GetUsecTick() : readTick;
+        if (!isKey && forceSegment) {
+            ++forcedSegmentationError;
+            stats.Add(CRuntimeStats::FORCED_SEGMENTATIONS);
+        }
+        if (encrypted && !segIncomplete) {
+            // Keys are rotated at the beginning of each segment
+            ENCRYPTION_KEY key;
+            if (ReadKeyFile(keyPath, key)) {
+                // Warn again if the file becomes unreadable later
+                keyFileWarned = false;
+                encryptionKey = key;
+                segmentAes.SetKey(key.key);
+                if (isMp4) {
+                    mp4frag.SetEncryptionKey(key.keyId, key.key, key.iv);
+                }
+            }
+            else if (!keyFileWarned) {
+                fprintf(stderr, "Warning: cannot read key file. Keeping the current key.\n");
+                keyFileWarned = true;
+            }
+        }
+        if (isMp4) {
+            size_t fragNum = mp4frag.GetFragmentSizes().size();
+            mp4frag.AddPackets(packets, pmt, !isKey && forceSegment, isChunk);
+            stats.Set(CRuntimeStats::FRAGMENTER_WARNINGS, mp4frag.GetWarningCount());
+            if (!mp4frag.GetHeader().empty()) {
+                // The header only changes here, so the previous versions are kept as they were last published
+                std::vector<uint8_t> &header = mp4Headers[mp4frag.GetHeaderVersion()];
+                if (header != mp4frag.GetHeader()) {
+                    header = mp4frag.GetHeader();
+                }
+            }
+            for (size_t i = fragNum; i < mp4frag.GetFragmentSizes().size(); ++i) {
+                hists.fragmentSize.Observe(static_cast<double>(mp4frag.GetFragmentSizes()[i]));
+            }
+        }
+        else {
+            hists.fragmentSize.Observe(static_cast<double>(packets.size()));
+        }
+
+        lock_recursive_mutex lock(bufLock);
 
-    ProcessSegmentation(fp, isMp4, targetDurationMsec, nextTargetDurationMsec, targetFragDurationMsec, segMaxBytes, segMaxBytes, syncError,
+        // Write the first "fragNum" MP4 fragments (or the packets) to the current segment
+        auto writeSegment = [&](bool incomplete, int64_t segPtsDiff, size_t fragNum) -> SEGMENT_CONTEXT & {
+            SEGMENT_CONTEXT &seg = segments[segIncomplete ? (segIndex + segNum - 2) % segNum + 1 : segIndex];
+            bool added = !segIncomplete;
+            if (added) {
+                segIndex = segIndex % segNum + 1;
+                seg.segCount = (++segCount) & 0xffffff;
+                seg.partSlot = 0;
+                partPublishedNum = 0;
+                std::copy(encryptionKey.keyId, encryptionKey.keyId + 16, seg.keyId);
+            }
+            segIncomplete = incomplete;
+            seg.incomplete = incomplete;
+            seg.segDurationMsec = static_cast<int>((segPtsDiff + durationMsecResidual) / 90);
+            seg.segTimeMsec = entireDurationMsec;
+            if (!segIncomplete) {
+                durationMsecResidual = (segPtsDiff + durationMsecResidual) % 90;
+                entireDurationMsec += seg.segDurationMsec;
+                if (!publishingHeldPieces) {
+                    entireDurationFromBaseMsec += seg.segDurationMsec;
+                }
+
+                // A segment closed by a header change does not end at a resumable position
+                if (indexFile && fragNum == mp4frag.GetFragmentSizes().size()) {
+                    SEGMENT_INDEX_RECORD record;
+                    record.segCount = segCount;
+                    record.segDurationMsec = seg.segDurationMsec;
+                    record.segTimeMsec = seg.segTimeMsec;
+                    // No cut is made within the prefix, which is read before the first key
+                    int64_t inputOffset = inputFile.Data() ? static_cast<int64_t>(inputStartPos - inputPrefix.size()) : -1;
+                    record.inputPos = inputFile.Data() ? inputOffset + cutPos.inputPos : -1;
+                    record.keyInputPos = inputFile.Data() ? inputOffset + cutPos.keyInputPos : -1;
+                    record.pts = cutPos.pts;
+                    record.fragCount = mp4frag.GetFragmentCount();
+                    record.decodeTimeEnd = mp4frag.GetDecodeTimeEnd();
+                    record.durationMsecResidual = static_cast<int>(durationMsecResidual);
+                    if (!AppendSegmentIndex(indexFile.get(), record)) {
+                        fprintf(stderr, "Warning: failed to write index file.\n");
+                        indexFile.reset();
+                    }
+                }
+            }
+
+            std::vector<size_t> fragSizes(mp4frag.GetFragmentSizes().begin(), mp4frag.GetFragmentSizes().begin() + fragNum);
+            std::vector<uint8_t> &segBuf = SelectWritableSegmentBuffer(seg);
+            segBuf.assign((signature ? 188 : 0) + 188 * GetSegmentHeaderUnitNum(isMp4, fragNum), 0);
+
+            if (isMp4) {
+                seg.fragDurationsMsec.assign(mp4frag.GetFragmentDurationsMsec().begin(), mp4frag.GetFragmentDurationsMsec().begin() + fragNum);
+                seg.headerVersion = fragNum > 0 ? mp4frag.GetFragmentHeaderVersions()[0] : mp4frag.GetHeaderVersion();
+                size_t fragBytes = 0;
+                for (size_t i = 0; i < fragNum; ++i) {
+                    fragBytes += fragSizes[i];
+                }
+                // Limit the total number of fragments
+                size_t undeterminedSize = 0;
+                for (size_t i = seg.fragDurationsMsec.size(); i >= MP4_FRAG_MAX_NUM; --i) {
+                    if (segIncomplete) {
+                        undeterminedSize += fragSizes[i - 1];
+                    }
+                    if (i > MP4_FRAG_MAX_NUM) {
+                        seg.fragDurationsMsec[i - 2] += seg.fragDurationsMsec.back();
+                        seg.fragDurationsMsec.pop_back();
+                    }
+                    else if (segIncomplete) {
+                        // In incomplete state, duration of the limited fragment is undetermined, remote it too
+                        seg.fragDurationsMsec.pop_back();
+                    }
+                }
+                if (fragNum == mp4frag.GetFragmentSizes().size() && mp4frag.IsLastFragmentOpen() && seg.fragDurationsMsec.size() == fragNum) {
+                    // The fragment receiving chunks is not listed until completed, but its chunks are readable
+                    seg.fragDurationsMsec.pop_back();
+                }
+                segBuf.insert(segBuf.end(), mp4frag.GetFragments().begin(), mp4frag.GetFragments().begin() + (fragBytes - undeterminedSize));
+
+                // Publish listed fragments to part pipes, except those merged by the limit
+                size_t fragPos = 0;
+                for (size_t i = 0; i < partPublishedNum; ++i) {
+                    fragPos += fragSizes[i];
+                }
+                for (; !partSegments.empty() && partPublishedNum < std::min(seg.fragDurationsMsec.size(), MP4_FRAG_MAX_NUM - 1); ++partPublishedNum) {
+                    SEGMENT_CONTEXT &part = partSegments[partRingIndex];
+                    if (partPublishedNum == 0) {
+                        seg.partSlot = partRingIndex + 1;
+                    }
+                    part.segCount = seg.segCount;
+                    part.partIndex = partPublishedNum;
+                    std::vector<uint8_t> &partBuf = SelectWritableSegmentBuffer(part);
+                    partBuf.assign((signature ? 188 : 0) + 188 * GetSegmentHeaderUnitNum(isMp4, 1), 0);
+                    partBuf.insert(partBuf.end(), mp4frag.GetFragments().begin() + fragPos,
+                                   mp4frag.GetFragments().begin() + fragPos + fragSizes[partPublishedNum]);
+                    WriteSegmentHeader(partBuf, signature, part.segCount, isMp4, seg.headerVersion, false,
+                                       std::vector<size_t>(1, fragSizes[partPublishedNum]));
+                    WriteUint32(&partBuf[(signature ? 188 : 0) + 20], static_cast<uint32_t>(part.partIndex));
+                    fragPos += fragSizes[partPublishedNum];
+                    partRingIndex = (partRingIndex + 1) % partSegments.size();
+                }
+            }
+            else {
+                size_t headerSize = segBuf.size();
+                if (encrypted) {
+                    // Room for the padding
+                    segBuf.reserve(headerSize + packets.size() + 16);
+                }
+                segBuf.insert(segBuf.end(), packets.begin(), packets.end());
+                if (encrypted) {
+                    EncryptSegment(segBuf, headerSize, segmentAes, seg.segCount);
+                }
+            }
+
+            WriteSegmentHeader(segBuf, signature, seg.segCount, isMp4, seg.headerVersion, segIncomplete, fragSizes);
+            segList.SetNewest(segments, &seg - segments.data(), added, partSegments);
+            if (!segIncomplete) {
+                if (!tsSegments.empty()) {
+                    // The MPEG-TS segment of the same number and timing
+                    SEGMENT_CONTEXT &tsSeg = tsSegments[&seg - segments.data()];
+                    tsSeg.segCount = seg.segCount;
+                    tsSeg.segDurationMsec = seg.segDurationMsec;
+                    tsSeg.segTimeMsec = seg.segTimeMsec;
+                    std::copy(seg.keyId, seg.keyId + 16, tsSeg.keyId);
+                    std::vector<uint8_t> &tsSegBuf = SelectWritableSegmentBuffer(tsSeg);
+                    size_t headerSize = (signature ? 188 : 0) + 188 * GetSegmentHeaderUnitNum(false, 0);
+                    tsSegBuf.reserve(headerSize + tsSegPackets.size() + (encrypted ? 16 : 0));
+                    tsSegBuf.assign(headerSize, 0);
+                    tsSegBuf.insert(tsSegBuf.end(), tsSegPackets.begin(), tsSegPackets.end());
+                    if (encrypted) {
+                        EncryptSegment(tsSegBuf, headerSize, segmentAes, tsSeg.segCount);
+                    }
+                    WriteSegmentHeader(tsSegBuf, signature, tsSeg.segCount, false, 0, false, std::vector<size_t>());
+                    tsSegPackets.clear();
+                    tsSegList.SetNewest(tsSegments, &tsSeg - tsSegments.data(), true, std::vector<SEGMENT_CONTEXT>());
+                    tsSegList.Assign(SelectWritableSegmentBuffer(tsSegments.front()), signature, false, false, false, encrypted, MP4_HEADER_MAP(), 0);
+                }
+                mp4frag.EraseFrontFragments(fragNum);
+                if (spillFile.Data()) {
+                    SpillAgedSegments(segments, spillFile.Data(), spillSlotBytes, segCount, memSegNum);
+                    if (!tsSegments.empty()) {
+                        SpillAgedSegments(tsSegments, spillFile.Data() + segNum * spillSlotBytes, spillSlotBytes, segCount, memSegNum);
+                    }
+                }
+            }
+            return seg;
+        };
+
+        ptsDiff -= splitPtsDiff;
+        if (isMp4) {
+            // Each segment depends on a single header version, so a header change closes the segment
+            const std::vector<uint32_t> &versions = mp4frag.GetFragmentHeaderVersions();
+            size_t changeIndex = std::find_if(versions.begin(), versions.end(),
+                                              [&versions](uint32_t v) { return v != versions.front(); }) - versions.begin();
+            if (changeIndex < versions.size()) {
+                int64_t partPtsDiff = 0;
+                for (size_t i = 0; i < changeIndex; ++i) {
+                    partPtsDiff += mp4frag.GetFragmentDurationsMsec()[i] * 90;
+                }
+                partPtsDiff = std::min(partPtsDiff, ptsDiff);
+                SEGMENT_CONTEXT &seg = writeSegment(false, partPtsDiff, changeIndex);
+                ptsDiff -= partPtsDiff;
+                splitPtsDiff += partPtsDiff;
+                hists.segmentDuration.Observe(seg.segDurationMsec / 1000.0);
+                stats.Add(CRuntimeStats::SEGMENTS);
+            }
+        }
+        if (!tsSegments.empty()) {
+            // A segment closed by a header change above ends at the previous cut for MPEG-TS
+            tsSegPackets.insert(tsSegPackets.end(), packets.begin(), packets.end());
+        }
+        SEGMENT_CONTEXT &seg = writeSegment(!isKey && !forceSegment, ptsDiff, mp4frag.GetFragmentSizes().size());
+        if (!segIncomplete) {
+            splitPtsDiff = 0;
+        }
+        {
+            TRACE_SCOPE("listing update");
+            if (mp4Headers.size() > 1) {
+                // Drop the header boxes no longer referenced by the listed segments
+                uint32_t minVersion = mp4frag.GetHeaderVersion();
+                for (auto it = segments.begin() + 1; it != segments.end(); ++it) {
+                    if (!it->fragDurationsMsec.empty()) {
+                        minVersion = std::min(minVersion, it->headerVersion);
+                    }
+                }
+                mp4Headers.erase(mp4Headers.begin(), mp4Headers.lower_bound(minVersion));
+            }
+            std::vector<uint8_t> &segfrBuf = SelectWritableSegmentBuffer(segments.front());
+            segList.Assign(segfrBuf, signature, false, segIncomplete, isMp4, encrypted, mp4Headers, mp4frag.GetHeaderVersion());
+        }
+
+        int64_t publishTick = GetUsecTick();
+        stats.Add(CRuntimeStats::FRAGMENTS);
+        stats.Set(CRuntimeStats::FRAGMENT_LATENCY_USEC_LAST, publishTick - cutTick);
+        stats.SetMax(CRuntimeStats::FRAGMENT_LATENCY_USEC_MAX, publishTick - cutTick);
+        stats.Add(CRuntimeStats::FRAGMENT_LATENCY_USEC_SUM, publishTick - cutTick);
+        stats.Set(CRuntimeStats::LAST_FRAGMENT_CUT_MSEC, cutTick / 1000 - startTick);
+        hists.publishLatency.Observe((publishTick - cutTick) / 1000000.0);
+        if (!segIncomplete) {
+            hists.segmentDuration.Observe(seg.segDurationMsec / 1000.0);
+            stats.Add(CRuntimeStats::SEGMENTS);
+            stats.Set(CRuntimeStats::SEGMENT_LATENCY_USEC_LAST, publishTick - cutTick);
+            stats.SetMax(CRuntimeStats::SEGMENT_LATENCY_USEC_MAX, publishTick - cutTick);
+            stats.Add(CRuntimeStats::SEGMENT_LATENCY_USEC_SUM, publishTick - cutTick);
+            stats.Set(CRuntimeStats::LAST_SEGMENT_CUT_MSEC, cutTick / 1000 - startTick);
+        }
+        return false;
+    };
+
+    // Publish the pieces held while no pipe was accessed (-l)
+    auto publishHeldPieces = [&]() -> bool {
+        CUT_POSITION currentCutPos = cutPos;
+        publishingHeldPieces = true;
+        for (; !heldPieces.empty(); heldPieces.pop_front()) {
+            HELD_PIECE &piece = heldPieces.front();
+            if (heldPiecesDropped) {
+                // The packets before have been discarded
+                mp4frag.ResetContinuity();
+                heldPiecesDropped = false;
+            }
+            cutPos = piece.cutPos;
+            if (publish(piece.isKey, piece.forceSegment, piece.isChunk, piece.ptsDiff, piece.pmt, piece.packets)) {
+                break;
+            }
+        }
+        publishingHeldPieces = false;
+        cutPos = currentCutPos;
+        heldSegNum = 0;
+        conversionSuspended = !heldPieces.empty();
+        return !heldPieces.empty();
+    };
+
+    ProcessSegmentation(readInput, isMp4, filterPids, targetDurationMsec, nextTargetDurationMsec, targetFragDurationMsec, chunkFrames, segMaxBytes, segMaxBytes, syncError, cutPos,
+        statsEnabled || metricsPath[0] ? &stats : nullptr,
         [&, accessTimeoutMsec, nextReadRatePerMille](int64_t ptsDiff) -> bool
     {
+        int sleptMsec = 0;
         for (;;) {
             int64_t nowTick = GetMsecTick();
             if (accessTimeoutMsec != 0 && static_cast<uint32_t>(nowTick) - lastAccessTick >= accessTimeoutMsec) {
                 return true;
             }
+            if (!heldPieces.empty() && static_cast<uint32_t>(nowTick) - lastAccessTick < lazyTimeoutMsec) {
+                // Resume as soon as accessed, not at the next cut, for readers waiting in WaitForConversionResumed()
+                if (publishHeldPieces()) {
+                    return true;
+                }
+            }
             if (readRatePerMille != nextReadRatePerMille &&
                 std::find_if(segments.begin() + 1, segments.end(),
                     [](const SEGMENT_CONTEXT &a) { return a.segCount == SEGMENT_COUNT_EMPTY; }) == segments.end()) {
@@ -957,77 +2278,77 @@ int main(int argc, char **argv)
                 // Check reading speed
                 if (entireDurationFromBaseMsec + ptsDiff / 90 > (nowTick - baseTick) * readRatePerMille / 1000) {
                     // Too fast
+                    TRACE_SCOPE("read throttle");
                     SleepFor(std::chrono::milliseconds(10));
+                    stats.Add(CRuntimeStats::READ_THROTTLE_MSEC, 10);
+                    sleptMsec += 10;
                     continue;
                 }
             }
             break;
         }
+        if (sleptMsec > 0) {
+            hists.throttleSleep.Observe(sleptMsec / 1000.0);
+        }
         return false;
     },
-        [&, isMp4, segNum](bool isKey, bool forceSegment, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets) -> bool
+        [&, segNum](bool isKey, bool forceSegment, bool isChunk, int64_t ptsDiff, const PMT &pmt, std::vector<uint8_t> &packets) -> bool
     {
-        if (isMp4) {
-            mp4frag.AddPackets(packets, pmt, !isKey && forceSegment);
-        }
-
-        lock_recursive_mutex lock(bufLock);
-
-        SEGMENT_CONTEXT &seg = segments[segIncomplete ? (segIndex + segNum - 2) % segNum + 1 : segIndex];
-        if (!segIncomplete) {
-            segIndex = segIndex % segNum + 1;
-            seg.segCount = (++segCount) & 0xffffff;
-        }
-        segIncomplete = !isKey && !forceSegment;
-        seg.segDurationMsec = static_cast<int>((ptsDiff + durationMsecResidual) / 90);
-        seg.segTimeMsec = entireDurationMsec;
-        if (!segIncomplete) {
-            durationMsecResidual = (ptsDiff + durationMsecResidual) % 90;
-            entireDurationMsec += seg.segDurationMsec;
-            entireDurationFromBaseMsec += seg.segDurationMsec;
-        }
-
-        std::vector<uint8_t> &segBuf = SelectWritableSegmentBuffer(seg);
-        segBuf.assign(signature ? 376 : 188, 0);
-
-        if (isMp4) {
-            seg.fragDurationsMsec = mp4frag.GetFragmentDurationsMsec();
-            // Limit the total number of fragments
-            size_t undeterminedSize = 0;
-            for (size_t i = seg.fragDurationsMsec.size(); i >= MP4_FRAG_MAX_NUM; --i) {
-                if (segIncomplete) {
-                    undeterminedSize += mp4frag.GetFragmentSizes()[i - 1];
-                }
-                if (i > MP4_FRAG_MAX_NUM) {
-                    seg.fragDurationsMsec[i - 2] += seg.fragDurationsMsec.back();
-                    seg.fragDurationsMsec.pop_back();
-                }
-                else if (segIncomplete) {
-                    // In incomplete state, duration of the limited fragment is undetermined, remote it too
-                    seg.fragDurationsMsec.pop_back();
+        if (lazyTimeoutMsec != 0) {
+            // Conversion is suspended only at a segment boundary
+            if (static_cast<uint32_t>(GetMsecTick()) - lastAccessTick >= lazyTimeoutMsec && (!segIncomplete || !heldPieces.empty())) {
+                heldPieces.emplace_back();
+                HELD_PIECE &piece = heldPieces.back();
+                piece.isKey = isKey;
+                piece.forceSegment = forceSegment;
+                piece.isChunk = isChunk;
+                piece.ptsDiff = ptsDiff;
+                piece.pmt = pmt;
+                piece.packets.swap(packets);
+                piece.cutPos = cutPos;
+                conversionSuspended = true;
+                if (isKey || forceSegment) {
+                    // Keep the read rate as if published
+                    entireDurationFromBaseMsec += ptsDiff / 90;
+                    if (++heldSegNum > segNum) {
+                        // Discard the oldest segment, which would be overwritten anyway
+                        for (;;) {
+                            bool segmentEnds = heldPieces.front().isKey || heldPieces.front().forceSegment;
+                            int64_t heldPtsDiff = heldPieces.front().ptsDiff;
+                            heldPieces.pop_front();
+                            if (segmentEnds) {
+                                // As writeSegment() would do
+                                entireDurationMsec += (heldPtsDiff + durationMsecResidual) / 90;
+                                durationMsecResidual = (heldPtsDiff + durationMsecResidual) % 90;
+                                break;
+                            }
+                        }
+                        --heldSegNum;
+                        heldPiecesDropped = true;
+                    }
                 }
+                return false;
+            }
+            if (publishHeldPieces()) {
+                return true;
             }
-            segBuf.insert(segBuf.end(), mp4frag.GetFragments().begin(), mp4frag.GetFragments().end() - undeterminedSize);
-        }
-        else {
-            segBuf.insert(segBuf.end(), packets.begin(), packets.end());
-        }
-
-        WriteSegmentHeader(segBuf, signature, seg.segCount, isMp4, mp4frag.GetFragmentSizes());
-        if (!segIncomplete) {
-            mp4frag.ClearFragments();
         }
-        std::vector<uint8_t> &segfrBuf = SelectWritableSegmentBuffer(segments.front());
-        AssignSegmentList(segfrBuf, signature, segments, segIndex, false, segIncomplete, isMp4, mp4frag.GetHeader());
-        return false;
+        return publish(isKey, forceSegment, isChunk, ptsDiff, pmt, packets);
     });
 
+    if (publishHeldPieces()) {
+        fprintf(stderr, "Warning: failed to publish held segments.\n");
+    }
+
     {
         lock_recursive_mutex lock(bufLock);
 
         // End list
         std::vector<uint8_t> &segfrBuf = SelectWritableSegmentBuffer(segments.front());
-        AssignSegmentList(segfrBuf, signature, segments, segIndex, true, false, isMp4, mp4frag.GetHeader());
+        segList.Assign(segfrBuf, signature, true, false, isMp4, encrypted, mp4Headers, mp4frag.GetHeaderVersion());
+        if (!tsSegments.empty()) {
+            tsSegList.Assign(SelectWritableSegmentBuffer(tsSegments.front()), signature, true, false, false, encrypted, MP4_HEADER_MAP(), 0);
+        }
     }
 
     if (syncError) {
@@ -1047,6 +2368,10 @@ int main(int argc, char **argv)
     if (closingRunnerThread.joinable()) {
         closingRunnerThread.join();
     }
+    CloseSegments(statsSegments);
+    CloseSegments(tsSegments);
+    CloseSegments(partSegments);
     CloseSegments(segments);
+    TRACE_DUMP();
     return 0;
 }
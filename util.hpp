@@ -4,10 +4,17 @@
 #include <stddef.h>
 #include <stdint.h>
 
+constexpr uint8_t MPEG2_VIDEO = 0x02;
+constexpr uint8_t MPEG1_AUDIO = 0x03;
+constexpr uint8_t MPEG2_AUDIO = 0x04;
+constexpr uint8_t PES_PRIVATE_DATA = 0x06;
 constexpr uint8_t ADTS_TRANSPORT = 0x0f;
 constexpr uint8_t PES_ID3_METADATA = 0x15;
 constexpr uint8_t AVC_VIDEO = 0x1b;
 constexpr uint8_t H_265_VIDEO = 0x24;
+// ATSC stream types, also used for DVB streams signaled by descriptors
+constexpr uint8_t AC3_AUDIO = 0x81;
+constexpr uint8_t EAC3_AUDIO = 0x87;
 
 struct PSI
 {
@@ -28,7 +35,9 @@ struct PMT
     int pcr_pid;
     int first_video_stream_type;
     int first_video_pid;
-    int first_adts_audio_pid;
+    // ADTS_TRANSPORT, MPEG1_AUDIO, MPEG2_AUDIO, AC3_AUDIO or EAC3_AUDIO
+    int first_audio_stream_type;
+    int first_audio_pid;
     int first_id3_metadata_pid;
     PSI psi;
 };
@@ -45,7 +54,21 @@ uint32_t calc_crc32(const uint8_t *data, int data_size, uint32_t crc = 0xfffffff
 int extract_psi(PSI *psi, const uint8_t *payload, int payload_size, int unit_start, int counter);
 void extract_pat(PAT *pat, const uint8_t *payload, int payload_size, int unit_start, int counter);
 void extract_pmt(PMT *pmt, const uint8_t *payload, int payload_size, int unit_start, int counter);
-int contains_nal_idr_or_cra(int *nal_state, const uint8_t *payload, int payload_size, bool h_265);
+// Make a PMT section from the last extracted one, listing only the first video, audio and ID3 metadata streams.
+// "dest" must be at least 1024 bytes. Returns the section size, or 0 if the extracted one is not valid.
+int make_filtered_pmt_section(uint8_t *dest, const PMT *pmt);
+// Make a PAT section from the last extracted one, listing only the first program.
+// "dest" must be at least 1024 bytes. Returns the section size, or 0 if the extracted one is not valid.
+int make_filtered_pat_section(uint8_t *dest, const PAT *pat);
+// Specialized on the codec so that the per-byte loop has no branch on it. Instantiated for false (AVC) and true (HEVC).
+template <bool H_265>
+int contains_nal_idr_or_cra(int *nal_state, const uint8_t *payload, int payload_size);
+inline int contains_nal_idr_or_cra(int *nal_state, const uint8_t *payload, int payload_size, bool h_265)
+{
+    return h_265 ? contains_nal_idr_or_cra<true>(nal_state, payload, payload_size) :
+                   contains_nal_idr_or_cra<false>(nal_state, payload, payload_size);
+}
+int contains_mpeg2_sequence_header_or_i_picture(int *mpeg2_state, const uint8_t *payload, int payload_size);
 int get_ts_payload_size(const uint8_t *packet);
 int64_t get_pes_timestamp(const uint8_t *data_5bytes);
 
@@ -74,4 +97,136 @@ inline int read_bits(const uint8_t *data, size_t &pos, int n)
     return r;
 }
 
+// Exp-Golomb ue(v), reads up to 61bits
+inline int read_ueg_bits(const uint8_t *data, size_t &pos)
+{
+    for (int n = 0; n < 31; ++n) {
+        if (read_bool(data, pos)) {
+            return read_bits(data, pos, n) - 1 + (1 << n);
+        }
+    }
+    return 0;
+}
+
+// Exp-Golomb se(v)
+inline int read_seg_bits(const uint8_t *data, size_t &pos)
+{
+    int r = read_ueg_bits(data, pos);
+    return (r >> 1) + (r & 1 ? 1 : -r);
+}
+
+// MSB-first bit reader with a 64-bit cache, which never reads beyond "size" bytes.
+// Reading beyond the end returns 0 and sets the overrun flag.
+class CBitReader
+{
+public:
+    CBitReader(const uint8_t *data, size_t size) : m_data(data), m_size(size), m_bytePos(0), m_cache(0), m_cacheBits(0), m_overrun(false) {}
+
+    // n must be between 0 and 32
+    uint32_t ReadBits(int n) {
+        if (m_cacheBits < n) {
+            Refill();
+            if (m_cacheBits < n) {
+                m_overrun = true;
+                m_cache = 0;
+                m_cacheBits = 0;
+                return 0;
+            }
+        }
+        if (n == 0) {
+            return 0;
+        }
+        uint32_t r = static_cast<uint32_t>(m_cache >> (64 - n));
+        m_cache <<= n;
+        m_cacheBits -= n;
+        return r;
+    }
+    bool ReadBool() { return ReadBits(1) != 0; }
+    void Skip(size_t n) {
+        for (; n > 32; n -= 32) {
+            ReadBits(32);
+        }
+        ReadBits(static_cast<int>(n));
+    }
+    // Exp-Golomb ue(v). Returns 0 and sets the overrun flag if there are more than 31 leading zeros.
+    uint32_t ReadUeg() {
+        if (m_cacheBits < 32) {
+            Refill();
+        }
+        int zeros = m_cache != 0 ? CountLeadingZeros(m_cache) : 64;
+        if (zeros >= m_cacheBits) {
+            // Rare case, the cache is not enough
+            zeros = 0;
+            while (zeros < 32 && !ReadBool() && !m_overrun) {
+                ++zeros;
+            }
+            if (zeros >= 32 || m_overrun) {
+                m_overrun = true;
+                return 0;
+            }
+        }
+        else {
+            if (zeros >= 32) {
+                m_overrun = true;
+                return 0;
+            }
+            ReadBits(zeros + 1);
+        }
+        return ((1U << zeros) | ReadBits(zeros)) - 1;
+    }
+    // Exp-Golomb se(v)
+    int32_t ReadSeg() {
+        uint32_t r = ReadUeg();
+        return r & 1 ? static_cast<int32_t>((r >> 1) + 1) : -static_cast<int32_t>(r >> 1);
+    }
+    bool IsOverrun() const { return m_overrun; }
+    // Bit position from the beginning
+    size_t GetPos() const { return m_bytePos * 8 - m_cacheBits; }
+
+private:
+    void Refill() {
+        if (m_bytePos + 8 <= m_size) {
+            // Load a big-endian word and take as many whole bytes as possible
+            const uint8_t *p = m_data + m_bytePos;
+            uint64_t w = (static_cast<uint64_t>(p[0]) << 56) | (static_cast<uint64_t>(p[1]) << 48) |
+                         (static_cast<uint64_t>(p[2]) << 40) | (static_cast<uint64_t>(p[3]) << 32) |
+                         (static_cast<uint64_t>(p[4]) << 24) | (static_cast<uint64_t>(p[5]) << 16) |
+                         (static_cast<uint64_t>(p[6]) << 8) | p[7];
+            int bytes = (64 - m_cacheBits) >> 3;
+            int bits = m_cacheBits + bytes * 8;
+            m_cache |= (w >> m_cacheBits) & (bits < 64 ? ~((~0ULL) >> bits) : ~0ULL);
+            m_cacheBits = bits;
+            m_bytePos += bytes;
+        }
+        else {
+            while (m_cacheBits <= 56 && m_bytePos < m_size) {
+                m_cache |= static_cast<uint64_t>(m_data[m_bytePos++]) << (56 - m_cacheBits);
+                m_cacheBits += 8;
+            }
+        }
+    }
+    static int CountLeadingZeros(uint64_t v) {
+#ifdef __GNUC__
+        return __builtin_clzll(v);
+#else
+        int n = 0;
+        for (; !(v & 0xff00000000000000ULL); v <<= 8) {
+            n += 8;
+        }
+        for (; !(v & 0x8000000000000000ULL); v <<= 1) {
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    const uint8_t *m_data;
+    size_t m_size;
+    size_t m_bytePos;
+    // Left-aligned, bits below m_cacheBits are 0
+    uint64_t m_cache;
+    int m_cacheBits;
+    bool m_overrun;
+};
+
 #endif